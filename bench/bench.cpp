@@ -0,0 +1,487 @@
+// mvm-bench - runs the workloads in bench/workloads on every execution mode
+// and reports throughput, dispatch cost, assembler speed and peak memory.
+
+#include "../src/mvm.h"
+#include "../src/vector.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#ifdef _MSC_VER
+#include <Windows.h>
+#include <Psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define BENCH_REPS          5
+#define COMPILE_REPS        20
+
+// size of the generated program, kept well inside 16 bit jump offsets
+#define GENERATED_BLOCKS    2500
+
+using bench_clock = std::chrono::steady_clock;
+
+enum Mode {
+    MODE_INTERP,
+    MODE_REGISTER,
+    MODE_JIT,
+    NUM_MODES
+};
+
+static const char* const mode_names[] = { "interp", "register", "jit" };
+
+// Host functions the workloads call, cheap enough that the call is the cost
+static void bind_host_functions() {
+    auto& host = host_functions::defaults();
+    host.bind("bench_mix", [](uint16_t a, uint16_t b) { return (uint16_t)(a * 31 + b); });
+    static uint64_t total = 0;
+    host.bind_batch("bench_count", [](const std::tuple<uint16_t>* calls, size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            total += std::get<0>(calls[i]);
+    });
+}
+
+struct Measurement {
+    bool ok = false;
+    double seconds = 0;         // best of all repetitions
+    uint64_t dispatches = 0;    // 0 when the mode has no dispatch loop
+    long peak_rss_kb = 0;
+};
+
+struct Result {
+    std::string name;
+    size_t source_bytes = 0;
+    double compile_mb_s = 0;
+    double optimize_mb_s = 0;
+    uint64_t instructions = 0;
+    Measurement modes[NUM_MODES];
+};
+
+// Gives the benchmark access to the decoded program so it can count the
+// work a run does without instrumenting the interpreter itself.
+class bench_vm : public mvm {
+public:
+    // Walks the decoded program with plain stack semantics. Returns the
+    // number of bytecode instructions retired and, in 'fused', the dispatches
+    // the superinstruction interpreter makes for the same run.
+    uint64_t count(uint64_t& fused, std::vector<uint64_t>& visits) {
+        std::vector<DATA_TYPE> stack;
+        std::vector<uint8_t> memory(MEMORY_SIZE + MEMORY_SLACK, 0);
+        DATA_TYPE r0 = 0;
+        uint64_t retired = 0;
+        int covered = 0;
+        fused = 0;
+        visits.assign(code.size(), 0);
+
+        size_t i = 0;
+        for (;;) {
+            const auto& insn = code[i];
+            visits[i]++;
+            if (covered > 0) {
+                covered--;
+            } else {
+                fused++;
+                covered = fused_length(insn.opcode) - 1;
+            }
+
+            OpCode op = unfused_opcode(insn.opcode);
+            auto effect = op == TRAP ? stack_effect(op) : effect_of(insn);
+            if (stack.size() < (size_t)effect.pops || op == HALT || op == EXIT || op == TRAP)
+                return retired;
+            retired++;
+
+            DATA_TYPE result;
+            size_t next = i + 1;
+            switch (op) {
+                case PUSH:
+                    stack.push_back(insn.arg);
+                    break;
+                case LOAD:
+                    stack.push_back(r0);
+                    break;
+                case POP:
+                    r0 = stack.back();
+                    stack.pop_back();
+                    break;
+                case CALL:
+                    // the results don't steer any workload, zeros will do
+                    stack.resize(stack.size() - effect.pops);
+                    stack.resize(stack.size() + effect.pushes, 0);
+                    break;
+                case NEG:
+                    stack.back() = (DATA_TYPE)~stack.back();
+                    break;
+                case LOADM:
+                    stack.back() = load_word<DATA_TYPE>(memory.data(), stack.back());
+                    break;
+                case STOREM:
+                    store_word<DATA_TYPE>(memory.data(), stack.back(), stack[stack.size() - 2]);
+                    stack.resize(stack.size() - 2);
+                    break;
+                case LOADX:
+                    stack.push_back(load_word<DATA_TYPE>(memory.data(), (DATA_TYPE)(insn.arg + r0)));
+                    break;
+                case STOREX:
+                    store_word<DATA_TYPE>(memory.data(), (DATA_TYPE)(insn.arg + r0), stack.back());
+                    stack.pop_back();
+                    break;
+                case MFILL: case MCOPY: case VADD: case VSUB: case VMUL: case VAND: case VOR: case VXOR:
+                case VEQ: case VLT: case VGT: case VSUM: case VMIN: case VMAX:
+                    result = vector_op<DATA_TYPE>(memory.data(), op, &stack[stack.size() - effect.pops]);
+                    stack.resize(stack.size() - effect.pops);
+                    if (effect.pushes)
+                        stack.push_back(result);
+                    break;
+                case JMP:
+                    next = insn.target;
+                    break;
+                case JMPZ: case JMPNZ:
+                    if ((stack.back() == 0) == (op == JMPZ)) {
+                        stack.pop_back();
+                        next = insn.target;
+                    }
+                    break;
+                case NOP: case PRINT:
+                    break;
+                default:
+                    if (!fold_binary(op, stack.back(), stack[stack.size() - 2], result))
+                        return retired;
+                    stack.pop_back();
+                    stack.back() = result;
+                    break;
+            }
+            if (next != i + 1)
+                covered = 0;
+            i = next;
+        }
+    }
+
+    // Dispatches of the register tier. Its code between two block entries
+    // is straight-line, so each block runs as often as its leader did.
+    uint64_t register_dispatches(const std::vector<uint64_t>& visits) {
+        if (!translate_registers())
+            return 0;
+        uint64_t total = 0;
+        for (size_t k = 0; k < reg_entries.size(); ++k) {
+            size_t end = k + 1 < reg_entries.size() ? reg_entries[k + 1].index : rcode.size();
+            size_t leader = 0;
+            while (leader < code.size() && code[leader].pc != reg_entries[k].pc)
+                ++leader;
+            if (leader < code.size())
+                total += (end - reg_entries[k].index) * visits[leader];
+        }
+        return total;
+    }
+
+    // everything a mode needs before the timed run
+    bool prepare(Mode mode) {
+        switch (mode) {
+            case MODE_REGISTER:
+                return translate_registers();
+            case MODE_JIT:
+                return compile_jit();
+            default:
+                return true;
+        }
+    }
+
+    bool run(Mode mode) {
+        RunStatus status;
+        switch (mode) {
+            case MODE_REGISTER:
+                status = start_registers();
+                break;
+            case MODE_JIT:
+                status = start_jit();
+                break;
+            default:
+                status = start();
+                break;
+        }
+        return status != RUN_UNSUPPORTED && status != RUN_TRAP;
+    }
+};
+
+#ifdef _MSC_VER
+#define NULL_DEVICE         "NUL"
+#else
+#define NULL_DEVICE         "/dev/null"
+#endif
+
+// Discards whatever still goes to cout, so the runs time the VM and not the
+// terminal. PRINT itself is formatted and written to the null device.
+class null_buffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+};
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Best wall time of 'reps' runs, each on a freshly loaded VM
+static bool time_mode(const std::string& binary, Mode mode, int reps, double& best) {
+    null_buffer null;
+    auto saved = cout.rdbuf(&null);
+    FILE* sink_file = fopen(NULL_DEVICE, "wb");
+    if (!sink_file)
+        return false;
+    bool ok = true;
+    best = 0;
+    for (int rep = 0; rep < reps && ok; ++rep) {
+        buffered_sink sink(sink_file);
+        bench_vm vm;
+        vm.set_output(&sink);
+        ok = vm.load(binary) && vm.prepare(mode);
+        if (!ok)
+            break;
+        auto start = bench_clock::now();
+        ok = vm.run(mode);
+        double t = seconds_since(start);
+        if (rep == 0 || t < best)
+            best = t;
+    }
+    cout.rdbuf(saved);
+    fclose(sink_file);
+    return ok;
+}
+
+// Runs one mode in a child process so its peak RSS is its own
+static Measurement measure(const std::string& binary, Mode mode, int reps) {
+    Measurement m;
+#ifdef _MSC_VER
+    // no fork, the peak covers every run so far
+    m.ok = time_mode(binary, mode, reps, m.seconds);
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        m.peak_rss_kb = (long)(counters.PeakWorkingSetSize / 1024);
+#else
+    int fds[2];
+    if (pipe(fds) != 0)
+        return m;
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        double seconds = 0;
+        bool ok = time_mode(binary, mode, reps, seconds);
+        if (ok && write(fds[1], &seconds, sizeof(seconds)) != sizeof(seconds))
+            ok = false;
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return m;
+    }
+    m.ok = read(fds[0], &m.seconds, sizeof(m.seconds)) == sizeof(m.seconds);
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    m.ok = m.ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    m.peak_rss_kb = usage.ru_maxrss;
+#endif
+    return m;
+}
+
+// Assembler throughput in MB of source per second
+static double compile_speed(const std::string& source, const std::string& binary, size_t bytes, bool optimize) {
+    mvm vm;
+    auto start = bench_clock::now();
+    for (int rep = 0; rep < COMPILE_REPS; ++rep) {
+        if (!vm.compile(source, binary, optimize))
+            return 0;
+    }
+    return bytes * COMPILE_REPS / seconds_since(start) / 1e6;
+}
+
+// Large straight-line program with a jump between every block, for the
+// assembler and for code that doesn't fit the caches as well.
+static void generate(const std::string& path) {
+    std::ofstream out(path);
+    out << "PUSH 0\n";
+    for (int i = 0; i < GENERATED_BLOCKS; ++i) {
+        out << "b" << i << ":\n";
+        out << "PUSH " << (i * 7 + 1) % 1000 << "\n";
+        out << "ADD\n";
+        out << "PUSH " << i % 13 + 1 << "\n";
+        out << "XOR\n";
+        out << "JMP b" << i + 1 << "\n";
+    }
+    out << "b" << GENERATED_BLOCKS << ":\n";
+    out << "POP\n";
+}
+
+static Result run_workload(const std::string& name, const std::string& source, const std::string& binary, int reps) {
+    Result r;
+    r.name = name;
+    {
+        std::ifstream in(source, std::ios::binary | std::ios::ate);
+        r.source_bytes = in.good() ? (size_t)in.tellg() : 0;
+    }
+    r.optimize_mb_s = compile_speed(source, binary, r.source_bytes, true);
+    r.compile_mb_s = compile_speed(source, binary, r.source_bytes, false);
+
+    bench_vm vm;
+    if (!vm.load(binary))
+        return r;
+    uint64_t fused = 0;
+    std::vector<uint64_t> visits;
+    r.instructions = vm.count(fused, visits);
+
+    for (int mode = 0; mode < NUM_MODES; ++mode) {
+        r.modes[mode] = measure(binary, (Mode)mode, reps);
+        if (mode == MODE_INTERP)
+            r.modes[mode].dispatches = fused;
+        else if (mode == MODE_REGISTER)
+            r.modes[mode].dispatches = vm.register_dispatches(visits);
+    }
+    return r;
+}
+
+static std::vector<std::string> list_workloads(const std::string& dir) {
+    std::vector<std::string> names;
+#ifdef _MSC_VER
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((dir + "\\*.mvms").c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            names.push_back(data.cFileName);
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            if (name.size() > 5 && name.substr(name.size() - 5) == ".mvms")
+                names.push_back(name);
+        }
+        closedir(d);
+    }
+#endif
+    for (auto& name : names)
+        name = name.substr(0, name.size() - 5);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static void print_table(const std::vector<Result>& results) {
+    printf("%-10s %-9s %12s %10s %10s %12s %10s %11s\n",
+        "workload", "mode", "insns", "time ms", "Minsn/s", "ns/dispatch", "compile", "peak RSS");
+    for (auto& r : results) {
+        for (int mode = 0; mode < NUM_MODES; ++mode) {
+            const auto& m = r.modes[mode];
+            if (!m.ok) {
+                printf("%-10s %-9s %12s\n", r.name.c_str(), mode_names[mode], "n/a");
+                continue;
+            }
+            char dispatch[32] = "-";
+            if (m.dispatches)
+                snprintf(dispatch, sizeof(dispatch), "%.2f", m.seconds * 1e9 / m.dispatches);
+            printf("%-10s %-9s %12llu %10.2f %10.1f %12s %7.1fMB/s %8ld KiB\n",
+                r.name.c_str(), mode_names[mode], (unsigned long long)r.instructions,
+                m.seconds * 1e3, r.instructions / m.seconds / 1e6, dispatch,
+                r.compile_mb_s, m.peak_rss_kb);
+        }
+    }
+}
+
+static void print_json(const std::vector<Result>& results) {
+    std::ostringstream out;
+    out << "{\n  \"workloads\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto& r = results[i];
+        out << (i ? "," : "") << "\n    {\n";
+        out << "      \"name\": \"" << r.name << "\",\n";
+        out << "      \"source_bytes\": " << r.source_bytes << ",\n";
+        out << "      \"compile_mb_s\": " << r.compile_mb_s << ",\n";
+        out << "      \"optimize_mb_s\": " << r.optimize_mb_s << ",\n";
+        out << "      \"instructions\": " << r.instructions << ",\n";
+        out << "      \"modes\": {";
+        for (int mode = 0; mode < NUM_MODES; ++mode) {
+            const auto& m = r.modes[mode];
+            out << (mode ? "," : "") << "\n        \"" << mode_names[mode] << "\": ";
+            if (!m.ok) {
+                out << "null";
+                continue;
+            }
+            out << "{ \"seconds\": " << m.seconds;
+            out << ", \"insns_per_sec\": " << r.instructions / m.seconds;
+            out << ", \"dispatches\": " << m.dispatches;
+            out << ", \"ns_per_dispatch\": ";
+            if (m.dispatches)
+                out << m.seconds * 1e9 / m.dispatches;
+            else
+                out << "null";
+            out << ", \"peak_rss_kb\": " << m.peak_rss_kb << " }";
+        }
+        out << "\n      }\n    }";
+    }
+    out << "\n  ]\n}\n";
+    cout << out.str();
+}
+
+int main(int argc, char** argv) {
+    std::string dir = "bench/workloads";
+    std::string filter;
+    bool json = false;
+    int reps = BENCH_REPS;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--json"))
+            json = true;
+        else if (!strcmp(argv[i], "--reps") && i + 1 < argc)
+            reps = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--dir") && i + 1 < argc)
+            dir = argv[++i];
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+            filter = argv[++i];
+        else {
+            cout << "mvm-bench - Minimal Virtual Machine benchmarks\n";
+            cout << "\n\tmvm-bench [--json] [--reps <n>] [--dir <workloads>] [--filter <name>]\n\n";
+            return -1;
+        }
+    }
+
+    bind_host_functions();
+    std::vector<std::string> names = list_workloads(dir);
+    if (names.empty()) {
+        cerr << "No workloads found in '" << dir << "'!\n";
+        return -1;
+    }
+    names.push_back("generated");
+
+    std::vector<Result> results;
+    for (auto& name : names) {
+        if (!filter.empty() && name.find(filter) == std::string::npos)
+            continue;
+        std::string source = dir + "/" + name + ".mvms";
+        std::string binary = name + ".bench.mvmb";
+        if (name == "generated") {
+            source = "generated.bench.mvms";
+            generate(source);
+        }
+        results.push_back(run_workload(name, source, binary, reps));
+        remove(binary.c_str());
+        if (name == "generated")
+            remove(source.c_str());
+    }
+
+    if (json)
+        print_json(results);
+    else
+        print_table(results);
+    return 0;
+}
@@ -0,0 +1,247 @@
+#include "native.h"
+
+#include <cstddef>
+#include <fstream>
+
+#ifndef _MSC_VER
+#include <sys/stat.h>
+#endif
+
+// Fixed load addresses of the two segments of a generated executable.
+#define AOT_TEXT_ADDR   0x400000ull
+#define AOT_BSS_ADDR    0x600000ull
+
+// .bss layout: NativeState, the running flag, the operand stack, then the
+// guest memory at the first page boundary after it
+#define AOT_RUNNING_OFF 64
+#define AOT_STACK_OFF   128
+#define AOT_PAGE        0x1000ull
+
+static_assert(sizeof(NativeState) <= AOT_RUNNING_OFF, "NativeState overlaps the running flag");
+
+// Linux x86-64 system call numbers used by the runtime
+#define SYS_WRITE       1
+#define SYS_NANOSLEEP   35
+#define SYS_EXIT_GROUP  231
+
+#pragma pack(push, 1)
+struct ElfHeader {
+    uint8_t  ident[16];
+    uint16_t type, machine;
+    uint32_t version;
+    uint64_t entry, phoff, shoff;
+    uint32_t flags;
+    uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+struct ElfProgramHeader {
+    uint32_t type, flags;
+    uint64_t offset, vaddr, paddr, filesz, memsz, align;
+};
+#pragma pack(pop)
+
+// Each trap message is a length byte followed by the text, padded to 32 bytes
+// so _start can index them by status.
+static void emit_messages(X64Emitter& e) {
+    for (int status = NATIVE_UNDERFLOW; status <= NATIVE_INVALID_CALL; ++status) {
+        std::string msg = native_status_message(status);
+        msg += "\n";
+        uint8_t record[32] = {};
+        record[0] = (uint8_t)msg.size();
+        memcpy(record + 1, msg.data(), msg.size());
+        e.bytes(record, sizeof(record));
+    }
+}
+
+// void print(NativeState*, uint32_t value): writes "PRINT <value>\n" to stdout
+// with a single write. There is no buffer to flush at exit this way.
+static void emit_print(X64Emitter& e) {
+    e.alu_r64_imm8(ALU_SUB, RSP, 32);
+    e.mov_r32_r32(RAX, RSI);
+    e.lea_r64_m(R8, RSP, 31);
+    e.mov_m8_imm(R8, 0, '\n');
+    e.mov_r32_imm(RCX, 10);
+    size_t digits = e.size();
+    e.alu_r32_r32(ALU_XOR, RDX, RDX);
+    e.div_r32(RCX);
+    e.alu_r32_imm(ALU_ADD, RDX, '0');
+    e.alu_r64_imm8(ALU_SUB, R8, 1);
+    e.mov_m8_r(R8, 0, RDX);
+    e.test_r32_r32(RAX, RAX);
+    e.jcc_rel32(CC_NE, digits);
+    e.alu_r64_imm8(ALU_SUB, R8, 6);
+    e.mov_m32_imm(R8, 0, 'P' | 'R' << 8 | 'I' << 16 | (uint32_t)'N' << 24);
+    e.mov_m16_imm(R8, 4, 'T' | ' ' << 8);
+    e.mov_r32_imm(RAX, SYS_WRITE);
+    e.mov_r32_imm(RDI, 1);
+    e.mov_r64_r64(RSI, R8);
+    e.lea_r64_m(RDX, RSP, 32);
+    e.alu_r64_r64(ALU_SUB, RDX, R8);
+    e.syscall();
+    e.alu_r64_imm8(ALU_ADD, RSP, 32);
+    e.ret();
+}
+
+// uint32_t call(NativeState*, uint32_t index, uint16_t* args): every import
+// is __sleep, which becomes nanosleep(args[0] seconds).
+static void emit_call(X64Emitter& e) {
+    e.movzx_r32_m16(RDX, RDX, 0);
+    e.alu_r64_imm8(ALU_SUB, RSP, 16);
+    e.mov_m64_r(RSP, 0, RDX);
+    e.mov_m64_imm(RSP, 8, 0);
+    e.mov_r32_imm(RAX, SYS_NANOSLEEP);
+    e.mov_r64_r64(RDI, RSP);
+    e.alu_r32_r32(ALU_XOR, RSI, RSI);
+    e.syscall();
+    e.alu_r64_imm8(ALU_ADD, RSP, 16);
+    e.mov_r32_imm(RAX, 1);
+    e.ret();
+}
+
+// void halt(NativeState*)
+static void emit_halt(X64Emitter& e) {
+    e.mov_r64_m(RAX, RDI, offsetof(NativeState, running));
+    e.mov_m8_imm(RAX, 0, 0);
+    e.ret();
+}
+
+// _start: set up NativeState in .bss, run the program from its first
+// instruction and turn the returned status into an exit code.
+static uint64_t memory_offset(size_t stack_depth) {
+    uint64_t stack_end = AOT_STACK_OFF + (stack_depth + 1) * DATA_SIZE;
+    return (stack_end + AOT_PAGE - 1) & ~(AOT_PAGE - 1);
+}
+
+static void emit_start(X64Emitter& e, uint64_t text, size_t messages, size_t entry, size_t first, size_t stack_depth) {
+    e.mov_r64_imm(RDI, AOT_BSS_ADDR);
+    e.mov_r64_imm(RAX, AOT_BSS_ADDR + AOT_STACK_OFF);
+    e.mov_m64_r(RDI, offsetof(NativeState, base), RAX);
+    e.mov_m64_r(RDI, offsetof(NativeState, sp), RAX);
+    e.mov_r64_imm(RAX, AOT_BSS_ADDR + AOT_STACK_OFF + stack_depth * DATA_SIZE);
+    e.mov_m64_r(RDI, offsetof(NativeState, limit), RAX);
+    e.mov_r64_imm(RAX, AOT_BSS_ADDR + AOT_RUNNING_OFF);
+    e.mov_m64_r(RDI, offsetof(NativeState, running), RAX);
+    e.mov_m8_imm(RAX, 0, 1);
+    e.mov_r64_imm(RAX, AOT_BSS_ADDR + memory_offset(stack_depth));
+    e.mov_m64_r(RDI, offsetof(NativeState, memory), RAX);
+    e.mov_r64_imm(RSI, text + first);
+    e.call_rel32(entry);
+
+    e.alu_r32_imm(ALU_CMP, RAX, NATIVE_STOPPED);
+    size_t ok = e.jcc_rel32(CC_BE);
+    e.alu_r32_imm(ALU_SUB, RAX, NATIVE_UNDERFLOW);
+    e.shl_r64_imm(RAX, 5);
+    e.mov_r64_imm(RSI, text + messages);
+    e.alu_r64_r64(ALU_ADD, RSI, RAX);
+    e.movzx_r32_m8(RDX, RSI, 0);
+    e.alu_r64_imm8(ALU_ADD, RSI, 1);
+    e.mov_r32_imm(RDI, 2);
+    e.mov_r32_imm(RAX, SYS_WRITE);
+    e.syscall();
+    e.mov_r32_imm(RDI, 1);
+    size_t done = e.jmp_rel32();
+    e.patch_rel32(ok, e.size());
+    e.alu_r32_r32(ALU_XOR, RDI, RDI);
+    e.patch_rel32(done, e.size());
+    e.mov_r32_imm(RAX, SYS_EXIT_GROUP);
+    e.syscall();
+}
+
+// Compiles a binary to a static x86-64 Linux executable. The program is
+// lowered exactly like the JIT does, with the runtime helpers written out as
+// raw syscalls so the result has no dependencies at all.
+template <class Word>
+bool basic_mvm<Word>::compile_native(std::string path, std::string output) {
+    if (path.empty() || output.empty())
+        return false;
+
+    // the lowering only knows 16-bit words, load() says so for the others
+    mvm vm(stack_depth);
+    vm.set_host_functions(host);
+    if (!vm.load(path)) {
+        cerr << vm.last_error() << endl;
+        return false;
+    }
+    // host functions are C++ in this process, only __sleep has a syscall
+    for (auto& f : vm.calls) {
+        if (f.bound() && !f.parks) {
+            cerr << "'" << path << "' calls host functions, which native executables don't support\n";
+            return false;
+        }
+    }
+
+    const size_t headers = sizeof(ElfHeader) + 2 * sizeof(ElfProgramHeader);
+    const uint64_t text = AOT_TEXT_ADDR + headers;
+
+    X64Emitter e;
+    size_t messages = e.size();
+    emit_messages(e);
+    size_t helpers[3];
+    helpers[HELPER_PRINT] = e.size();
+    emit_print(e);
+    helpers[HELPER_CALL] = e.size();
+    emit_call(e);
+    helpers[HELPER_HALT] = e.size();
+    emit_halt(e);
+
+    size_t entry = e.size();
+    std::vector<uint32_t> labels;
+    // the vector kernels are C++, there is no runtime to link them from
+    bool ok = lower_x64(e, vm.code, vm.call_effects(), labels, [&](NativeHelper helper) {
+        if (helper == HELPER_VECTOR)
+            return false;
+        e.call_rel32(helpers[helper]);
+        return true;
+    });
+    if (!ok) {
+        cerr << "'" << path << "' uses bulk memory opcodes, which native executables don't support\n";
+        return false;
+    }
+
+    size_t first = 0;
+    while (vm.code[first].pc != vm.pc && vm.code[first].opcode != EXIT)
+        ++first;
+
+    size_t start = e.size();
+    emit_start(e, text, messages, entry, labels[first], stack_depth);
+
+    ElfHeader eh = {};
+    memcpy(eh.ident, "\x7f" "ELF\x02\x01\x01", 7);
+    eh.type = 2;            // ET_EXEC
+    eh.machine = 62;        // EM_X86_64
+    eh.version = 1;
+    eh.entry = text + start;
+    eh.phoff = sizeof(ElfHeader);
+    eh.ehsize = sizeof(ElfHeader);
+    eh.phentsize = sizeof(ElfProgramHeader);
+    eh.phnum = 2;
+
+    ElfProgramHeader ph[2] = {};
+    ph[0].type = 1;         // PT_LOAD
+    ph[0].flags = 5;        // R+X
+    ph[0].vaddr = ph[0].paddr = AOT_TEXT_ADDR;
+    ph[0].filesz = ph[0].memsz = headers + e.size();
+    ph[0].align = 0x1000;
+    ph[1].type = 1;
+    ph[1].flags = 6;        // R+W
+    ph[1].vaddr = ph[1].paddr = AOT_BSS_ADDR;
+    ph[1].memsz = memory_offset(stack_depth) + MEMORY_SIZE + MEMORY_SLACK;
+    ph[1].align = 0x1000;
+
+    std::ofstream out(output, std::ios::binary);
+    if (!out.good())
+        return false;
+    out.write(reinterpret_cast<char*>(&eh), sizeof(eh));
+    out.write(reinterpret_cast<char*>(ph), sizeof(ph));
+    out.write(reinterpret_cast<char*>(e.buf.data()), e.size());
+    out.close();
+
+#ifndef _MSC_VER
+    chmod(output.c_str(), 0755);
+#endif
+    return out.good();
+}
+
+#define INSTANTIATE(W)                                                          \
+    template bool basic_mvm<W>::compile_native(std::string, std::string);
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
@@ -0,0 +1,320 @@
+#include "mvm.h"
+#include "optimizer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+struct Mnemonic {
+    std::string_view name;
+    OpCode opcode;
+};
+
+#define MNEMONIC(o, a)      { #o, o },
+static constexpr Mnemonic mnemonics[] = { MVM_MNEMONICS(MNEMONIC) };
+#undef MNEMONIC
+
+// Perfect hash over the mnemonics. The multipliers were searched for so no
+// two of them share a slot, the static_assert below checks that still holds.
+#define MNEMONIC_SLOTS      128
+
+static constexpr uint32_t mnemonic_hash(std::string_view s) {
+    return ((uint32_t)s[0] + (uint32_t)s[1] + 5 * (uint32_t)s[s.size() - 2] + 15 * (uint32_t)s.back() +
+            27 * (uint32_t)s.size()) % MNEMONIC_SLOTS;
+}
+
+struct MnemonicTable {
+    int8_t slot[MNEMONIC_SLOTS];
+    bool perfect;
+};
+
+static constexpr MnemonicTable make_mnemonic_table() {
+    MnemonicTable table = {};
+    for (auto& slot : table.slot)
+        slot = -1;
+    table.perfect = true;
+    for (size_t i = 0; i < sizeof(mnemonics) / sizeof(*mnemonics); ++i) {
+        uint32_t h = mnemonic_hash(mnemonics[i].name);
+        if (table.slot[h] >= 0)
+            table.perfect = false;
+        table.slot[h] = (int8_t)i;
+    }
+    return table;
+}
+
+static constexpr MnemonicTable mnemonic_table = make_mnemonic_table();
+static_assert(mnemonic_table.perfect, "mnemonics collide, mnemonic_hash needs new multipliers");
+
+// One hash and one compare; every mnemonic is at least two characters long
+static bool find_opcode(std::string_view name, OpCode& opcode) {
+    if (name.size() < 2)
+        return false;
+    int i = mnemonic_table.slot[mnemonic_hash(name)];
+    if (i < 0 || mnemonics[i].name != name)
+        return false;
+    opcode = mnemonics[i].opcode;
+    return true;
+}
+
+// Leading digits of 'text', wrapping like the word of 'bits' it ends up in
+static uint64_t parse_number(std::string_view text, unsigned bits) {
+    uint64_t value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9')
+            break;
+        value = value * 10 + (c - '0');
+    }
+    return bits < 64 ? value & ((1ull << bits) - 1) : value;
+}
+
+// Assembles in a single pass over the mapped source. Label operands are
+// recorded as fixups and patched once every label is known; the bytecode is
+// built in memory and written out in one go. A ".width 16|32|64" line ahead
+// of the first instruction sets the word size of the binary.
+//
+// CALL takes the name of a host function or an index into the import table.
+// ".import <name> <params> <results>" declares a function the table starts
+// with; names nothing declared are looked up among the host functions and
+// added behind them. Sources that name no function get no table and CALL 0
+// is __sleep.
+template <class Word>
+bool basic_mvm<Word>::compile(std::string path, std::string output, bool optimize) const {
+    if (path.empty() || output.empty())
+        return false;
+
+    auto source = mapped_file::open(path);
+    if (!source)
+        return false;
+    ByteSpan text = source->bytes();
+
+    // the same source assembled the same way before, by any process
+    uint64_t key = 0;
+    if (cache) {
+        key = cache_key().add(CACHE_VERSION).add(text).add(word_bits).add(optimize).add(stack_depth)
+                  .add(host->fingerprint()).value();
+        std::shared_ptr<mapped_file> artifact;
+        ByteSpan binary = cache->get(CACHE_BYTECODE, key, artifact);
+        if (!binary.empty())
+            return write_file(output, binary);
+    }
+
+    std::vector<AsmInstruction> insns;
+    insns.reserve(text.size() / 6);
+    std::unordered_map<std::string_view, int32_t> label_index;
+    std::vector<std::pair<size_t, std::string_view>> label_refs;
+    std::vector<ImportedFunction> imports;
+    std::vector<std::pair<size_t, std::string_view>> call_refs;
+
+    unsigned width = word_bits;
+    const char* p = text.data();
+    const char* end = p + text.size();
+    uint32_t line_no = 0;
+    while (p < end) {
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        std::string_view line(p, eol - p);
+        p = eol == end ? end : eol + 1;
+        ++line_no;
+
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line.empty() || line.find('#') != std::string_view::npos)
+            continue;
+
+        if (line.substr(0, 8) == ".import ") {
+            // name, parameters and results, one space apart
+            std::string_view rest = line.substr(8);
+            size_t a = rest.find(' '), b = a == std::string_view::npos ? a : rest.find(' ', a + 1);
+            if (b == std::string_view::npos || a == 0 || !isdigit((unsigned char)rest[a + 1]) ||
+                b + 1 >= rest.size() || !isdigit((unsigned char)rest[b + 1])) {
+                cerr << path << ":" << line_no << ": Invalid directive: " << line << endl;
+                return false;
+            }
+            std::string name(rest.substr(0, a));
+            for (auto& import : imports) {
+                if (import.name == name) {
+                    cerr << path << ":" << line_no << ": Duplicate import: " << name << endl;
+                    return false;
+                }
+            }
+            imports.push_back({ name, (unsigned)parse_number(rest.substr(a + 1), 16),
+                                (unsigned)parse_number(rest.substr(b + 1), 16) });
+            continue;
+        }
+        if (line[0] == '.') {
+            if (line.substr(0, 7) != ".width " || !insns.empty()) {
+                cerr << path << ":" << line_no << ": Invalid directive: " << line << endl;
+                return false;
+            }
+            width = (unsigned)parse_number(line.substr(7), 32);
+            if (width != 16 && width != 32 && width != 64) {
+                cerr << path << ":" << line_no << ": Unsupported word size: " << width << endl;
+                return false;
+            }
+            continue;
+        }
+
+        if (line.back() == ':') {
+            // This is a label definition
+            std::string_view label_name = line.substr(0, line.size() - 1);
+            if (!label_index.emplace(label_name, (int32_t)insns.size()).second) {
+                cerr << path << ":" << line_no << ": Duplicate label name: " << label_name << endl;
+                return false;
+            }
+            continue;
+        }
+
+        AsmInstruction insn = { NOP, 0, -1, line_no };
+        size_t space_pos = line.find(' ');
+        std::string_view opcode_str = line.substr(0, space_pos);
+        if (space_pos != std::string_view::npos) {
+            std::string_view operand = line.substr(space_pos + 1);
+            if (!operand.empty() && isdigit((unsigned char)operand[0]))
+                insn.arg = parse_number(operand, width);
+            else if (opcode_str == "CALL")
+                call_refs.push_back({ insns.size(), operand });
+            else // Label reference
+                label_refs.push_back({ insns.size(), operand });
+        }
+
+        if (!find_opcode(opcode_str, insn.opcode)) {
+            cerr << path << ":" << line_no << ": Invalid opcode: " << opcode_str << endl;
+            return false;
+        }
+        insns.push_back(insn);
+    }
+
+    for (auto& ref : call_refs) {
+        size_t index = 0;
+        while (index < imports.size() && imports[index].name != ref.second)
+            ++index;
+        if (index == imports.size()) {
+            const HostFunction* fn = host->find(ref.second);
+            if (!fn) {
+                cerr << path << ":" << insns[ref.first].line << ": Unknown host function: " << ref.second << endl;
+                return false;
+            }
+            imports.push_back({ fn->name, fn->params, fn->results });
+        }
+        insns[ref.first].arg = index;
+    }
+    std::vector<StackEffect> calls;
+    for (auto& import : imports.empty() ? default_imports() : imports)
+        calls.push_back({ (int)import.params, (int)import.results });
+
+    for (auto& ref : label_refs) {
+        auto it = label_index.find(ref.second);
+        if (it == label_index.end()) {
+            cerr << path << ":" << insns[ref.first].line << ": Invalid label name: " << ref.second << endl;
+            return false;
+        }
+        insns[ref.first].target = it->second;
+    }
+
+    std::vector<std::string_view> label_names;
+    std::vector<int32_t> label_positions;
+    for (auto& label : label_index) {
+        label_names.push_back(label.first);
+        label_positions.push_back(label.second);
+    }
+
+    if (optimize)
+        optimize_program(insns, stack_depth, width, calls, &label_positions);
+
+    // Lay out the bytecode, label operands become the offset of their instruction
+    size_t operand_size = width / 8;
+    uint64_t operand_mask = width < 64 ? (1ull << width) - 1 : ~0ull;
+    std::vector<uint32_t> offsets(insns.size() + 1, 0);
+    for (size_t i = 0; i < insns.size(); ++i)
+        offsets[i + 1] = (uint32_t)(offsets[i] + INSN_SIZE + operand_size * operand_count(insns[i].opcode));
+
+    std::vector<char> bytes;
+    bytes.reserve(insns.size() * (INSN_SIZE + operand_size));
+    std::vector<uint32_t> jump_targets;
+    std::vector<MvmbLine> lines;
+    lines.reserve(insns.size());
+    for (size_t i = 0; i < insns.size(); ++i) {
+        auto& insn = insns[i];
+        uint64_t arg = (insn.target >= 0 ? offsets[insn.target] : insn.arg) & operand_mask;
+        bytes.push_back((INSN_TYPE)insn.opcode);
+        if (operand_count(insn.opcode)) {
+            // little-endian, the low bytes of arg
+            bytes.resize(bytes.size() + operand_size);
+            memcpy(&bytes[bytes.size() - operand_size], &arg, operand_size);
+        }
+        if (insn.opcode == JMP || insn.opcode == JMPZ || insn.opcode == JMPNZ)
+            jump_targets.push_back((uint32_t)arg);
+        lines.push_back({ offsets[i], insn.line });
+    }
+    std::sort(jump_targets.begin(), jump_targets.end());
+    jump_targets.erase(std::unique(jump_targets.begin(), jump_targets.end()), jump_targets.end());
+
+    std::vector<std::pair<uint32_t, std::string>> labels;
+    for (size_t i = 0; i < label_names.size(); ++i) {
+        if (label_positions[i] >= 0)
+            labels.push_back({ offsets[label_positions[i]], std::string(label_names[i]) });
+    }
+    std::vector<char> symbols = make_symbols(std::move(labels));
+    std::vector<char> import_table = make_imports(imports);
+
+    if (!write_mvmb(output, 0, span_of(bytes), span_of(jump_targets), span_of(lines), span_of(symbols),
+                    span_of(import_table), width))
+        return false;
+    if (cache) {
+        if (auto binary = mapped_file::open(output))
+            cache->put(CACHE_BYTECODE, key, binary->bytes());
+    }
+    return true;
+}
+
+template <class Word>
+bool basic_mvm<Word>::compile_all(std::string dir, std::string output_dir, bool optimize) const {
+    namespace fs = std::filesystem;
+
+    std::error_code ec;
+    std::vector<fs::path> sources;
+    for (auto& entry : fs::directory_iterator(dir, ec)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".mvms")
+            sources.push_back(entry.path());
+    }
+    if (ec)
+        return false;
+    fs::create_directories(output_dir, ec);
+    if (ec)
+        return false;
+    std::sort(sources.begin(), sources.end());
+
+    // workers pull the next file off a shared counter
+    std::atomic<size_t> next{ 0 };
+    std::atomic<bool> ok{ true };
+    auto work = [&] {
+        for (size_t i; (i = next++) < sources.size();) {
+            fs::path out = fs::path(output_dir) / sources[i].filename();
+            out.replace_extension(".mvmb");
+            if (!compile(sources[i].string(), out.string(), optimize)) {
+                cerr << "Could not compile '" << sources[i].string() << "'!\n";
+                ok = false;
+            }
+        }
+    };
+
+    size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), sources.size());
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < workers; ++k)
+        threads.emplace_back(work);
+    work();
+    for (auto& t : threads)
+        t.join();
+    return ok;
+}
+
+#define INSTANTIATE(W)                                                          \
+    template bool basic_mvm<W>::compile(std::string, std::string, bool) const; \
+    template bool basic_mvm<W>::compile_all(std::string, std::string, bool) const;
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
@@ -0,0 +1,202 @@
+#include "batch.h"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+std::shared_ptr<const any_mvm> program_cache::get(const std::string& path, std::string* error) {
+    auto file = mapped_file::open(path);
+    if (!file) {
+        if (error)
+            *error = "Could not read '" + path + "'";
+        return nullptr;
+    }
+    return lookup(std::move(file), error);
+}
+
+std::shared_ptr<const any_mvm> program_cache::get(const void* data, size_t size, std::string* error) {
+    auto file = mapped_file::copy_of(data, size);
+    if (!file) {
+        if (error)
+            *error = "Empty binary";
+        return nullptr;
+    }
+    return lookup(std::move(file), error);
+}
+
+size_t program_cache::size() const {
+    std::lock_guard<std::mutex> hold(lock);
+    return count;
+}
+
+// Loads under the lock, so two threads asking for a new program don't both
+// decode it
+std::shared_ptr<const any_mvm> program_cache::lookup(std::shared_ptr<mapped_file> file, std::string* error) {
+    ByteSpan bytes = file->bytes();
+    uint64_t key = content_hash(bytes);
+
+    std::lock_guard<std::mutex> hold(lock);
+    auto& bucket = programs[key];
+    for (auto& entry : bucket) {
+        ByteSpan known = entry.file->bytes();
+        if (known.size() == bytes.size() && memcmp(known.data(), bytes.data(), bytes.size()) == 0)
+            return entry.vm;
+    }
+
+    std::shared_ptr<const any_mvm> vm = load_mvm(bytes.data(), bytes.size(), STACK_DEPTH, host, error);
+    if (!vm)
+        return nullptr;
+    bucket.push_back({ std::move(file), vm });
+    ++count;
+    return vm;
+}
+
+struct BatchJob {
+    std::shared_ptr<const any_mvm> program;
+    std::shared_ptr<mapped_file> input;
+    std::string name;           // "manifest:line", for reports
+};
+
+// What a job left for the writer: its PRINT lines and why it failed, if it did
+struct BatchResult {
+    std::string output;
+    std::string error;
+    bool done = false;
+};
+
+static bool read_manifest(const std::string& manifest, program_cache& programs, std::vector<BatchJob>& jobs) {
+    namespace fs = std::filesystem;
+
+    std::ifstream in(manifest);
+    if (!in) {
+        cerr << "Could not read manifest '" << manifest << "'!\n";
+        return false;
+    }
+    fs::path base = fs::path(manifest).parent_path();
+    auto resolve = [&](const std::string& name) {
+        fs::path p(name);
+        return (p.is_relative() ? base / p : p).string();
+    };
+
+    // binaries and inputs by path, read once however many jobs name them
+    std::unordered_map<std::string, std::shared_ptr<const any_mvm>> binaries;
+    std::unordered_map<std::string, std::shared_ptr<mapped_file>> inputs;
+    bool ok = true;
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); ++number) {
+        std::istringstream fields(line);
+        std::string binary, input;
+        if (!(fields >> binary) || binary[0] == '#')
+            continue;
+        fields >> input;
+
+        BatchJob job;
+        job.name = manifest + ":" + std::to_string(number);
+        std::string error;
+        auto& program = binaries[resolve(binary)];
+        if (!program)
+            program = programs.get(resolve(binary), &error);
+        job.program = program;
+        if (!job.program) {
+            cerr << job.name << ": " << error << endl;
+            ok = false;
+            continue;
+        }
+        if (!input.empty()) {
+            auto& file = inputs[resolve(input)];
+            if (!file)
+                file = mapped_file::open(resolve(input));
+            if (!file) {
+                cerr << job.name << ": Could not read '" << resolve(input) << "'\n";
+                ok = false;
+                continue;
+            }
+            job.input = file;
+        }
+        jobs.push_back(std::move(job));
+    }
+    return ok;
+}
+
+bool run_batch(const std::string& manifest, size_t workers) {
+    auto started = std::chrono::steady_clock::now();
+
+    program_cache programs;
+    std::vector<BatchJob> jobs;
+    bool ok = read_manifest(manifest, programs, jobs);
+
+    // Whoever finishes the oldest unwritten job writes it and every finished
+    // one after it, so output goes out in manifest order without a writer
+    // thread to hand over to
+    std::vector<BatchResult> results(jobs.size());
+    std::mutex lock;
+    size_t written = 0;
+    auto publish = [&](size_t i, BatchResult result) {
+        std::lock_guard<std::mutex> hold(lock);
+        results[i] = std::move(result);
+        for (; written < jobs.size() && results[written].done; ++written) {
+            BatchResult& done = results[written];
+            fwrite(done.output.data(), 1, done.output.size(), stdout);
+            if (!done.error.empty()) {
+                fflush(stdout);
+                cerr << "An exception occurred in " << jobs[written].name << "!\n\n" << done.error << endl;
+                ok = false;
+            }
+            done.output = std::string();
+            done.error = std::string();
+        }
+    };
+
+    // workers pull the next job off a shared counter
+    std::atomic<size_t> next{ 0 };
+    auto work = [&] {
+        std::unique_ptr<any_mvm> vm;
+        const any_mvm* attached = nullptr;
+        memory_sink sink;
+        for (size_t i; (i = next++) < jobs.size();) {
+            const BatchJob& job = jobs[i];
+            if (!vm || vm->bits() != job.program->bits()) {
+                vm = create_mvm(job.program->bits());
+                vm->set_output(&sink);
+                attached = nullptr;
+            }
+            // the same program again only needs a reset
+            if (attached == job.program.get())
+                vm->reset();
+            else
+                attached = vm->attach(*job.program) ? job.program.get() : nullptr;
+
+            RunStatus status = RUN_TRAP;
+            if (attached) {
+                if (job.input)
+                    vm->write_memory(0, job.input->bytes().data(), job.input->bytes().size());
+                status = vm->run(INT64_MAX);
+            }
+            BatchResult result;
+            result.output.swap(sink.text);
+            if (status == RUN_TRAP)
+                result.error = vm->last_error();
+            result.done = true;
+            publish(i, std::move(result));
+        }
+    };
+
+    if (!workers)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::max<size_t>(1, std::min(workers, jobs.size()));
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < workers; ++k)
+        threads.emplace_back(work);
+    work();
+    for (auto& t : threads)
+        t.join();
+    fflush(stdout);
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    cerr << jobs.size() << " jobs of " << programs.size() << " programs on " << workers << " threads in " << ms
+         << " ms, " << (jobs.empty() ? 0.0 : ms * 1000 / jobs.size()) << " us per job\n";
+    return ok;
+}
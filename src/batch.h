@@ -0,0 +1,43 @@
+#pragma once
+
+#include "mvm.h"
+
+#include <mutex>
+#include <unordered_map>
+
+// Loaded programs by content. A binary that several jobs or paths name is
+// read, decoded and verified once, and every VM that runs it attaches to
+// the one loaded copy, see any_mvm::attach. Thread-safe.
+class program_cache {
+public:
+    explicit program_cache(const host_functions* host = nullptr) : host(host) {}
+
+    // the program in 'path', nullptr with the reason in 'error' if it can't
+    // be loaded
+    MVM_API std::shared_ptr<const any_mvm> get(const std::string& path, std::string* error = nullptr);
+    // the same for a binary in memory, which is copied if it is new
+    MVM_API std::shared_ptr<const any_mvm> get(const void* data, size_t size, std::string* error = nullptr);
+    // distinct programs loaded so far
+    MVM_API size_t size() const;
+
+private:
+    struct Entry {
+        std::shared_ptr<mapped_file> file;
+        std::shared_ptr<const any_mvm> vm;
+    };
+
+    std::shared_ptr<const any_mvm> lookup(std::shared_ptr<mapped_file> file, std::string* error);
+
+    const host_functions* host;
+    mutable std::mutex lock;
+    std::unordered_map<uint64_t, std::vector<Entry>> programs;     // by content_hash
+    size_t count = 0;
+};
+
+// Runs every job of 'manifest' over 'workers' threads, all cores if 0, and
+// writes their output in manifest order. Every line names a binary and
+// optionally a file whose bytes the job starts with in memory at address 0,
+// both relative to the manifest; blank lines and lines starting with '#' are
+// skipped. Each worker keeps one VM and resets it between jobs, so a job
+// costs its run and no load. False if a job couldn't be loaded or trapped.
+MVM_API bool run_batch(const std::string& manifest, size_t workers = 0);
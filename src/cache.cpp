@@ -0,0 +1,145 @@
+#include "cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#ifdef _MSC_VER
+#include <process.h>
+#define getpid      _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+cache_key& cache_key::add(uint64_t value) {
+    const char* bytes = (const char*)&value;
+    material.insert(material.end(), bytes, bytes + sizeof(value));
+    return *this;
+}
+
+// length first, so ("ab", "c") and ("a", "bc") differ
+cache_key& cache_key::add(ByteSpan bytes) {
+    add((uint64_t)bytes.size());
+    material.insert(material.end(), bytes.data(), bytes.data() + bytes.size());
+    return *this;
+}
+
+uint64_t cache_key::value() const {
+    return content_hash(span_of(material));
+}
+
+artifact_cache::artifact_cache(std::string directory, uint64_t max_size)
+    : dir(std::move(directory)), max_size(max_size) {}
+
+const artifact_cache* artifact_cache::defaults() {
+    static const artifact_cache* cache = [] {
+        const char* dir = getenv(CACHE_ENV);
+        return dir && *dir ? new artifact_cache(dir) : nullptr;
+    }();
+    return cache;
+}
+
+std::string artifact_cache::path_of(const char* kind, uint64_t key) const {
+    char name[64];
+    snprintf(name, sizeof(name), "%s-%016llx.mvmc", kind, (unsigned long long)key);
+    return (fs::path(dir) / name).string();
+}
+
+ByteSpan artifact_cache::get(const char* kind, uint64_t key, std::shared_ptr<mapped_file>& file) const {
+    std::string path = path_of(kind, key);
+    file = mapped_file::open(path);
+    if (!file)
+        return {};
+
+    ByteSpan bytes = file->bytes();
+    CacheHeader header;
+    bool intact = bytes.size() >= sizeof(header);
+    if (intact) {
+        memcpy(&header, bytes.data(), sizeof(header));
+        intact = memcmp(header.magic, CACHE_MAGIC, 4) == 0 && header.version == CACHE_VERSION && header.key == key &&
+                 header.size == bytes.size() - sizeof(header);
+    }
+    ByteSpan payload = { bytes.data() + sizeof(header), bytes.size() - sizeof(header) };
+    std::error_code ec;
+    if (!intact || content_hash(payload) != header.checksum) {
+        // truncated, damaged or from another version, the next put replaces it
+        file.reset();
+        fs::remove(path, ec);
+        return {};
+    }
+    // most recently used
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    return payload;
+}
+
+bool artifact_cache::put(const char* kind, uint64_t key, ByteSpan payload) const {
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+
+    // a name no other process or thread writes to
+    static std::atomic<unsigned> serial{ 0 };
+    std::string path = path_of(kind, key);
+    std::string temp = path + "." + std::to_string(getpid()) + "." + std::to_string(serial++) + ".tmp";
+
+    CacheHeader header = {};
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.size = payload.size();
+    header.checksum = content_hash(payload);
+    std::ofstream out(temp, std::ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    out.write(payload.data(), payload.size());
+    out.close();
+    if (!out.good()) {
+        fs::remove(temp, ec);
+        return false;
+    }
+
+    // a writer that got there first stored the same artifact
+    fs::rename(temp, path, ec);
+    if (ec) {
+        fs::remove(temp, ec);
+        return fs::exists(path, ec);
+    }
+    evict();
+    return true;
+}
+
+// Oldest first until the directory fits again. Other processes may be
+// evicting too, files already gone are skipped.
+void artifact_cache::evict() const {
+    struct File {
+        fs::file_time_type used;
+        uint64_t size;
+        fs::path path;
+    };
+    std::vector<File> files;
+    uint64_t total = 0;
+    std::error_code ec;
+    for (auto& entry : fs::directory_iterator(dir, ec)) {
+        if (entry.path().extension() != ".mvmc")
+            continue;
+        std::error_code file_ec;
+        File f = { entry.last_write_time(file_ec), entry.file_size(file_ec), entry.path() };
+        if (file_ec)
+            continue;
+        total += f.size;
+        files.push_back(std::move(f));
+    }
+    if (total <= max_size)
+        return;
+
+    std::sort(files.begin(), files.end(), [](const File& a, const File& b) { return a.used < b.used; });
+    for (auto& f : files) {
+        if (total <= max_size)
+            break;
+        fs::remove(f.path, ec);
+        total -= f.size;
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "export.h"
+#include "mvmb.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Bump whenever the assembler, optimizer, decoder or native lowering starts
+// producing different output for the same input, so stale artifacts miss
+#define CACHE_VERSION       1
+#define CACHE_MAGIC         "MVMC"
+#define CACHE_MAX_SIZE      (64ull << 20)   // bytes a cache directory holds before it evicts
+#define CACHE_ENV           "MVM_CACHE"     // directory of artifact_cache::defaults()
+
+// What an artifact is, part of its file name
+#define CACHE_BYTECODE      "mvmb"          // a .mvmb assembled from source
+#define CACHE_NATIVE        "x64"           // JIT code with its labels and relocations
+
+// Every artifact file starts with this, the payload follows
+struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint64_t size;          // of the payload
+    uint64_t checksum;      // content_hash of the payload
+};
+
+static_assert(sizeof(CacheHeader) == 32, "CacheHeader layout");
+
+// Builds a cache key out of everything an artifact depends on
+class cache_key {
+public:
+    cache_key& add(uint64_t value);
+    cache_key& add(ByteSpan bytes);
+    cache_key& add(const std::string& text) { return add(ByteSpan{ text.data(), text.size() }); }
+    uint64_t value() const;
+
+private:
+    std::vector<char> material;
+};
+
+// Artifacts on disk that outlive the process: one file per artifact, named
+// after its kind and key. Files are written under a temporary name and
+// renamed into place, so processes sharing the directory only ever see
+// whole artifacts, and a damaged one reads as a miss. Every hit refreshes
+// the file's time; once the directory holds more than max_size bytes the
+// least recently used files go.
+class artifact_cache {
+public:
+    explicit artifact_cache(std::string directory, uint64_t max_size = CACHE_MAX_SIZE);
+
+    // the cache in $MVM_CACHE, which VMs use unless given another, nullptr
+    // if it isn't set
+    MVM_API static const artifact_cache* defaults();
+
+    // The artifact of 'kind' under 'key', mapped into 'file' and valid while
+    // it lives; empty if there is no intact one
+    MVM_API ByteSpan get(const char* kind, uint64_t key, std::shared_ptr<mapped_file>& file) const;
+    MVM_API bool put(const char* kind, uint64_t key, ByteSpan payload) const;
+    const std::string& directory() const { return dir; }
+
+private:
+    std::string path_of(const char* kind, uint64_t key) const;
+    void evict() const;
+
+    std::string dir;
+    uint64_t max_size;
+};
@@ -0,0 +1,14 @@
+#pragma once
+
+// What libmvm exports. The static library and the other platforms need
+// nothing; the Windows DLL builds with MVM_SHARED and MVM_EXPORTS and its
+// users with MVM_SHARED alone, see libmvm-shared.vcxproj.
+#if defined(_WIN32) && defined(MVM_SHARED)
+#ifdef MVM_EXPORTS
+#define MVM_API     __declspec(dllexport)
+#else
+#define MVM_API     __declspec(dllimport)
+#endif
+#else
+#define MVM_API
+#endif
@@ -0,0 +1,52 @@
+#include "cache.h"
+#include "host.h"
+
+#ifdef _MSC_VER
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// milliseconds on Windows, seconds everywhere else
+static void host_sleep(uint64_t val) {
+#ifdef _MSC_VER
+    Sleep((DWORD)val);
+#else
+    sleep((unsigned)val);
+#endif
+}
+
+host_functions& host_functions::defaults() {
+    static host_functions table = [] {
+        host_functions t;
+        // it blocks, don't hold output back meanwhile
+        t.bind(HOST_SLEEP, host_sleep, HOST_FLUSH_OUTPUT);
+        return t;
+    }();
+    return table;
+}
+
+const HostFunction* host_functions::find(std::string_view name) const {
+    for (auto& fn : functions) {
+        if (fn.name == name)
+            return &fn;
+    }
+    return nullptr;
+}
+
+uint64_t host_functions::fingerprint() const {
+    cache_key key;
+    for (auto& fn : functions)
+        key.add(fn.name).add(fn.params).add(fn.results).add(fn.make_queue != nullptr);
+    return key.value();
+}
+
+void host_functions::add(HostFunction fn) {
+    for (auto& existing : functions) {
+        if (existing.name == fn.name) {
+            existing = std::move(fn);
+            return;
+        }
+    }
+    functions.push_back(std::move(fn));
+}
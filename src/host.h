@@ -0,0 +1,212 @@
+#pragma once
+
+#include "export.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#define HOST_BATCH          256         // calls a batched function queues before it gets them
+#define HOST_SLEEP          "__sleep"   // bound in host_functions::defaults(), the scheduler parks on it
+
+// Options of host_functions::bind
+enum HostFlags : unsigned {
+    HOST_FLUSH_OUTPUT = 1,      // flush PRINT output before every call, for functions that block or write stdout
+    HOST_YIELD = 2,             // run() returns RUN_YIELD after every call, so its caller gets control back
+};
+
+// Entry points generated for one bound function and word type. A call finds
+// its arguments in slots[0], the deepest, to slots[params - 1] and leaves its
+// results in slots[0] up. Batched functions have 'append' instead, which
+// queues the call and returns how many are queued.
+template <class Word>
+struct HostThunks {
+    void (*call)(void* callable, Word* slots);
+    size_t (*append)(void* queue, const Word* slots);
+};
+
+struct HostFunction {
+    std::string name;
+    unsigned params = 0;
+    unsigned results = 0;
+    unsigned flags = 0;
+    std::shared_ptr<void> callable;
+    // batched functions: every VM makes its own queue and hands it over whole
+    std::shared_ptr<void> (*make_queue)() = nullptr;
+    void (*flush)(void* callable, void* queue) = nullptr;
+    // one set per MVM_WORD_TYPES
+    std::tuple<HostThunks<uint16_t>, HostThunks<uint32_t>, HostThunks<uint64_t>> thunks;
+
+    template <class Word>
+    const HostThunks<Word>& thunks_for() const { return std::get<HostThunks<Word>>(thunks); }
+};
+
+// Parameter and result types of a function, function pointer or lambda
+template <class F>
+struct host_signature : host_signature<decltype(&F::operator())> {};
+template <class R, class... A>
+struct host_signature<R (*)(A...)> {
+    using result = R;
+    using params = std::tuple<std::decay_t<A>...>;
+};
+template <class R, class... A>
+struct host_signature<R(A...)> : host_signature<R (*)(A...)> {};
+template <class C, class R, class... A>
+struct host_signature<R (C::*)(A...)> : host_signature<R (*)(A...)> {};
+template <class C, class R, class... A>
+struct host_signature<R (C::*)(A...) const> : host_signature<R (*)(A...)> {};
+
+// Stack words a result type stands for: none, one, or one per tuple element
+template <class R>
+struct host_results {
+    static constexpr unsigned count = 1;
+    static constexpr bool valid = std::is_integral<R>::value;
+};
+template <>
+struct host_results<void> {
+    static constexpr unsigned count = 0;
+    static constexpr bool valid = true;
+};
+template <class... T>
+struct host_results<std::tuple<T...>> {
+    static constexpr unsigned count = sizeof...(T);
+    static constexpr bool valid = (std::is_integral<T>::value && ...);
+};
+
+template <class T>
+struct host_integers;
+template <class... T>
+struct host_integers<std::tuple<T...>> {
+    static constexpr bool value = (std::is_integral<T>::value && ...);
+};
+
+template <class Word, class R>
+void host_store(Word* slots, const R& value) {
+    slots[0] = (Word)value;
+}
+template <class Word, class... T, size_t... I>
+void host_store(Word* slots, const std::tuple<T...>& values, std::index_sequence<I...>) {
+    ((slots[I] = (Word)std::get<I>(values)), ...);
+}
+template <class Word, class... T>
+void host_store(Word* slots, const std::tuple<T...>& values) {
+    host_store(slots, values, std::index_sequence_for<T...>());
+}
+
+// Every argument is read before the call and every result written after it
+template <class F, class Word, class... A, size_t... I>
+void host_invoke(F& f, Word* slots, std::tuple<A...>*, std::index_sequence<I...>) {
+    if constexpr (std::is_void<typename host_signature<F>::result>::value)
+        f((A)slots[I]...);
+    else
+        host_store(slots, f((A)slots[I]...));
+}
+template <class F, class Word>
+void host_call(void* callable, Word* slots) {
+    using params = typename host_signature<F>::params;
+    host_invoke(*(F*)callable, slots, (params*)nullptr, std::make_index_sequence<std::tuple_size<params>::value>());
+}
+
+// Batched functions take (const std::tuple<A...>* calls, size_t count)
+template <class F>
+using host_batch_call = std::remove_cv_t<std::remove_pointer_t<std::tuple_element_t<0, typename host_signature<F>::params>>>;
+
+template <class Call, class Word, size_t... I>
+Call host_unpack(const Word* slots, std::index_sequence<I...>) {
+    return Call((std::tuple_element_t<I, Call>)slots[I]...);
+}
+template <class Call, class Word>
+size_t host_append(void* queue, const Word* slots) {
+    auto& calls = *(std::vector<Call>*)queue;
+    calls.push_back(host_unpack<Call>(slots, std::make_index_sequence<std::tuple_size<Call>::value>()));
+    return calls.size();
+}
+template <class Call>
+std::shared_ptr<void> host_make_queue() {
+    auto queue = std::make_shared<std::vector<Call>>();
+    queue->reserve(HOST_BATCH);
+    return queue;
+}
+template <class F, class Call>
+void host_flush(void* callable, void* queue) {
+    auto& calls = *(std::vector<Call>*)queue;
+    // emptied even if the function throws, so no call is delivered twice
+    struct Clear {
+        std::vector<Call>& calls;
+        ~Clear() { calls.clear(); }
+    } clear = { calls };
+    if (!calls.empty())
+        (*(F*)callable)((const Call*)calls.data(), calls.size());
+}
+
+// Named C++ functions for CALL. The assembler looks names up here to record
+// each function's signature in the binary, and load() resolves the binary's
+// imports against it to the generated thunks, so a CALL costs one indirect
+// call with the arguments read straight off the VM stack. Bind everything
+// before VMs compile or load against a table, it isn't locked.
+class host_functions {
+public:
+    // the table VMs use unless given another one, with __sleep in it
+    MVM_API static host_functions& defaults();
+
+    // Binds 'f' under 'name', replacing any function of that name. Parameters
+    // are integers; the result is void, an integer or a std::tuple of them to
+    // push several. Stack words are converted to and from them with a cast.
+    template <class F>
+    void bind(std::string name, F f, unsigned flags = 0) {
+        using signature = host_signature<F>;
+        static_assert(host_integers<typename signature::params>::value, "host function parameters must be integers");
+        static_assert(host_results<typename signature::result>::valid,
+                      "host functions return void, an integer or a std::tuple of integers");
+
+        HostFunction fn;
+        fn.name = std::move(name);
+        fn.params = std::tuple_size<typename signature::params>::value;
+        fn.results = host_results<typename signature::result>::count;
+        fn.flags = flags;
+        fn.callable = std::make_shared<F>(std::move(f));
+        fn.thunks = { { host_call<F, uint16_t>, nullptr }, { host_call<F, uint32_t>, nullptr },
+                      { host_call<F, uint64_t>, nullptr } };
+        add(std::move(fn));
+    }
+
+    // Binds a function that takes its calls in batches, as
+    //     void f(const std::tuple<A...>* calls, size_t count)
+    // for a CALL of A... arguments and no results. Each VM queues the calls
+    // and hands them over in order once HOST_BATCH are queued, before any
+    // other host function runs, and before run() returns.
+    template <class F>
+    void bind_batch(std::string name, F f, unsigned flags = 0) {
+        using Call = host_batch_call<F>;
+        static_assert(host_integers<Call>::value, "host function parameters must be integers");
+        static_assert(std::is_void<typename host_signature<F>::result>::value, "batched functions have no results");
+
+        HostFunction fn;
+        fn.name = std::move(name);
+        fn.params = std::tuple_size<Call>::value;
+        fn.flags = flags;
+        fn.callable = std::make_shared<F>(std::move(f));
+        fn.make_queue = host_make_queue<Call>;
+        fn.flush = host_flush<F, Call>;
+        fn.thunks = { { nullptr, host_append<Call, uint16_t> }, { nullptr, host_append<Call, uint32_t> },
+                      { nullptr, host_append<Call, uint64_t> } };
+        add(std::move(fn));
+    }
+
+    // nullptr if nothing is bound under 'name'
+    MVM_API const HostFunction* find(std::string_view name) const;
+    // changes whenever a name or signature in the table does, which is all
+    // the assembler and the JIT take from it
+    MVM_API uint64_t fingerprint() const;
+
+private:
+    MVM_API void add(HostFunction fn);
+
+    std::vector<HostFunction> functions;
+};
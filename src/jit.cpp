@@ -0,0 +1,215 @@
+#include "native.h"
+#include "sampler.h"
+#include "vector.h"
+
+#ifdef MVM_JIT
+#include <sys/mman.h>
+#endif
+
+#ifdef MVM_JIT
+
+static void jit_print(NativeState* st, uint32_t value) {
+    st->out->print((DATA_TYPE)value);
+}
+static uint32_t jit_call(NativeState* st, uint32_t index, DATA_TYPE* args) {
+    st->vm->call_host(index, args);
+    return *st->running;
+}
+static uint32_t jit_vector(NativeState* st, uint32_t op, const DATA_TYPE* args) {
+    return vector_op<DATA_TYPE>(st->memory, (OpCode)op, args);
+}
+static void jit_halt(NativeState* st) {
+    st->out->flush();
+    MVM_LOG("HALT\n");
+    *st->running = 0;
+}
+
+static const void* const jit_helpers[] = { (const void*)jit_print, (const void*)jit_call, (const void*)jit_halt,
+                                           (const void*)jit_vector };
+
+// A helper address generated code loads, the imm64 at 'offset'. Addresses
+// change with every process, so cached code is stored without them and
+// patched on the way in.
+struct JitRelocation {
+    uint32_t offset;
+    uint32_t helper;
+};
+
+// Cached artifact: code size, label and relocation counts, then the three
+static std::vector<char> pack_native(const std::vector<uint8_t>& code, const std::vector<uint32_t>& labels,
+                                     const std::vector<JitRelocation>& relocs) {
+    uint32_t counts[3] = { (uint32_t)code.size(), (uint32_t)labels.size(), (uint32_t)relocs.size() };
+    std::vector<char> payload(sizeof(counts) + code.size() + labels.size() * sizeof(uint32_t) +
+                              relocs.size() * sizeof(JitRelocation));
+    char* p = payload.data();
+    memcpy(p, counts, sizeof(counts));
+    p += sizeof(counts);
+    memcpy(p, code.data(), code.size());
+    p += code.size();
+    memcpy(p, labels.data(), labels.size() * sizeof(uint32_t));
+    p += labels.size() * sizeof(uint32_t);
+    memcpy(p, relocs.data(), relocs.size() * sizeof(JitRelocation));
+    return payload;
+}
+static bool unpack_native(ByteSpan payload, ByteSpan& code, std::vector<uint32_t>& labels,
+                          std::vector<JitRelocation>& relocs) {
+    uint32_t counts[3];
+    if (payload.size() < sizeof(counts))
+        return false;
+    memcpy(counts, payload.data(), sizeof(counts));
+    if (payload.size() != sizeof(counts) + (uint64_t)counts[0] + counts[1] * sizeof(uint32_t) +
+                              counts[2] * sizeof(JitRelocation))
+        return false;
+    const char* p = payload.data() + sizeof(counts);
+    code = { p, counts[0] };
+    p += counts[0];
+    labels.resize(counts[1]);
+    memcpy(labels.data(), p, counts[1] * sizeof(uint32_t));
+    p += counts[1] * sizeof(uint32_t);
+    relocs.resize(counts[2]);
+    memcpy(relocs.data(), p, counts[2] * sizeof(JitRelocation));
+    for (auto& r : relocs) {
+        if (r.helper >= sizeof(jit_helpers) / sizeof(*jit_helpers) || r.offset > code.size() || code.size() - r.offset < 8)
+            return false;
+    }
+    return true;
+}
+
+template <class Word>
+bool basic_mvm<Word>::compile_jit() {
+    // only 16-bit words have a lowering
+    if (sizeof(Word) != sizeof(DATA_TYPE))
+        return false;
+
+    // The lowering reads the decoded code, which the binary and the imports
+    // bound to it determine, and the stack effects of those imports
+    uint64_t key = 0;
+    X64Emitter e;
+    std::shared_ptr<mapped_file> artifact;
+    ByteSpan native;
+    std::vector<JitRelocation> relocs;
+    if (cache) {
+        cache_key k;
+        k.add(CACHE_VERSION).add(word_bits).add(vector_kernels().isa).add(image.file->bytes());
+        for (auto& f : calls)
+            k.add(f.effect.pops).add(f.effect.pushes).add(f.bound());
+        key = k.value();
+        if (!unpack_native(cache->get(CACHE_NATIVE, key, artifact), native, jit_labels, relocs) ||
+            jit_labels.size() != code.size())
+            native = {};
+    }
+
+    if (native.empty()) {
+        relocs.clear();
+        bool ok = lower_x64(e, code, call_effects(), jit_labels, [&](NativeHelper helper) {
+            e.mov_r64_imm(RAX, 0);
+            relocs.push_back({ (uint32_t)e.size() - 8, (uint32_t)helper });
+            e.call_r64(RAX);
+            return true;
+        });
+        if (!ok)
+            return false;
+        native = span_of(e.buf);
+        if (cache)
+            cache->put(CACHE_NATIVE, key, span_of(pack_native(e.buf, jit_labels, relocs)));
+    }
+
+    // W^X: fill the buffer while writable, then flip it to executable
+    void* mem = mmap(nullptr, native.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return false;
+    memcpy(mem, native.data(), native.size());
+    // helpers move with every process, the code only knows where they go
+    for (auto& r : relocs) {
+        uint64_t address = (uint64_t)jit_helpers[r.helper];
+        memcpy((char*)mem + r.offset, &address, sizeof(address));
+    }
+    if (mprotect(mem, native.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, native.size());
+        return false;
+    }
+
+    jit_code = mem;
+    jit_size = native.size();
+    if (sampling) {
+        sampling->native_begin = (uintptr_t)jit_code;
+        sampling->native_end = (uintptr_t)jit_code + jit_size;
+        if (!write_perf_map())
+            cerr << "Could not write the perf map!\n";
+    }
+    return true;
+}
+
+template <class Word>
+void basic_mvm<Word>::free_jit() {
+    if (sampling)
+        sampling->native_end = 0;
+    if (jit_code)
+        munmap(jit_code, jit_size);
+    jit_code = nullptr;
+    jit_size = 0;
+    jit_labels.clear();
+}
+
+template <class Word>
+RunStatus basic_mvm<Word>::start_jit() {
+    if (code.empty() && !decode())
+        return RUN_UNSUPPORTED;
+    if (!jit_code && !compile_jit())
+        return RUN_UNSUPPORTED;
+
+    size_t index = 0;
+    while (code[index].pc != pc && code[index].opcode != EXIT)
+        ++index;
+
+    // only reached for 16-bit words, lower_x64 turns the others down
+    DATA_TYPE* base = (DATA_TYPE*)stck.data();
+    NativeState st = { base, base + sp, base + stack_depth, &running, (DATA_TYPE)reg, (DATA_TYPE)pc, out,
+                         memory.data(), (mvm*)this };
+    auto entry = (int (*)(NativeState*, const void*))jit_code;
+
+    RunStatus status = RUN_TRAP;
+    running = 1;
+    try {
+        int native = entry(&st, (char*)jit_code + jit_labels[index]);
+        sp = st.sp - base;
+        reg = st.reg;
+        pc = st.pc;
+        running = 0;
+        flush_calls();
+        out->flush();
+
+        if (native == NATIVE_INVALID_OPCODE)
+            throw std::runtime_error("Invalid opcode " + std::to_string((unsigned char)program.at(pc)));
+        if (native >= NATIVE_UNDERFLOW)
+            throw std::runtime_error(native_status_message(native));
+        status = native == NATIVE_HALT ? RUN_HALTED : native == NATIVE_STOPPED ? RUN_STOPPED : RUN_EXIT;
+    }
+    CATCH
+    running = 0;
+    finish_sampling();
+    return status;
+}
+
+#else
+
+template <class Word>
+bool basic_mvm<Word>::compile_jit() {
+    return false;
+}
+template <class Word>
+void basic_mvm<Word>::free_jit() {
+}
+template <class Word>
+RunStatus basic_mvm<Word>::start_jit() {
+    return RUN_UNSUPPORTED;
+}
+
+#endif
+
+#define INSTANTIATE(W)                                                          \
+    template bool basic_mvm<W>::compile_jit();                                 \
+    template void basic_mvm<W>::free_jit();                                    \
+    template RunStatus basic_mvm<W>::start_jit();
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
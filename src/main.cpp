@@ -1,44 +1,170 @@
+#include "batch.h"
 #include "mvm.h"
+#include "scheduler.h"
+
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+
+// VMs only record traps, the CLI prints them
+static void report_trap(const any_mvm& vm) {
+    cerr << "An exception occurred!\n\n" << vm.last_error() << endl;
+}
 
 int main(int argc, char **argp) {
     if (argc < 2) {
         cout << "mvm - Minimal Virtual Machine\n";
         cout << "\n\tmvm -c <source> <output>\t-\tCompile source to output\n";
+        cout << "\tmvm -c <dir> <output dir>\t-\tCompile every .mvms in dir, in parallel\n";
+        cout << "\tmvm -O <source> <output>\t-\tCompile and optimize source to output\n";
         cout << "\tmvm -d <binary> <output>\t-\tDecompile binary to output\n";
+        cout << "\tmvm -v <binary>\t\t\t-\tVerify binary can run without runtime checks\n";
+        cout << "\tmvm -a <binary> <output>\t-\tCompile binary to a native executable\n";
+        cout << "\tmvm -j <binary>\t\t\t-\tExecute binary as native code\n";
+        cout << "\tmvm -r <binary>\t\t\t-\tExecute binary on the register VM\n";
+        cout << "\tmvm -m <binary> [binary...]\t-\tExecute binaries concurrently\n";
+        cout << "\tmvm -b <manifest>\t\t-\tExecute the jobs of a manifest across all cores\n";
+        cout << "\tmvm -w <binary>\t\t\t-\tExecute binary, writing output on a separate thread\n";
+        cout << "\tmvm -u <binary>\t\t\t-\tExecute binary, flushing output on every PRINT\n";
+        cout << "\tmvm -p <binary>\t\t\t-\tExecute binary and write a profile to <binary>.prof\n";
+        cout << "\tmvm -s <binary>\t\t\t-\tExecute binary and write sampled stacks to <binary>.folded\n";
+        cout << "\tmvm -S <binary>\t\t\t-\tSame as -s on native code, with a perf map in /tmp\n";
+        cout << "\tmvm -x <binary>\t\t\t-\tExecute binary and record a trace to <binary>.trace\n";
+        cout << "\tmvm -X <binary> <trace>\t\t-\tReplay a trace of binary\n";
         cout << "\tmvm <binary>\t\t\t-\tExecute source\n\n";
         return -1;
     }
 
     mvm vm;
     if (strstr(argp[1], "-t")) {
-        vm.compile("scripts\\count_to_100.mvms", "bin\\count_to_100.mvmb");
-        vm.translate_to_x64_asm("bin\\count_to_100.mvmb", "bin\\count_to_100.x64.s");
-        vm.decompile("bin\\count_to_100.mvmb", "bin\\count_to_100.dec.mvms");
-        if (vm.load("bin\\count_to_100.mvmb"))
-            vm.start();
+        vm.compile("scripts/count_to_100.mvms", "bin/count_to_100.mvmb");
+        vm.compile_native("bin/count_to_100.mvmb", "bin/count_to_100");
+        vm.decompile("bin/count_to_100.mvmb", "bin/count_to_100.dec.mvms");
+        if (vm.load("bin/count_to_100.mvmb") && vm.start() == RUN_TRAP)
+            report_trap(vm);
         return 1;
     }
 
+    std::string error;
+    if (strstr(argp[1], "-v") && argc > 2) {
+        auto vm = load_mvm(argp[2], STACK_DEPTH, nullptr, &error);
+        if (!vm) {
+            cerr << error << endl;
+            cerr << "Could not load MVMB '" << argp[2] << "'!\n";
+            return 0;
+        }
+        if (!vm->verify(error)) {
+            cerr << argp[2] << ": " << error << endl;
+            return 0;
+        }
+        cout << argp[2] << ": verified\n";
+        return 1;
+    }
+
+    if (strstr(argp[1], "-m")) {
+        std::mutex report_lock;
+        scheduler sched(0, SCHED_SLICE, [&](any_mvm& vm, RunStatus status) {
+            std::lock_guard<std::mutex> hold(report_lock);
+            if (status == RUN_TRAP)
+                report_trap(vm);
+        });
+        for (int i = 2; i < argc; ++i) {
+            auto vm = load_mvm(argp[i], STACK_DEPTH, nullptr, &error);
+            if (!vm) {
+                cerr << error << endl;
+                cerr << "Could not load MVMB '" << argp[i] << "'!\n";
+                continue;
+            }
+            sched.spawn(std::move(vm));
+        }
+        sched.wait();
+        return 1;
+    }
+
+    if (strstr(argp[1], "-b") && argc > 2)
+        return run_batch(argp[2]);
+
     bool bRun = true;
-    if (strstr(argp[1], "-c") || strstr(argp[1], "-d"))
+    if (strstr(argp[1], "-c") || strstr(argp[1], "-O") || strstr(argp[1], "-d") || strstr(argp[1], "-a"))
         bRun = false;
-    
+    bool bJit = strstr(argp[1], "-j") != nullptr;
+    bool bReg = strstr(argp[1], "-r") != nullptr;
+    bool bAsync = strstr(argp[1], "-w") != nullptr;
+    bool bUnbuffered = strstr(argp[1], "-u") != nullptr;
+    bool bProfile = strstr(argp[1], "-p") != nullptr;
+    bool bSample = strstr(argp[1], "-s") != nullptr;
+    bool bSampleJit = strstr(argp[1], "-S") != nullptr;
+    bool bTrace = strstr(argp[1], "-x") != nullptr;
+    bool bReplay = strstr(argp[1], "-X") != nullptr && argc > 3;
+
     int res = 0;
-    std::string in = argp[bRun ? 1 : 2];
+    std::string in = argp[bRun && !bJit && !bReg && !bAsync && !bUnbuffered && !bProfile && !bSample && !bSampleJit && !bTrace && !bReplay ? 1 : 2];
     if (!bRun) {
         std::string out = argp[3];
 
-        if (strstr(argp[1], "-c"))
-            res = vm.compile(in, out);
+        bool optimize = strstr(argp[1], "-O") != nullptr;
+        if (strstr(argp[1], "-c") || optimize) {
+            if (std::filesystem::is_directory(in))
+                res = vm.compile_all(in, out, optimize);
+            else
+                res = vm.compile(in, out, optimize);
+        }
+        else if (strstr(argp[1], "-a"))
+            res = vm.compile_native(in, out);
         else
             res = vm.decompile(in, out);
     } else {
-        res = vm.load(in);
-        if (res)
-            vm.start();
+        stream_sink stream;
+        std::unique_ptr<async_sink> async;
+        if (bAsync)
+            async = std::make_unique<async_sink>();
+
+        // the binary decides which word size of VM runs it
+        auto run_vm = load_mvm(in, STACK_DEPTH, nullptr, &error);
+        res = run_vm != nullptr;
+        if (res && bUnbuffered)
+            run_vm->set_output(&stream);
+        else if (res && bAsync)
+            run_vm->set_output(async.get());
+
+        RunStatus status = RUN_UNSUPPORTED;
+        if (res && bProfile) {
+            // profiling only instruments the interpreter
+            run_vm->enable_profiling(in + ".prof");
+            status = run_vm->start();
+        } else if (res && (bTrace || bReplay)) {
+            // traces only cover the interpreter
+            if (bTrace && !run_vm->enable_tracing(in + ".trace"))
+                cerr << "Could not create trace '" << in << ".trace'!\n";
+            else if (bReplay && !run_vm->enable_replay(argp[3]))
+                cerr << run_vm->last_error() << endl;
+            else
+                status = run_vm->start();
+        } else if (res && (bSample || bSampleJit)) {
+            if (!run_vm->enable_sampling(in + ".folded"))
+                cerr << "Sampling is not supported on this platform\n";
+            if (bSampleJit)
+                status = run_vm->start_jit();
+            if (status == RUN_UNSUPPORTED)
+                status = run_vm->start();
+        } else if (res) {
+            // anything the JIT or register VM can't handle runs on the interpreter
+            if (bJit)
+                status = run_vm->start_jit();
+            if (status == RUN_UNSUPPORTED && bReg)
+                status = run_vm->start_registers();
+            if (status == RUN_UNSUPPORTED)
+                status = run_vm->start();
+        }
         else {
+            cerr << error << endl;
             cerr << "Could not load MVMB '" << in << "'!\n";
         }
+        if (status == RUN_TRAP)
+            report_trap(*run_vm);
+        // a halted program exits cleanly, like HALT always did in release builds
+        if (status == RUN_HALTED)
+            res = 0;
     }
     return res;
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include "memory.h"
+
+#include <algorithm>
+#include <new>
+
+#ifdef MVM_MMAP_MEMORY
+#include <sys/mman.h>
+#endif
+#ifdef MVM_COW_MEMORY
+#include <unistd.h>
+#endif
+
+memory_pool& memory_pool::shared() {
+    static memory_pool pool;
+    return pool;
+}
+
+uint8_t* memory_pool::acquire() {
+    std::lock_guard<std::mutex> hold(lock);
+    if (free_list.empty()) {
+        // chunks stay mapped for as long as the process runs
+        size_t size = (size_t)MEMORY_STRIDE * MEMORY_CHUNK;
+#ifdef MVM_MMAP_MEMORY
+        void* chunk = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+            throw std::bad_alloc();
+#else
+        void* chunk = new uint8_t[size]();
+#endif
+        for (size_t i = MEMORY_CHUNK; i-- > 0;)
+            free_list.push_back((uint8_t*)chunk + i * MEMORY_STRIDE);
+    }
+    uint8_t* memory = free_list.back();
+    free_list.pop_back();
+    return memory;
+}
+
+void memory_pool::release(uint8_t* memory) {
+    if (!memory)
+        return;
+    clear(memory);
+    std::lock_guard<std::mutex> hold(lock);
+    free_list.push_back(memory);
+}
+
+void memory_pool::clear(uint8_t* memory) {
+#if defined(MVM_MMAP_MEMORY) && defined(__linux__)
+    // private anonymous pages read back as zero after this
+    if (madvise(memory, MEMORY_STRIDE, MADV_DONTNEED) == 0)
+        return;
+#endif
+    memset(memory, 0, MEMORY_SIZE + MEMORY_SLACK);
+}
+
+// Only pages holding something are written, the others stay holes in the
+// memfd and read back as zero without ever being backed
+memory_image::memory_image(const uint8_t* memory) {
+#ifdef MVM_COW_MEMORY
+    fd = memfd_create("mvm-memory", MFD_CLOEXEC);
+    void* view = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, MEMORY_STRIDE) == 0)
+        view = mmap(nullptr, MEMORY_STRIDE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED) {
+        if (fd >= 0)
+            close(fd);
+        throw std::bad_alloc();
+    }
+    bytes = (uint8_t*)view;
+    const size_t page = 4096;
+    static const uint8_t zeroes[page] = {};
+    for (size_t at = 0; at < MEMORY_SIZE + MEMORY_SLACK; at += page) {
+        size_t n = std::min<size_t>(page, MEMORY_SIZE + MEMORY_SLACK - at);
+        if (memcmp(memory + at, zeroes, n) != 0)
+            memcpy(bytes + at, memory + at, n);
+    }
+    mprotect(bytes, MEMORY_STRIDE, PROT_READ);
+#else
+    copy.assign(memory, memory + MEMORY_SIZE + MEMORY_SLACK);
+    bytes = copy.data();
+#endif
+}
+
+memory_image::~memory_image() {
+#ifdef MVM_COW_MEMORY
+    // memories mapped from it keep the memfd alive
+    munmap(bytes, MEMORY_STRIDE);
+    close(fd);
+#endif
+}
+
+void guest_memory::assign(const memory_image& image) {
+#ifdef MVM_COW_MEMORY
+    // replaces whatever was mapped here, the pool's pages included
+    if (mmap(bytes, MEMORY_STRIDE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image.fd, 0) != MAP_FAILED) {
+        shared = true;
+        return;
+    }
+    // a failed MAP_FIXED may have unmapped the range
+    shared = true;
+    unshare();
+#endif
+    memcpy(bytes, image.data(), MEMORY_SIZE + MEMORY_SLACK);
+}
+
+void guest_memory::unshare() {
+    if (!shared)
+        return;
+    shared = false;
+#ifdef MVM_MMAP_MEMORY
+    if (mmap(bytes, MEMORY_STRIDE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) !=
+        MAP_FAILED)
+        return;
+#endif
+    // private copies of zero pages do as well
+    memset(bytes, 0, MEMORY_SIZE + MEMORY_SLACK);
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+// Guest memory is byte addressed and every address is taken modulo
+// MEMORY_SIZE, so any address a program computes is in bounds and accesses
+// need neither a check nor a guard page. A word read or written at the last
+// few addresses runs into MEMORY_SLACK, plain memory past the end.
+#define MEMORY_SIZE         0x10000
+#define MEMORY_MASK         (MEMORY_SIZE - 1)
+#define MEMORY_SLACK        8
+#define MEMORY_STRIDE       (MEMORY_SIZE + 4096)    // one memory per stride of a pool mapping
+#define MEMORY_CHUNK        16                      // memories mapped at once
+
+// anonymous mappings, whose pages are only backed once touched
+#if defined(__unix__) || defined(__APPLE__)
+#define MVM_MMAP_MEMORY
+#endif
+// memory images in memfds that memories map copy-on-write
+#if defined(MVM_MMAP_MEMORY) && defined(__linux__)
+#define MVM_COW_MEMORY
+#endif
+
+// Hands out zeroed guest memories. They are carved out of large mappings and
+// go back on a free list, so starting a VM costs no system call once the
+// pool is warm, and a memory a program never touches costs no RAM.
+class memory_pool {
+public:
+    static memory_pool& shared();
+
+    // a zeroed memory of MEMORY_SIZE + MEMORY_SLACK bytes, throws
+    // std::bad_alloc when nothing can be mapped
+    uint8_t* acquire();
+    void release(uint8_t* memory);
+    // zeroes a memory, handing its pages back to the system where possible
+    static void clear(uint8_t* memory);
+
+private:
+    std::mutex lock;
+    std::vector<uint8_t*> free_list;
+};
+
+// A frozen copy of a guest memory, which any number of memories start out
+// as, see guest_memory::assign. On Linux it lives in a memfd that memories
+// map privately, so taking one on costs a page table update and only the
+// pages a VM writes to afterwards get copied. Zero pages aren't stored.
+class memory_image {
+public:
+    // copies MEMORY_SIZE + MEMORY_SLACK bytes of 'memory', throws
+    // std::bad_alloc if there is no room for them
+    explicit memory_image(const uint8_t* memory);
+    ~memory_image();
+    memory_image(const memory_image&) = delete;
+    memory_image& operator=(const memory_image&) = delete;
+
+    const uint8_t* data() const { return bytes; }
+
+private:
+    friend class guest_memory;
+
+    uint8_t* bytes = nullptr;       // read-only view of the copy
+#ifdef MVM_COW_MEMORY
+    int fd = -1;
+#else
+    std::vector<uint8_t> copy;
+#endif
+};
+
+// The guest memory of one VM, returned to the pool with it
+class guest_memory {
+public:
+    guest_memory() : bytes(memory_pool::shared().acquire()) {}
+    ~guest_memory() {
+        unshare();
+        memory_pool::shared().release(bytes);
+    }
+    guest_memory(const guest_memory&) = delete;
+    guest_memory& operator=(const guest_memory&) = delete;
+
+    uint8_t* data() const { return bytes; }
+    void clear() {
+        if (shared)
+            unshare();
+        else
+            memory_pool::clear(bytes);
+    }
+    // makes the contents a copy of 'image', mapped copy-on-write where the
+    // platform allows it
+    void assign(const memory_image& image);
+
+private:
+    // back to private zero pages
+    void unshare();
+
+    uint8_t* bytes;
+    bool shared = false;            // mapped from a memory_image
+};
+
+// little-endian words at any byte address, wrapping like the VM does
+template <class Word>
+inline Word load_word(const uint8_t* memory, uint64_t address) {
+    Word value;
+    memcpy(&value, memory + (address & MEMORY_MASK), sizeof(Word));
+    return value;
+}
+template <class Word>
+inline void store_word(uint8_t* memory, uint64_t address, Word value) {
+    memcpy(memory + (address & MEMORY_MASK), &value, sizeof(Word));
+}
@@ -1,133 +1,86 @@
 #include "mvm.h"
-
-#ifdef _MSC_VER
-#include <Windows.h>
-#else
-#include <unistd.h>
-#endif
+#include "profile.h"
+#include "sampler.h"
+#include "trace.h"
+#include "vector.h"
 
 #include <fstream>
+#include <sstream>
 #include <cstdint>
-#include <unordered_map>
+#include <cstring>
+#include <algorithm>
 
-bool mvm::compile(std::string path, std::string output) {
-    if (path.empty() || output.empty())
-        return false;
-
-    std::ifstream source(path);
-    std::ofstream binary(output, std::ios::binary);
-    if (!source.good() || !binary.good())
-        return false;
-
-    // First pass: build list of label names and their locations
-    std::unordered_map<std::string, DATA_TYPE> label_offsets;
-    size_t bytecode_size = 0;
-    string line;
-    while (getline(source, line)) {
-        if (line.empty() || line[0] == '#' || line.find("#") != std::string::npos) 
-            continue;
-
-        if (line[line.size() - 1] == ':') {
-            // This is a label definition
-            std::string label_name = line.substr(0, line.size() - 1);
-            if (label_offsets.count(label_name) > 0) {
-                cerr << "Duplicate label name: " << label_name << endl;
-                return false;
-            }
-            label_offsets[label_name] = (DATA_TYPE)bytecode_size;
-        }
-        else {
-            // This is an instruction
-            string opcode_str;
-            size_t space_pos = line.find(' ');
-            if (space_pos == string::npos)
-                opcode_str = line;
-            else
-                opcode_str = line.substr(0, space_pos);
-
-            bool found = false;
-            for (auto& insn : instruction_definitions) {
-                if (opcode_str == insn.sz) {
-                    bytecode_size += INSN_SIZE + DATA_SIZE * insn.num_args;
-                    found = true;
-                    break;
-                }
-            }
-
-            if (!found) {
-                cerr << "Invalid opcode: " << opcode_str << endl;
-                return false;
-            }
-        }
+int operand_count(OpCode op) {
+    switch (op) {
+        case CALL: case PUSH: case JMP: case JMPZ: case JMPNZ: case LOADX: case STOREX:
+            return 1;
+        default:
+            return 0;
     }
+}
 
-    // Second pass: generate bytecode
-    source.clear();
-    source.seekg(0);
-    while (getline(source, line)) {
-        if (line.empty() || line[0] == '#' || line.find("#") != std::string::npos)
-            continue;
-
-        if (line[line.size() - 1] == ':') { // Label definition
-            string label_name = line.substr(0, line.size() - 1);
-            label_offsets[label_name] = (DATA_TYPE)binary.tellp();
-            continue;
-        }
-
-        string opcode_str;
-        DATA_TYPE arg = 0;
-        size_t space_pos = line.find(' ');
-        if (space_pos == string::npos)
-            opcode_str = line;
-        else {
-            opcode_str = line.substr(0, space_pos);
-            if (isdigit(line[space_pos + 1]))
-                arg = stoi(line.substr(space_pos + 1));
-            else { // Label reference
-                string label_name = line.substr(space_pos + 1);
-                if (label_offsets.find(label_name) == label_offsets.end()) {
-                    cerr << "Invalid label name: " << label_name << endl;
-                    return false;
-                }
-                arg = label_offsets[label_name];
-            }
-        }
-
-        bool found = false;
-        for (auto& insn : instruction_definitions) {
-            if (opcode_str == insn.sz) {
-                binary.write(reinterpret_cast<char*>(&insn.opcode), INSN_SIZE);
-                binary.write(reinterpret_cast<char*>(&arg), DATA_SIZE * insn.num_args);
-                found = true;
-                break;
-            }
-        }
-
-        if (!found) {
-            cerr << "Invalid opcode: " << opcode_str << endl;
-            return false;
-        }
+StackEffect stack_effect(OpCode op) {
+    switch (op) {
+        case PUSH: case LOAD: case LOADX:
+            return { 0, 1 };
+        case POP: case CALL: case JMPZ: case JMPNZ: case STOREX:
+            return { 1, 0 };
+        case NEG: case PRINT: case LOADM:
+            return { 1, 1 };
+        case STOREM:
+            return { 2, 0 };
+        case MFILL: case MCOPY:
+            return { 3, 0 };
+        case VADD: case VSUB: case VMUL: case VAND: case VOR: case VXOR: case VEQ: case VLT: case VGT:
+            return { 4, 0 };
+        case VSUM: case VMIN: case VMAX:
+            return { 2, 1 };
+#define EFFECT(o, e)    case o:
+        MVM_BINARY_OPS(EFFECT)
+#undef EFFECT
+            return { 2, 1 };
+        default:
+            return { 0, 0 };
     }
-    return true;
 }
-bool mvm::decompile(std::string path, std::string output) {
+
+template <class Word>
+bool basic_mvm<Word>::decompile(std::string path, std::string output) {
     if (path.empty() || output.empty())
         return false;
 
-    std::ifstream in(path);
+    MvmbImage in;
+    std::string error;
+    if (!read_mvmb(path, in, &error)) {
+        cerr << error << endl;
+        return false;
+    }
     std::ofstream out(output, std::ios::binary);
-    if (!in.good() || !out.good())
+    if (!out.good())
         return false;
 
-    INSN_TYPE instr;
-    while (in.read(reinterpret_cast<char*>(&instr), INSN_SIZE)) {
+    if (in.word_bits != 16)
+        out << ".width " << in.word_bits << endl;
+    // CALL operands index the imports in this order
+    if (!in.imports.empty()) {
+        for (auto& import : read_imports(in.imports))
+            out << ".import " << import.name << " " << import.params << " " << import.results << endl;
+    }
+    size_t offset = 0;
+    while (offset < in.code.size()) {
+        INSN_TYPE instr = in.code[offset];
+        offset += INSN_SIZE;
         bool found = false;
         for (auto& insn : instruction_definitions) {
             if (instr == insn.opcode) {
                 out << insn.sz;
-                DATA_TYPE arg;
+                // operands are as wide as the binary's words, little-endian
+                size_t width = in.word_bits / 8;
+                uint64_t arg = 0;
                 for (int i = 0; i < insn.num_args; ++i) {
-                    in.read(reinterpret_cast<char*>(&arg), DATA_SIZE);
+                    if (offset + width <= in.code.size())
+                        memcpy(&arg, in.code.data() + offset, width);
+                    offset += width;
                     out << " " << arg;
                 }
                 out << endl;
@@ -140,439 +93,1019 @@ bool mvm::decompile(std::string path, std::string output) {
     }
     return true;
 }
-void mvm::translate_to_x64_asm(std::string path, std::string output) {
-    std::ifstream in(path, std::ios::binary);
-    std::ofstream out(output);
 
-    if (!in.good() || !out.good())
+// An import that isn't bound, or bound with another signature, stays in the
+// table unbound and CALLs of it decode to TRAP.
+template <class Word>
+void basic_mvm<Word>::resolve_imports() {
+    flush_calls();
+    calls.clear();
+    for (auto& import : read_imports(image.imports)) {
+        HostCall<Word> f = {};
+        f.effect = { (int)import.params, (int)import.results };
+        const HostFunction* fn = host->find(import.name);
+        if (tracer && tracer->replaying) {
+            // replay takes every result from the trace and calls nothing
+            f.call = [](void*, Word*) {};
+            f.parks = import.name == HOST_SLEEP && import.params == 1 && import.results == 0;
+        } else if (fn && fn->params == import.params && fn->results == import.results) {
+            f.call = fn->thunks_for<Word>().call;
+            f.append = fn->thunks_for<Word>().append;
+            f.flush = fn->flush;
+            f.callable = fn->callable;
+            if (fn->make_queue)
+                f.queue = fn->make_queue();
+            f.flush_output = (fn->flags & HOST_FLUSH_OUTPUT) != 0;
+            f.yields = (fn->flags & HOST_YIELD) != 0;
+            f.parks = import.name == HOST_SLEEP && import.params == 1 && import.results == 0;
+        }
+        calls.push_back(f);
+    }
+}
+
+template <class Word>
+std::vector<StackEffect> basic_mvm<Word>::call_effects() const {
+    std::vector<StackEffect> effects;
+    for (auto& f : calls)
+        effects.push_back(f.effect);
+    return effects;
+}
+
+template <class Word>
+void basic_mvm<Word>::flush_calls() {
+    HostCall<Word>* f = queued;
+    if (!f)
         return;
+    queued = nullptr;
+    if (f->flush_output)
+        out->flush();
+    f->flush(f->callable.get(), f->queue.get());
+}
 
-    out << ".section .text\n";
-    out << ".globl _start\n";
-    out << "_start:\n";
-
-    INSN_TYPE instr;
-    DATA_TYPE value;
-    #define READ()  in.read(reinterpret_cast<char*>(&value), DATA_SIZE)
-    while (in.read(reinterpret_cast<char*>(&instr), INSN_SIZE)) {
-        switch (instr) {
-            case PUSH:
-                READ();
-                out << "    movabs $" << value << ", %rax\n";
-                out << "    push %rax\n";
-                break;
-            case POP:
-                out << "    pop %rax\n";
-                break;
-            case LOAD:
-                out << "    push %rax\n";
-                break;
-            case ADD: 
-            case SUB:
-            {
-                out << "    pop %rbx\n";
-                out << "    pop %rax\n";
-                if (instr == ADD) {
-                    out << "    add %rbx, %rax\n";
-                    out << "    push %rax\n";
-                } else if (instr == SUB) {
-                    out << "    sub %rax, %rbx\n";
-                    out << "    push %rbx\n";
-                }
-                break;
-            }
-            case XOR: 
-            case AND:
-            case OR:
-            {
-                out << "    pop %rax\n";
-                out << "    pop %rbx\n";
-                if (instr == XOR)
-                    out << "    xor %rax, %rbx\n";
-                else if (instr == AND)
-                    out << "    and %rax, %rbx\n";
-                else if (instr == OR)
-                    out << "    or %rax, %rbx\n";
-                out << "    push %rax\n";
-                break;
-            }
-            case NEG: {
-                out << "    pop %rax\n";
-                out << "    neg %rax\n";
-                out << "    push %rax\n";
-                break;
-            }
-            case MUL:
-                out << "    pop %rax\n";
-                out << "    pop %rcx\n";
-                out << "    imul %rcx, %rax\n";
-                out << "    push %rax\n";
-                break;
-            case DIV:
-                out << "    pop %rax\n";
-                out << "    pop %rcx\n";
-                out << "    xor %rdx, %rdx\n";  // Clear rdx to zero
-                out << "    div %rcx\n";
-                out << "    push %rax\n";
-                break;
-            case MOD:
-                out << "    pop %rax\n";
-                out << "    pop %rcx\n";
-                out << "    xor %rdx, %rdx\n";  // Clear rdx to zero
-                out << "    div %rcx\n";
-                out << "    push %rdx\n";
-                break;
-            case EQU:
-            case NEQU:
-                out << "    pop %rax\n";
-                out << "    pop %rbx\n";
-                out << "    cmp %rax, %rbx\n";
-                if (instr == EQU)
-                    out << "    sete %al\n";
-                else if (instr == NEQU)
-                    out << "    setne %al\n";
-                out << "    movsx %al, %rax\n";
-                out << "    push %rax\n";
-                break;
-            case LT: {
-                out << "    pop %rbx\n";
-                out << "    pop %rax\n";
-                out << "    cmp %rax, %rbx\n";
-                out << "    setl %al\n";
-                out << "    and $1, %al\n";
-                out << "    push %rax\n";
-                break;
-            }
-            case LTEQ: {
-                out << "    pop %rax\n";
-                out << "    pop %rbx\n";
-                out << "    cmp %bx, %ax\n";
-                out << "    setle %al\n";
-                out << "    movzbl %al, %eax\n";
-                out << "    push %rax\n";
-                break;
-            }
-            case GT:
-            case GTEQ: {
-                out << "    pop %rbx\n";
-                out << "    pop %rax\n";
-                out << "    cmp %rax, %rbx\n";
-                if (instr == GT)
-                    out << "    setg %al\n";
-                else if (instr == GTEQ)
-                    out << "    setge %al\n";
-                out << "    movzb %rax, %al\n";
-                out << "    push %rax\n";
-                break;
-            }
-            case JMP:
-            case JMPNZ:
-            case JMPZ: {
-                READ();
-                if (instr == JMP) {
-                    out << "    jmp $0x" << std::hex << value << endl;
-                } else {
-                    out << "    pop %rax\n";
-                    out << "    cmp $0, %rax\n";
-                    if (instr == JMPNZ)
-                        out << "    jne $0x" << std::hex << value << endl;
-                    else
-                        out << "    je $0x" << std::hex << value << endl;
-                }
-                break;
-            }
-            case HALT: {
-                out << "    mov $60, %rax\n";
-                out << "    xor %rdi, %rdi\n";
-                out << "    syscall\n";
-                break;
-            }
-            case PRINT: {
-                // print out the value
-                out << "    add $0x30, %rax\n"; // shift into ASCII integer characters
-                out << "    pop %rax\n";
-                out << "    push %rax\n";
-                out << "    mov $1, %rax\n";
-                out << "    mov $1, %rdi\n";
-                out << "    mov %rsp, %rsi\n";
-                out << "    mov $1, %rdx\n";
-                out << "    syscall\n";
-                out << "    add $8, %rsp\n";
-
-                // print out a newline
-                out << "    push $0x0d\n";
-                out << "    mov $1, %rax\n";
-                out << "    mov $1, %rdi\n";
-                out << "    mov %rsp, %rsi\n";
-                out << "    mov $1, %rdx\n";
-                out << "    syscall\n";
-                out << "    add $8, %rsp\n";
-                break;
-            }
-            case CALL: {
-                READ();
-                break;
-            }
-            case NOP: {
-                out << "    nop\n";
-                break;
-            }
-        }
+template <class Word>
+bool basic_mvm<Word>::save(std::string path) {
+    if (program.empty() || path.empty())
+        return false;
+
+    return write_mvmb(path, image.entry, program, image.jump_targets, image.lines, image.symbols, image.imports,
+                      word_bits);
+}
+// Maps the file and runs straight from the mapping, there is no copy of the
+// bytecode. Decoding still happens per VM.
+template <class Word>
+bool basic_mvm<Word>::load(std::string path) {
+    if (path.empty())
+        return false;
+
+    MvmbImage loaded;
+    if (!read_mvmb(path, loaded, &error))
+        return false;
+    return load_image(std::move(loaded), "'" + path + "'");
+}
+template <class Word>
+bool basic_mvm<Word>::load(const void* data, size_t size) {
+    MvmbImage loaded;
+    if (!read_mvmb(data, size, loaded, &error))
+        return false;
+    return load_image(std::move(loaded), "The binary");
+}
+template <class Word>
+bool basic_mvm<Word>::load_image(MvmbImage loaded, const std::string& name) {
+    if (loaded.word_bits != word_bits) {
+        error = name + " is a " + std::to_string(loaded.word_bits) + "-bit binary, this VM runs " +
+                std::to_string(word_bits) + "-bit ones";
+        return false;
     }
-    #undef READ
 
-    // Prepare the data segment
-    out << ".section .rodata\n";
-    out << "\n";
+    free_jit();
+    origin.reset();
+    image = std::move(loaded);
+    program = image.code;
+    resolve_imports();
+    if (!decode()) {
+        error = name + " has no code";
+        return false;
+    }
+    reset();
+    // programs that fail still run, with every check in place
+    std::string problem;
+    verified = verify(problem);
+    prepare();
+    return true;
+}
+template <class Word>
+bool basic_mvm<Word>::attach(const any_mvm& other) {
+    auto source = dynamic_cast<const basic_mvm*>(&other);
+    if (!source || source->code.empty()) {
+        error = source ? "Nothing is loaded to attach to" : "The VM to attach to runs another word size";
+        return false;
+    }
 
-    out << "\n";
+    free_jit();
+    origin.reset();
+    image = source->image;
+    program = source->program;
+    code = source->code;
+    dispatch_table = source->dispatch_table;
+    verified = source->verified;
+    max_depth = source->max_depth;
+    rcode = source->rcode;
+    reg_entries = source->reg_entries;
+    // same table, same functions, but queues of our own
+    host = source->host;
+    resolve_imports();
+    reset();
+    return true;
+}
+template <class Word>
+void basic_mvm<Word>::reset() {
+    flush_calls();
+    pc = (Word)image.entry;
+    resume = 0;
+    sp = 0;
+    reg = 0;
+    sleep_request = 0;
+    std::fill(stck.begin(), stck.end(), (Word)0);
+    memory.clear();
+    error.clear();
+    state_changed = true;
+}
+template <class Word>
+void basic_mvm<Word>::write_memory(uint64_t address, const void* data, size_t size) {
+    auto bytes = (const uint8_t*)data;
+    while (size) {
+        size_t at = address & MEMORY_MASK;
+        size_t chunk = std::min<size_t>(size, MEMORY_SIZE - at);
+        memcpy(memory.data() + at, bytes, chunk);
+        bytes += chunk;
+        address += chunk;
+        size -= chunk;
+    }
+    state_changed = true;
+}
+template <class Word>
+void basic_mvm<Word>::set_trap(const char* what) {
+    std::ostringstream report;
+    report << what << "\nPC: 0x" << std::hex << pc;
+    if (uint32_t line = source_line(pc))
+        report << "\nLine: " << std::dec << line;
+    report << "\nR0: 0x" << std::hex << (uint64_t)reg << "\nprogram size: 0x" << program.size();
+    error = report.str();
+}
+template <class Word>
+uint32_t basic_mvm<Word>::source_line(Word pc) const {
+    // last record at or before pc
+    size_t lo = 0, hi = image.lines.size() / sizeof(MvmbLine);
+    MvmbLine record = {};
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        MvmbLine probe;
+        memcpy(&probe, image.lines.data() + mid * sizeof(MvmbLine), sizeof(probe));
+        if (probe.pc <= pc) {
+            record = probe;
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return record.line;
 }
 
-void __sleep(DATA_TYPE val) {
-#ifdef _MSC_VER
-    Sleep(*reinterpret_cast<int*>(&val));
-#else
-    sleep(*reinterpret_cast<int*>(&val));
-#endif
+
+// Turns the raw program bytes into a flat array of DecodedInstruction, with
+// immediates read once and jump offsets resolved to indices into 'code'.
+// Malformed bytes decode to TRAP so they only fault when actually reached.
+template <class Word>
+bool basic_mvm<Word>::decode() {
+    this->code.clear();
+    verified = false;
+    dispatch_table = nullptr;
+    rcode.clear();
+    reg_entries.clear();
+    if (program.empty())
+        return false;
+
+    // a fresh vector, VMs attached to the old decoding keep theirs
+    auto& code = this->code.edit();
+
+    std::vector<uint32_t> index_of(program.size() + 1, UINT32_MAX);
+    size_t offset = 0;
+    while (offset < program.size()) {
+        DecodedInstruction<Word> insn = {};
+        insn.pc = (Word)offset;
+        insn.opcode = (OpCode)(unsigned char)program[offset];
+        index_of[offset] = (uint32_t)code.size();
+
+        int num_args = operand_count(insn.opcode);
+        if (insn.opcode >= EXIT) {
+            insn.opcode = TRAP;
+            insn.arg = TRAP_INVALID_OPCODE;
+        }
+
+        offset += INSN_SIZE;
+        if (offset + sizeof(Word) * num_args > program.size()) {
+            insn.opcode = TRAP;
+            insn.arg = TRAP_TRUNCATED_OPERAND;
+            code.push_back(insn);
+            offset = program.size();
+            break;
+        }
+        if (num_args) {
+            memcpy(&insn.arg, program.data() + offset, sizeof(Word));
+            offset += sizeof(Word);
+        }
+        if (insn.opcode == CALL && (insn.arg >= calls.size() || !calls[insn.arg].bound())) {
+            insn.opcode = TRAP;
+            insn.arg = TRAP_INVALID_CALL;
+        }
+        code.push_back(insn);
+    }
+
+    // running off the end of the program stops the VM
+    index_of[program.size()] = (uint32_t)code.size();
+    code.push_back({ nullptr, 0, 0, (Word)program.size(), EXIT });
+
+    for (size_t i = 0; i < code.size(); ++i) {
+        auto& insn = code[i];
+        if (insn.opcode != JMP && insn.opcode != JMPZ && insn.opcode != JMPNZ)
+            continue;
+
+        if (insn.arg <= program.size() && index_of[insn.arg] != UINT32_MAX) {
+            insn.target = index_of[insn.arg];
+        } else {
+            // jumps into the middle of an instruction fault when taken
+            insn.target = (uint32_t)code.size();
+            code.push_back({ nullptr, 0, TRAP_INVALID_JUMP, insn.pc, TRAP });
+        }
+    }
+
+    // a taken jump or a CALL is charged for everything since the closest
+    // jump target or CALL, which is exact for any run that didn't fall into
+    // a loop from above
+    std::vector<bool> is_target(code.size(), false);
+    if (!image.jump_targets.empty()) {
+        // the assembler already listed them
+        for (size_t k = 0; k < image.jump_targets.size() / sizeof(uint32_t); ++k) {
+            uint32_t offset;
+            memcpy(&offset, image.jump_targets.data() + k * sizeof(uint32_t), sizeof(offset));
+            if (offset <= program.size() && index_of[offset] != UINT32_MAX)
+                is_target[index_of[offset]] = true;
+        }
+    } else {
+        for (auto& insn : code) {
+            if (insn.opcode == JMP || insn.opcode == JMPZ || insn.opcode == JMPNZ)
+                is_target[insn.target] = true;
+        }
+    }
+    for (size_t i = 0, run = 0; i < code.size(); ++i) {
+        run = is_target[i] || (i > 0 && code[i - 1].opcode == CALL) ? 1 : run + 1;
+        code[i].cost = (uint16_t)std::min<size_t>(run, UINT16_MAX);
+    }
+
+    fuse();
+    return true;
 }
 
-void (*func_table[])(DATA_TYPE val) = {
-    __sleep
+// Every superinstruction for one binary operator, in OpCode order
+struct FusedBinary {
+    OpCode op, load_push, load_push_pop, push, print_pop;
+};
+struct FusedCompare {
+    OpCode op, load_push_jmpz, load_push_jmpnz, jmpz, jmpnz;
 };
 
-void mvm::execute(INSN_TYPE opcode) {
-    try {
-        DATA_TYPE immediate = 0;
-        switch (opcode) {
-            case CALL: {
-                pc += INSN_SIZE;
-                immediate = *reinterpret_cast<DATA_TYPE*>(&program.at(pc));
-                func_table[immediate](stck.top());
-                stck.pop();
-                pc += DATA_SIZE - INSN_SIZE;
-                break;
-            }
-            case LOAD: {
-                stck.push(reg);
-                break;
-            }
-            case NOP: {
-                break;
-            }
-            case HALT: {
-                LOG << "HALT\n";
-                running = 0;
-    #           ifndef _DEBUG
-                    exit(0);
-    #           endif
-                break;
-            }
-            case PUSH: {
-                pc += INSN_SIZE;
-                immediate = *reinterpret_cast<DATA_TYPE*>(&program.at(pc));
-                stck.push(immediate);
-                pc += DATA_SIZE - INSN_SIZE;
-                break;
-            }
-            case POP: {
-                reg = stck.top();
-                stck.pop();
-                break;
-            }
-            case EQU: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a == b ? 1 : 0);
-                break;
-            }
-            case NEQU: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a != b ? 1 : 0);
-                break;
-            }
-            case GT: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a > b ? 1 : 0);
-                break;
-            }
-            case LT: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a < b ? 1 : 0);
-                break;
-            }
-            case GTEQ: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a >= b ? 1 : 0);
-                break;
-            }
-            case LTEQ: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a <= b ? 1 : 0);
-                break;
-            }
-            case XOR: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a ^ b);
-                break;
-            }
-            case OR: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a | b);
-                break;
-            }
-            case MOD: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a % b);
-                break;
-            }
-            case NEG: {
-                DATA_TYPE v = ~stck.top();
-                stck.pop();
-                stck.push(v);
-                break;
-            }
-            case AND: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a & b);
-                break;
-            }
-            case ADD: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a + b);
-                break;
-            }
-            case SUB: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(b - a);
-                break;
-            }
-            case MUL: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(a * b);
-                break;
-            }
-            case DIV: {
-                DATA_TYPE a = stck.top();
-                stck.pop();
-                DATA_TYPE b = stck.top();
-                stck.pop();
-                stck.push(b / a);
-                break;
-            }
-            case JMP:
-            case JMPZ:
-            case JMPNZ: {
-                pc += INSN_SIZE;
-                if (opcode == JMP) {
-                    immediate = *reinterpret_cast<DATA_TYPE*>(&program.at(pc)) - 1;
-                    pc = immediate - 1;
-                } else if (opcode == JMPZ ? stck.top() == 0 : stck.top() != 0) {
-                    immediate = *reinterpret_cast<DATA_TYPE*>(&program.at(pc)) - 1;
-                    pc = immediate - 1;
-                    stck.pop();
-                }
-                pc += DATA_SIZE - INSN_SIZE;
-                break;
-            }
-            case PRINT: {
-                cout << "PRINT " << stck.top() << endl;
-                break;
+#define FUSED_ROW(o, e)     { o, LOAD_PUSH_##o, LOAD_PUSH_##o##_POP, PUSH_##o, o##_PRINT_POP },
+static const FusedBinary fused_binary[] = { MVM_BINARY_OPS(FUSED_ROW) };
+#undef FUSED_ROW
+#define FUSED_ROW(o, e)     { o, LOAD_PUSH_##o##_JMPZ, LOAD_PUSH_##o##_JMPNZ, o##_JMPZ, o##_JMPNZ },
+static const FusedCompare fused_compare[] = { MVM_COMPARE_OPS(FUSED_ROW) };
+#undef FUSED_ROW
+
+int fused_length(OpCode op) {
+    if (op <= TRAP)
+        return 1;
+    if (op == PUSH_POP || op == PRINT_POP)
+        return 2;
+    for (auto& f : fused_binary) {
+        if (op == f.load_push || op == f.print_pop)
+            return 3;
+        if (op == f.load_push_pop)
+            return 4;
+        if (op == f.push)
+            return 2;
+    }
+    for (auto& f : fused_compare) {
+        if (op == f.load_push_jmpz || op == f.load_push_jmpnz)
+            return 4;
+        if (op == f.jmpz || op == f.jmpnz)
+            return 2;
+    }
+    return 1;
+}
+
+OpCode unfused_opcode(OpCode op) {
+    if (op <= TRAP)
+        return op;
+    if (op == PUSH_POP)
+        return PUSH;
+    if (op == PRINT_POP)
+        return PRINT;
+    for (auto& f : fused_binary) {
+        if (op == f.load_push || op == f.load_push_pop)
+            return LOAD;
+        if (op == f.push)
+            return PUSH;
+        if (op == f.print_pop)
+            return f.op;
+    }
+    for (auto& f : fused_compare) {
+        if (op == f.load_push_jmpz || op == f.load_push_jmpnz)
+            return LOAD;
+        if (op == f.jmpz || op == f.jmpnz)
+            return f.op;
+    }
+    return op;
+}
+
+// Superinstruction pass. Every place where one of the fusable shapes matches
+// is a candidate; each superinstruction is then scored by a static profile,
+// the number of dispatches it saves weighted by the loop nesting of where it
+// matched, and the best scoring ones are applied first without overlapping.
+//
+// Only the first slot of a sequence is rewritten. Its handler falls back to
+// the plain handler whenever it would trap, so traps still report the PC of
+// the exact instruction, and jumps into the middle of a sequence still land
+// on the original instructions.
+template <class Word>
+void basic_mvm<Word>::fuse() {
+    auto& code = this->code.edit();
+    // loop nesting from backward jumps, each level weighs 8x the one outside it
+    std::vector<int> depth(code.size() + 1, 0);
+    for (size_t i = 0; i < code.size(); ++i) {
+        auto op = code[i].opcode;
+        if ((op == JMP || op == JMPZ || op == JMPNZ) && code[i].target <= i) {
+            depth[code[i].target]++;
+            depth[i + 1]--;
+        }
+    }
+    std::vector<uint64_t> weight(code.size());
+    for (size_t i = 0, nesting = 0; i < code.size(); ++i) {
+        nesting += depth[i];
+        weight[i] = 1ull << (3 * std::min<size_t>(nesting, 16));
+    }
+
+    struct Candidate { uint32_t at; OpCode fused; int length; };
+    std::vector<Candidate> candidates;
+    std::vector<uint64_t> score(NUM_OPCODES, 0);
+    auto candidate = [&](size_t at, OpCode fused, int length) {
+        candidates.push_back({ (uint32_t)at, fused, length });
+        score[fused] += weight[at] * (length - 1);
+    };
+    auto op_at = [&](size_t i) {
+        return i < code.size() ? code[i].opcode : NUM_OPCODES;
+    };
+
+    for (size_t i = 0; i < code.size(); ++i) {
+        OpCode op = op_at(i);
+        if (op == PUSH && op_at(i + 1) == POP)
+            candidate(i, PUSH_POP, 2);
+        if (op == PRINT && op_at(i + 1) == POP)
+            candidate(i, PRINT_POP, 2);
+
+        for (auto& f : fused_binary) {
+            if (op == LOAD && op_at(i + 1) == PUSH && op_at(i + 2) == f.op) {
+                candidate(i, f.load_push, 3);
+                if (op_at(i + 3) == POP)
+                    candidate(i, f.load_push_pop, 4);
             }
-            default: {
-                throw new std::runtime_error("Invalid opcode " + opcode);
+            if (op == PUSH && op_at(i + 1) == f.op)
+                candidate(i, f.push, 2);
+            if (op == f.op && op_at(i + 1) == PRINT && op_at(i + 2) == POP)
+                candidate(i, f.print_pop, 3);
+        }
+        for (auto& f : fused_compare) {
+            if (op == LOAD && op_at(i + 1) == PUSH && op_at(i + 2) == f.op) {
+                if (op_at(i + 3) == JMPZ)
+                    candidate(i, f.load_push_jmpz, 4);
+                if (op_at(i + 3) == JMPNZ)
+                    candidate(i, f.load_push_jmpnz, 4);
             }
+            if (op == f.op && op_at(i + 1) == JMPZ)
+                candidate(i, f.jmpz, 2);
+            if (op == f.op && op_at(i + 1) == JMPNZ)
+                candidate(i, f.jmpnz, 2);
         }
     }
-    CATCH
-}
 
-bool mvm::save(std::string path) {
-    if (!program.size() || path.empty())
-        return false;
+    std::stable_sort(candidates.begin(), candidates.end(), [&](const Candidate& a, const Candidate& b) {
+        if (score[a.fused] != score[b.fused])
+            return score[a.fused] > score[b.fused];
+        return a.length > b.length;
+    });
 
-    std::ofstream out(path, std::ios::binary);
-    if (!out.good())
-        return false;
+    std::vector<bool> used(code.size(), false);
+    for (auto& c : candidates) {
+        bool free = true;
+        for (int k = 0; k < c.length; ++k)
+            free = free && !used[c.at + k];
+        if (!free)
+            continue;
+        for (int k = 0; k < c.length; ++k)
+            used[c.at + k] = true;
 
-    out.write(reinterpret_cast<char*>(&program.at(0)), program.size());
-    out.close();
-    return true;
+        // hoist the operands of the later slots into the first one
+        auto& first = code[c.at];
+        if (first.opcode == LOAD)
+            first.arg = code[c.at + 1].arg;
+        const auto& last = code[c.at + c.length - 1];
+        if (last.opcode == JMPZ || last.opcode == JMPNZ) {
+            first.target = last.target;
+            first.cost = last.cost;
+        }
+        first.opcode = c.fused;
+    }
 }
-bool mvm::load(std::string path) {
-    if (path.empty())
-        return false;
 
-    std::ifstream in(path, std::ios::binary);
-    if (!in.good())
-        return false;
+// Direct-threaded interpreter over the decoded program. Every handler ends by
+// jumping straight to the next handler; compilers without computed goto get
+// the same handler bodies inside a switch.
+//
+// The top of stack lives in 'tos' and the rest of the stack below 'sp', so a
+// binary op is one load and no stores. Depth checks are a single pointer
+// compare and raise a trap instead of reading past the stack. Programs that
+// passed verify() can't underflow or overflow, so they run an instantiation
+// with no checks at all. Memory accesses never need one, their address is
+// wrapped into the guest memory instead.
+//
+// Taken jumps and CALLs charge their precomputed cost against the budget
+// and only there check whether it is used up, so counting instructions costs
+// nothing on the fall-through path and a straight line never stops to look.
+//
+// The profiling instantiation counts every dispatch and taken jump and the
+// sampling one stores each dispatched instruction where the sampler's signal
+// handler can see it; in the plain one those lines compile away.
+#ifdef MVM_THREADED_DISPATCH
+#define VM_OP(o)            op_##o:
+#define VM_DISPATCH()       { VM_COUNT(); goto *ip->handler; }
+#else
+#define VM_OP(o)            case o: op_##o:
+#define VM_DISPATCH()       { VM_COUNT(); continue; }
+#endif
+#define VM_COUNT()          if (PROFILE == PROFILE_COUNT)                                   \
+                                prof->step(ip - code.data(), ip->opcode);                   \
+                            else if (PROFILE == PROFILE_SAMPLE)                             \
+                                sampler->current.store(ip, std::memory_order_relaxed)
+#define VM_NEXT()           ++ip; VM_DISPATCH()
+#define VM_JUMP()           {                                   \
+                                if (PROFILE == PROFILE_COUNT)   \
+                                    ++prof->taken[ip - code.data()]; \
+                                budget -= ip->cost;             \
+                                ip = &code[ip->target];         \
+                                if (!running || budget <= 0)    \
+                                    goto preempted;             \
+                                VM_DISPATCH();                  \
+                            }
+#define VM_TAKEN()          if (PROFILE == PROFILE_TRACE)                                   \
+                                ++taken
+#define VM_FELL_THROUGH()   if (PROFILE == PROFILE_TRACE) {                                 \
+                                if (!tracer->fell_through(taken))                           \
+                                    VM_TRAP(TRACE_DIVERGED);                                \
+                                taken = 0;                                                  \
+                            }
+#define VM_SYNC()           do {                                \
+                                pc = ip->pc;                    \
+                                resume = ip - code.data();      \
+                                reg = r0;                       \
+                                *sp = tos;                      \
+                                this->sp = sp - base;           \
+                            } while (0)
+#define VM_TRAP(msg)        do { VM_SYNC(); flush_calls(); out->flush(); throw std::runtime_error(msg); } while (0)
+#define VM_CHECK(cond)      (CHECKED && (cond))
+#define VM_NEED(n)          if (VM_CHECK(sp - base < (n))) VM_TRAP("Stack underflow")
+#define VM_PUSH(v)          do {                                \
+                                Word v_ = (v);                  \
+                                if (VM_CHECK(sp == limit))      \
+                                    VM_TRAP("Stack overflow");  \
+                                *sp++ = tos;                    \
+                                tos = v_;                       \
+                            } while (0)
+#define VM_BINARY(o, expr)  VM_OP(o) {                          \
+                                VM_NEED(2);                     \
+                                Word a = tos;                   \
+                                Word b = *--sp;                 \
+                                tos = (Word)(expr);             \
+                                VM_NEXT();                      \
+                            }
+// one dispatch for a whole range, the kernels do the rest
+#define VM_VECTOR(o, n, results)                                \
+    VM_OP(o) {                                                  \
+        VM_NEED(n);                                             \
+        *sp = tos;                                              \
+        Word r = vector_op<Word>(mem, o, sp - (n - 1));         \
+        sp -= n - results;                                      \
+        tos = results ? r : *sp;                                \
+        VM_NEXT();                                              \
+    }
+#define VM_BRANCH(o, cond)  VM_OP(o) {                          \
+                                VM_NEED(1);                     \
+                                if (cond) {                     \
+                                    VM_TAKEN();                 \
+                                    tos = *--sp;                \
+                                    VM_JUMP();                  \
+                                }                               \
+                                VM_FELL_THROUGH();              \
+                                VM_NEXT();                      \
+                            }
 
-    in.seekg(0, std::ios::end);
-    size_t sz = in.tellg();
-    in.seekg(0, std::ios::beg);
-    if (!sz) {
-        in.close();
-        return false;
+// Superinstructions check up front that none of the instructions they stand
+// for would trap, and otherwise run the first of them with its plain handler.
+#define VM_FUSED_BINARY(o, expr)                                \
+    VM_OP(LOAD_PUSH_##o) {                                      \
+        if (VM_CHECK(limit - sp < 2))                           \
+            goto op_LOAD;                                       \
+        Word a = ip->arg;                                       \
+        Word b = r0;                                            \
+        *sp++ = tos;                                            \
+        tos = (Word)(expr);                                     \
+        ip += 3;                                                \
+        VM_DISPATCH();                                          \
+    }                                                           \
+    VM_OP(LOAD_PUSH_##o##_POP) {                                \
+        if (VM_CHECK(limit - sp < 2))                           \
+            goto op_LOAD;                                       \
+        Word a = ip->arg;                                       \
+        Word b = r0;                                            \
+        r0 = (Word)(expr);                                      \
+        ip += 4;                                                \
+        VM_DISPATCH();                                          \
+    }                                                           \
+    VM_OP(PUSH_##o) {                                           \
+        if (VM_CHECK(sp == limit || sp == base))                \
+            goto op_PUSH;                                       \
+        Word a = ip->arg;                                       \
+        Word b = tos;                                           \
+        tos = (Word)(expr);                                     \
+        ip += 2;                                                \
+        VM_DISPATCH();                                          \
+    }                                                           \
+    VM_OP(o##_PRINT_POP) {                                      \
+        if (VM_CHECK(sp - base < 2))                            \
+            goto op_##o;                                        \
+        Word a = tos;                                           \
+        Word b = *--sp;                                         \
+        r0 = (Word)(expr);                                      \
+        out->print(r0);                                         \
+        tos = *--sp;                                            \
+        ip += 3;                                                \
+        VM_DISPATCH();                                          \
+    }
+#define VM_FUSED_COMPARE(o, expr)                               \
+    VM_OP(LOAD_PUSH_##o##_JMPZ) {                               \
+        if (VM_CHECK(limit - sp < 2))                           \
+            goto op_LOAD;                                       \
+        Word a = ip->arg;                                       \
+        Word b = r0;                                            \
+        if (!(expr)) {                                          \
+            VM_TAKEN();                                         \
+            VM_JUMP();                                          \
+        }                                                       \
+        VM_FELL_THROUGH();                                      \
+        *sp++ = tos;                                            \
+        tos = 1;                                                \
+        ip += 4;                                                \
+        VM_DISPATCH();                                          \
+    }                                                           \
+    VM_OP(LOAD_PUSH_##o##_JMPNZ) {                              \
+        if (VM_CHECK(limit - sp < 2))                           \
+            goto op_LOAD;                                       \
+        Word a = ip->arg;                                       \
+        Word b = r0;                                            \
+        if (expr) {                                             \
+            VM_TAKEN();                                         \
+            VM_JUMP();                                          \
+        }                                                       \
+        VM_FELL_THROUGH();                                      \
+        *sp++ = tos;                                            \
+        tos = 0;                                                \
+        ip += 4;                                                \
+        VM_DISPATCH();                                          \
+    }                                                           \
+    VM_OP(o##_JMPZ) {                                           \
+        if (VM_CHECK(sp - base < 2))                            \
+            goto op_##o;                                        \
+        Word a = tos;                                           \
+        Word b = *--sp;                                         \
+        if (!(expr)) {                                          \
+            VM_TAKEN();                                         \
+            tos = *--sp;                                        \
+            VM_JUMP();                                          \
+        }                                                       \
+        VM_FELL_THROUGH();                                      \
+        tos = 1;                                                \
+        ip += 2;                                                \
+        VM_DISPATCH();                                          \
+    }                                                           \
+    VM_OP(o##_JMPNZ) {                                          \
+        if (VM_CHECK(sp - base < 2))                            \
+            goto op_##o;                                        \
+        Word a = tos;                                           \
+        Word b = *--sp;                                         \
+        if (expr) {                                             \
+            VM_TAKEN();                                         \
+            tos = *--sp;                                        \
+            VM_JUMP();                                          \
+        }                                                       \
+        VM_FELL_THROUGH();                                      \
+        tos = 0;                                                \
+        ip += 2;                                                \
+        VM_DISPATCH();                                          \
     }
 
-    program.clear();
-    program.resize(sz);
+template <class Word>
+RunStatus basic_mvm<Word>::start() {
+    RunStatus status = run(INT64_MAX);
+    if (profile && !profile_path.empty()) {
+        if (write_profile(profile_path))
+            cerr << "Profile written to '" << profile_path << "'\n";
+        else
+            cerr << "Could not write profile '" << profile_path << "'!\n";
+    }
+    finish_sampling();
+    return status;
+}
 
-    in.read(reinterpret_cast<char*>(&program.at(0)), sz);
-    in.close();
-    return true;
+// Runs until the program ends, stops or traps, or until roughly 'budget'
+// instructions have executed, whichever comes first. The budget is only
+// checked at taken jumps and CALLs, so a straight-line run always finishes.
+// A CALL of a function bound with HOST_YIELD returns RUN_YIELD right after
+// it. With park_sleep set, CALL of __sleep returns RUN_SLEEP instead of
+// blocking, leaving the requested time in sleep_time().
+template <class Word>
+RunStatus basic_mvm<Word>::run(int64_t budget, bool park_sleep) {
+    if (tracer)
+        return run_traced(budget, park_sleep);
+    if (verified) {
+        if (profile)
+            return execute<PROFILE_COUNT, false>(budget, park_sleep);
+        if (sampling)
+            return execute<PROFILE_SAMPLE, false>(budget, park_sleep);
+        return execute<PROFILE_OFF, false>(budget, park_sleep);
+    }
+    if (profile)
+        return execute<PROFILE_COUNT, true>(budget, park_sleep);
+    if (sampling)
+        return execute<PROFILE_SAMPLE, true>(budget, park_sleep);
+    return execute<PROFILE_OFF, true>(budget, park_sleep);
 }
 
+template <class Word>
+void basic_mvm<Word>::prepare() {
+    // a negative budget stops execute once the handlers are in
+    if (verified)
+        execute<PROFILE_OFF, false>(-1, false);
+    else
+        execute<PROFILE_OFF, true>(-1, false);
+}
 
-void mvm::start() {
-    running = 1;
+template <class Word>
+template <int PROFILE, bool CHECKED>
+RunStatus basic_mvm<Word>::execute(int64_t budget, bool park_sleep) {
+    if (code.empty() && !decode())
+        return RUN_EXIT;
 
-    try {
-        while (running && pc < program.size()) {
-            execute(program.at(pc));
+#ifdef MVM_THREADED_DISPATCH
+    static const void* const handlers[] = {
+        &&op_CALL, &&op_NOP, &&op_PUSH, &&op_POP, &&op_LOAD,
+        &&op_EQU, &&op_NEQU, &&op_GT, &&op_GTEQ, &&op_LT, &&op_LTEQ,
+        &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV,
+        &&op_XOR, &&op_OR, &&op_MOD, &&op_NEG, &&op_AND,
+        &&op_JMP, &&op_JMPZ, &&op_JMPNZ,
+        &&op_PRINT, &&op_HALT,
+        &&op_LOADM, &&op_STOREM, &&op_LOADX, &&op_STOREX,
+        &&op_MFILL, &&op_MCOPY,
+        &&op_VADD, &&op_VSUB, &&op_VMUL, &&op_VAND, &&op_VOR, &&op_VXOR,
+        &&op_VEQ, &&op_VLT, &&op_VGT, &&op_VSUM, &&op_VMIN, &&op_VMAX,
+        &&op_EXIT, &&op_TRAP,
+#define FUSED_HANDLERS(o, e) &&op_LOAD_PUSH_##o, &&op_LOAD_PUSH_##o##_POP, &&op_PUSH_##o, &&op_##o##_PRINT_POP,
+        MVM_BINARY_OPS(FUSED_HANDLERS)
+#undef FUSED_HANDLERS
+#define FUSED_HANDLERS(o, e) &&op_LOAD_PUSH_##o##_JMPZ, &&op_LOAD_PUSH_##o##_JMPNZ, &&op_##o##_JMPZ, &&op_##o##_JMPNZ,
+        MVM_COMPARE_OPS(FUSED_HANDLERS)
+#undef FUSED_HANDLERS
+        &&op_PUSH_POP, &&op_PRINT_POP,
+    };
+    static_assert(sizeof(handlers) / sizeof(*handlers) == NUM_OPCODES, "handler table out of sync with OpCode");
 
-            pc += INSN_SIZE;
+    if (dispatch_table != handlers) {
+        for (auto& insn : code.edit())
+            insn.handler = handlers[insn.opcode];
+        dispatch_table = handlers;
+    }
+#endif
+
+    if (budget < 0)
+        return RUN_YIELD;
+
+    Profile* const prof = profile.get();
+    if (PROFILE == PROFILE_COUNT)
+        prof->attach(code.size());
+    Sampler* const sampler = sampling.get();
+    if (PROFILE == PROFILE_SAMPLE)
+        sampler->code_begin = (uintptr_t)code.data();
+
+    // resume from wherever the VM last stopped
+    const DecodedInstruction<Word>* ip = nullptr;
+    if (resume < code.size() && code[resume].pc == pc)
+        ip = &code[resume];
+    for (size_t i = 0; !ip; ++i) {
+        if (code[i].pc == pc || code[i].opcode == EXIT)
+            ip = &code[i];
+    }
+    RunStatus status = RUN_EXIT;
+
+    Word* const base = stck.data();
+    Word* const limit = base + stack_depth;
+    Word* sp = base + this->sp;
+    Word tos = *sp;
+    Word r0 = reg;
+    uint8_t* const mem = memory.data();
+    uint64_t taken = 0;    // conditional jumps taken since the last fall-through, when tracing
+
+    running = 1;
+    try {
+#ifdef MVM_THREADED_DISPATCH
+        VM_DISPATCH();
+#else
+        VM_COUNT();
+        for (;;) switch (ip->opcode) {
+#endif
+        VM_OP(CALL) {
+            const StackEffect effect = calls[ip->arg].effect;
+            VM_NEED(effect.pops);
+            if (VM_CHECK(limit - sp < effect.pushes - effect.pops))
+                VM_TRAP("Stack overflow");
+            // spill the top of stack so the arguments are contiguous
+            *sp = tos;
+            Word* args = sp + 1 - effect.pops;
+            if (park_sleep && calls[ip->arg].parks) {
+                sleep_request = args[0];
+                sp = args - 1;
+                tos = *sp;
+                status = RUN_SLEEP;
+                ++ip;
+                goto done;
+            }
+            bool yields = calls[ip->arg].yields;
+            if (PROFILE == PROFILE_TRACE) {
+                if (const char* why = trace_call(*ip, args, taken, yields))
+                    VM_TRAP(why);
+                taken = 0;
+            } else {
+                call_host(ip->arg, args);
+            }
+            sp = args + effect.pushes - 1;
+            tos = *sp;
+            budget -= ip->cost;
+            if (!running || budget <= 0 || yields) {
+                ++ip;
+                goto preempted;
+            }
+            VM_NEXT();
+        }
+        VM_OP(NOP) {
+            VM_NEXT();
+        }
+        VM_OP(PUSH) {
+            VM_PUSH(ip->arg);
+            VM_NEXT();
         }
-    } 
+        VM_OP(POP) {
+            VM_NEED(1);
+            r0 = tos;
+            tos = *--sp;
+            VM_NEXT();
+        }
+        VM_OP(LOAD) {
+            VM_PUSH(r0);
+            VM_NEXT();
+        }
+        MVM_BINARY_OPS(VM_BINARY)
+        VM_OP(NEG) {
+            VM_NEED(1);
+            tos = ~tos;
+            VM_NEXT();
+        }
+        VM_OP(JMP) {
+            VM_JUMP();
+        }
+        VM_BRANCH(JMPZ, tos == 0)
+        VM_BRANCH(JMPNZ, tos != 0)
+        VM_OP(PRINT) {
+            VM_NEED(1);
+            out->print(tos);
+            VM_NEXT();
+        }
+        VM_OP(HALT) {
+            out->flush();
+            MVM_LOG("HALT\n");
+            running = 0;
+            status = RUN_HALTED;
+            ++ip;
+            goto done;
+        }
+        VM_OP(LOADM) {
+            VM_NEED(1);
+            tos = load_word<Word>(mem, tos);
+            VM_NEXT();
+        }
+        VM_OP(STOREM) {
+            VM_NEED(2);
+            Word a = tos;
+            Word b = *--sp;
+            store_word<Word>(mem, a, b);
+            tos = *--sp;
+            VM_NEXT();
+        }
+        VM_OP(LOADX) {
+            VM_PUSH(load_word<Word>(mem, (Word)(ip->arg + r0)));
+            VM_NEXT();
+        }
+        VM_OP(STOREX) {
+            VM_NEED(1);
+            store_word<Word>(mem, (Word)(ip->arg + r0), tos);
+            tos = *--sp;
+            VM_NEXT();
+        }
+        VM_VECTOR(MFILL, 3, 0)
+        VM_VECTOR(MCOPY, 3, 0)
+        VM_VECTOR(VADD, 4, 0)
+        VM_VECTOR(VSUB, 4, 0)
+        VM_VECTOR(VMUL, 4, 0)
+        VM_VECTOR(VAND, 4, 0)
+        VM_VECTOR(VOR, 4, 0)
+        VM_VECTOR(VXOR, 4, 0)
+        VM_VECTOR(VEQ, 4, 0)
+        VM_VECTOR(VLT, 4, 0)
+        VM_VECTOR(VGT, 4, 0)
+        VM_VECTOR(VSUM, 2, 1)
+        VM_VECTOR(VMIN, 2, 1)
+        VM_VECTOR(VMAX, 2, 1)
+        VM_OP(EXIT) {
+            goto done;
+        }
+        MVM_BINARY_OPS(VM_FUSED_BINARY)
+        MVM_COMPARE_OPS(VM_FUSED_COMPARE)
+        VM_OP(PUSH_POP) {
+            if (VM_CHECK(sp == limit))
+                goto op_PUSH;
+            r0 = ip->arg;
+            ip += 2;
+            VM_DISPATCH();
+        }
+        VM_OP(PRINT_POP) {
+            if (VM_CHECK(sp == base))
+                goto op_PRINT;
+            out->print(tos);
+            r0 = tos;
+            tos = *--sp;
+            ip += 2;
+            VM_DISPATCH();
+        }
+        VM_OP(TRAP) {
+            switch (ip->arg) {
+                case TRAP_INVALID_OPCODE:
+                    VM_TRAP("Invalid opcode " + std::to_string((unsigned char)program.at(ip->pc)));
+                case TRAP_TRUNCATED_OPERAND:
+                    VM_TRAP("Truncated operand");
+                case TRAP_INVALID_CALL:
+                    VM_TRAP("Invalid call");
+                default:
+                    VM_TRAP("Invalid jump target");
+            }
+        }
+#ifndef MVM_THREADED_DISPATCH
+        default:
+            goto done;
+        }
+#endif
+    preempted:
+        status = running ? RUN_YIELD : RUN_STOPPED;
+    done:
+        VM_SYNC();
+        running = 0;
+        if (PROFILE == PROFILE_SAMPLE)
+            sampler->current = nullptr;
+        if (PROFILE == PROFILE_TRACE)
+            tracer->taken = taken;
+        flush_calls();
+        out->flush();
+        return status;
+    }
     CATCH
+    running = 0;
+    if (PROFILE == PROFILE_SAMPLE)
+        sampler->current = nullptr;
+    if (PROFILE == PROFILE_TRACE)
+        tracer->taken = taken;
+    return RUN_TRAP;
 }
-void mvm::stop() {
+
+#undef VM_OP
+#undef VM_DISPATCH
+#undef VM_COUNT
+#undef VM_NEXT
+#undef VM_JUMP
+#undef VM_TAKEN
+#undef VM_FELL_THROUGH
+#undef VM_SYNC
+#undef VM_TRAP
+#undef VM_CHECK
+#undef VM_NEED
+#undef VM_PUSH
+#undef VM_BINARY
+#undef VM_BRANCH
+#undef VM_VECTOR
+#undef VM_FUSED_BINARY
+#undef VM_FUSED_COMPARE
+
+template <class Word>
+void basic_mvm<Word>::stop() {
     running = 0;
-}
\ No newline at end of file
+}
+#define INSTANTIATE(W)                                                          \
+    template bool basic_mvm<W>::decompile(std::string, std::string);           \
+    template bool basic_mvm<W>::save(std::string);                             \
+    template bool basic_mvm<W>::load(std::string);                             \
+    template bool basic_mvm<W>::load(const void*, size_t);                     \
+    template bool basic_mvm<W>::load_image(MvmbImage, const std::string&);     \
+    template void basic_mvm<W>::reset();                                       \
+    template void basic_mvm<W>::set_trap(const char*);                         \
+    template void basic_mvm<W>::resolve_imports();                             \
+    template std::vector<StackEffect> basic_mvm<W>::call_effects() const;      \
+    template void basic_mvm<W>::flush_calls();                                 \
+    template uint32_t basic_mvm<W>::source_line(W) const;                      \
+    template bool basic_mvm<W>::decode();                                      \
+    template void basic_mvm<W>::fuse();                                        \
+    template RunStatus basic_mvm<W>::start();                                  \
+    template RunStatus basic_mvm<W>::run(int64_t, bool);                       \
+    template RunStatus basic_mvm<W>::execute<PROFILE_TRACE, false>(int64_t, bool); \
+    template RunStatus basic_mvm<W>::execute<PROFILE_TRACE, true>(int64_t, bool); \
+    template void basic_mvm<W>::stop();
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
+
+std::unique_ptr<any_mvm> create_mvm(unsigned word_bits, size_t stack_depth, const host_functions* host) {
+    std::unique_ptr<any_mvm> vm;
+    switch (word_bits) {
+        case 16:
+            vm = std::make_unique<mvm>(stack_depth);
+            break;
+        case 32:
+            vm = std::make_unique<mvm32>(stack_depth);
+            break;
+        case 64:
+            vm = std::make_unique<mvm64>(stack_depth);
+            break;
+        default:
+            return nullptr;
+    }
+    vm->set_host_functions(host);
+    return vm;
+}
+
+// The header is read twice this way, but only the first page of a mapping
+std::unique_ptr<any_mvm> load_mvm(const std::string& path, size_t stack_depth, const host_functions* host,
+                                  std::string* error) {
+    MvmbImage image;
+    std::string problem;
+    if (!read_mvmb(path, image, &problem)) {
+        if (error)
+            *error = problem;
+        return nullptr;
+    }
+    auto vm = create_mvm(image.word_bits, stack_depth, host);
+    if (!vm->load(path)) {
+        if (error)
+            *error = vm->last_error();
+        return nullptr;
+    }
+    return vm;
+}
+
+std::unique_ptr<any_mvm> load_mvm(const void* data, size_t size, size_t stack_depth, const host_functions* host,
+                                  std::string* error) {
+    MvmbImage image;
+    std::string problem;
+    if (!read_mvmb(data, size, image, &problem)) {
+        if (error)
+            *error = problem;
+        return nullptr;
+    }
+    auto vm = create_mvm(image.word_bits, stack_depth, host);
+    if (!vm->load(data, size)) {
+        if (error)
+            *error = vm->last_error();
+        return nullptr;
+    }
+    return vm;
+}
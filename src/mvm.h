@@ -3,31 +3,74 @@
 #define INSN_TYPE   char
 #define INSN_SIZE   (sizeof(char))
 
+// Word of the default 16-bit VM, the only one the native backends generate
+// code for. basic_mvm itself is a template over the word type.
 #define DATA_TYPE   unsigned short
 #define DATA_SIZE   (sizeof(unsigned short))
 
-#define CATCH               catch (std::exception& e) {                                          \
-                                cerr << "An exception occurred!\n\n";                             \
-                                cerr << e.what() << endl;                                         \
-                                cerr << "PC: 0x" << std::hex << pc << endl;                       \
-                                cerr << "R0: 0x" << std::hex << reg << endl;                      \
-                                cerr << "program size: 0x" << std::hex << program.size() << endl; \
-                           }                                                                      \
-
-// disable logging on Release
-#ifndef _DEBUG
-#define LOG        / ## /
+// Word types there is a VM build of, see basic_mvm
+#define MVM_WORD_TYPES(X)   X(uint16_t) X(uint32_t) X(uint64_t)
+
+#define STACK_DEPTH 256
+
+// Records the exception as the VM's trap, see last_error. Nothing is printed,
+// whoever runs the VM decides what to do with it.
+#define CATCH               catch (std::exception& e) {         \
+                                set_trap(e.what());             \
+                            }
+
+// Debug builds note HALT on stdout after the program's output, release
+// builds compile the statement away
+#ifdef _DEBUG
+#define MVM_LOG(text)       (cout << (text))
 #else
-#define LOG        cout
+#define MVM_LOG(text)       ((void)0)
 #endif
 
+#include "cache.h"
+#include "export.h"
+#include "host.h"
+#include "memory.h"
+#include "mvmb.h"
+#include "output.h"
+
 #include <iostream>
-#include <stack>
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <memory>
+
+// computed goto is a GNU extension, other compilers use the switch loop
+#if defined(__GNUC__) || defined(__clang__)
+#define MVM_THREADED_DISPATCH
+#endif
+
+// the native backend emits x86-64 code into mmap'd memory
+#if defined(__x86_64__) && defined(__unix__)
+#define MVM_JIT
+#endif
 
 using namespace std;
 
+// Binary operators and their result, with a the top of stack and b the
+// value below it. Used to generate both the plain and fused handlers.
+#define MVM_COMPARE_OPS(X)  X(EQU, a == b) X(NEQU, a != b) X(GT, a > b) \
+                            X(GTEQ, a >= b) X(LT, a < b) X(LTEQ, a <= b)
+#define MVM_ARITH_OPS(X)    X(ADD, a + b) X(SUB, b - a) X(MUL, a * b) X(DIV, b / a) \
+                            X(XOR, a ^ b) X(OR, a | b) X(MOD, a % b) X(AND, a & b)
+#define MVM_BINARY_OPS(X)   MVM_COMPARE_OPS(X) MVM_ARITH_OPS(X)
+
+// Every opcode the assembler accepts and its number of operands
+#define MVM_MNEMONICS(X)    X(CALL, 1) X(NOP, 0) X(PUSH, 1) X(POP, 0) X(LOAD, 0)                    \
+                            X(EQU, 0) X(NEQU, 0) X(GT, 0) X(GTEQ, 0) X(LT, 0) X(LTEQ, 0)            \
+                            X(ADD, 0) X(SUB, 0) X(MUL, 0) X(DIV, 0)                                 \
+                            X(XOR, 0) X(OR, 0) X(MOD, 0) X(NEG, 0) X(AND, 0)                        \
+                            X(JMP, 1) X(JMPZ, 1) X(JMPNZ, 1) X(PRINT, 0) X(HALT, 0)                 \
+                            X(LOADM, 0) X(STOREM, 0) X(LOADX, 1) X(STOREX, 1)                       \
+                            X(MFILL, 0) X(MCOPY, 0)                                                 \
+                            X(VADD, 0) X(VSUB, 0) X(VMUL, 0) X(VAND, 0) X(VOR, 0) X(VXOR, 0)        \
+                            X(VEQ, 0) X(VLT, 0) X(VGT, 0) X(VSUM, 0) X(VMIN, 0) X(VMAX, 0)
+
 enum OpCode {
     CALL,
 
@@ -63,6 +106,93 @@ enum OpCode {
     PRINT,
 
     HALT,
+
+    // guest memory, see memory.h. LOADM and STOREM take the address from the
+    // top of stack, the indexed forms address operand + R0
+    LOADM,
+    STOREM,
+    LOADX,
+    STOREX,
+
+    // Bulk operations over uint16 elements of guest memory, see vector.h.
+    // Operands are on the stack, deepest first: MFILL dst, value, count;
+    // MCOPY dst, src, count; VADD ... VGT dst, x, y, count; and VSUM, VMIN
+    // and VMAX src, count, which push their result.
+    MFILL,
+    MCOPY,
+    VADD,
+    VSUB,
+    VMUL,
+    VAND,
+    VOR,
+    VXOR,
+    VEQ,            // compares set an element to 0xFFFF where they hold, 0 elsewhere
+    VLT,
+    VGT,
+    VSUM,
+    VMIN,
+    VMAX,
+
+    // internal opcodes, only ever produced by mvm::decode
+    EXIT,
+    TRAP,
+
+    // superinstructions, only ever produced by mvm::fuse
+#define FUSED_ENUM(o, e)    LOAD_PUSH_##o, LOAD_PUSH_##o##_POP, PUSH_##o, o##_PRINT_POP,
+    MVM_BINARY_OPS(FUSED_ENUM)
+#undef FUSED_ENUM
+#define FUSED_ENUM(o, e)    LOAD_PUSH_##o##_JMPZ, LOAD_PUSH_##o##_JMPNZ, o##_JMPZ, o##_JMPNZ,
+    MVM_COMPARE_OPS(FUSED_ENUM)
+#undef FUSED_ENUM
+    PUSH_POP,
+    PRINT_POP,
+
+    NUM_OPCODES
+};
+
+enum TrapReason {
+    TRAP_INVALID_OPCODE,
+    TRAP_TRUNCATED_OPERAND,
+    TRAP_INVALID_JUMP,
+    TRAP_INVALID_CALL,
+
+    // only raised by the register tier, where stack depths are static
+    TRAP_STACK_UNDERFLOW,
+    TRAP_STACK_OVERFLOW,
+};
+
+// Opcodes of the register tier, see mvm::translate_registers. Binary ops come
+// in three forms: both operands in registers, a immediate (_AI) or b
+// immediate (_BI). Everything before R_JMP writes the dst register.
+enum RegOpCode : uint8_t {
+    R_MOV,
+    R_MOVI,
+    R_NEG,
+#define REG_ENUM(o, e)      R_##o, R_##o##_AI, R_##o##_BI,
+    MVM_BINARY_OPS(REG_ENUM)
+#undef REG_ENUM
+    R_LOADM,        // dst = memory[a + imm]
+    R_LOADMI,       // dst = memory[imm]
+
+    R_JMP,
+    R_JMPZ,
+    R_JMPNZ,
+#define REG_ENUM(o, e)      R_##o##_JMPZ, R_##o##_AI_JMPZ, R_##o##_BI_JMPZ, \
+                            R_##o##_JMPNZ, R_##o##_AI_JMPNZ, R_##o##_BI_JMPNZ,
+    MVM_COMPARE_OPS(REG_ENUM)
+#undef REG_ENUM
+
+    R_PRINT,
+    R_PRINTI,
+    R_STOREM,       // memory[b + imm] = a
+    R_STOREMI,      // memory[imm] = a
+    R_VECTOR,       // bulk opcode imm on the operands from register a, result in dst
+    R_CALL,
+    R_HALT,
+    R_EXIT,
+    R_TRAP,
+
+    NUM_REG_OPCODES
 };
 
 struct Instruction {
@@ -71,68 +201,479 @@ struct Instruction {
     char num_args;
 };
 
-class mvm {
+// A vector VMs share until one of them changes it. Reading never copies;
+// edit() hands out a private copy first if anyone else holds the same items,
+// so a program decoded once runs on any number of VMs and threads.
+template <class T>
+class shared_vector {
 public:
-    mvm() = default;
-    ~mvm() {
-        stop();
+    bool empty() const { return !items || items->empty(); }
+    size_t size() const { return items ? items->size() : 0; }
+    const T* data() const { return items ? items->data() : nullptr; }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size(); }
+    const T& operator[](size_t i) const { return (*items)[i]; }
+
+    void clear() { items.reset(); }
+    void assign(std::vector<T> v) { items = std::make_shared<std::vector<T>>(std::move(v)); }
+    std::vector<T>& edit() {
+        if (!items)
+            items = std::make_shared<std::vector<T>>();
+        else if (items.use_count() > 1)
+            items = std::make_shared<std::vector<T>>(*items);
+        return *items;
     }
 
-protected:
-    char running = 0;
+private:
+    std::shared_ptr<std::vector<T>> items;
+};
 
-    std::stack<DATA_TYPE> stck;
-    DATA_TYPE pc = 0;
-    DATA_TYPE reg = 0;
+// Pre-decoded form of one bytecode instruction, see mvm::decode. A
+// superinstruction replaces the first instruction of its sequence and the
+// others stay in place behind it.
+template <class Word>
+struct DecodedInstruction {
+    const void* handler;    // dispatch target, filled in by mvm::start
+    uint32_t target;        // index of the jump destination in mvm::code
+    Word arg;               // immediate operand
+    Word pc;                // offset of the instruction in mvm::program
+    OpCode opcode;
+    uint16_t cost;          // instructions a taken jump charges to the budget
+};
 
-    #define INS(o,a) { o, #o, a }
-    std::vector<Instruction> instruction_definitions = {
-        INS(CALL, 1),
+// Three-address instruction of the register tier. Register 0 is R0 and
+// register i + 1 holds stack slot i, so the register file is mvm::stck itself.
+// pc and depth are the VM state to report when execution stops on this
+// instruction: its own for traps, where it resumes for everything else.
+template <class Word>
+struct RegInstruction {
+    const void* handler;    // dispatch target, filled in by mvm::start_registers
+    uint32_t target;        // index of the jump destination in mvm::rcode
+    uint16_t dst, a, b;
+    Word imm;
+    Word pc;
+    uint16_t depth;
+    RegOpCode opcode;
+};
 
-        INS(NOP, 0),
+// Block boundary of the register tier, where every stack slot is in its
+// register and execution can start
+template <class Word>
+struct RegEntry {
+    Word pc;
+    uint16_t depth;
+    uint32_t index;
+};
 
-        INS(PUSH, 1),
-        INS(POP, 0),
-        
-        INS(LOAD, 0),
+// Why mvm::run and the start functions returned
+enum RunStatus {
+    RUN_EXIT,       // ran off the end of the program
+    RUN_HALTED,
+    RUN_YIELD,      // budget used up, run again to continue
+    RUN_SLEEP,      // parked on CALL __sleep, see sleep_time
+    RUN_STOPPED,
+    RUN_TRAP,       // see last_error
+    RUN_UNSUPPORTED,    // start_jit and start_registers: that tier can't run the program, nothing ran
+};
 
-        INS(EQU, 0),
-        INS(NEQU, 0),
-        INS(GT, 0),
-        INS(GTEQ, 0),
-        INS(LT, 0),
-        INS(LTEQ, 0),
+// One parsed assembler instruction. Label operands refer to the index of
+// the instruction the label stands before, or the instruction count for a
+// label at the very end.
+struct AsmInstruction {
+    OpCode opcode;
+    uint64_t arg;           // already wrapped to the word size
+    int32_t target;         // -1 unless the operand is a label
+    uint32_t line;          // source line
+};
 
-        INS(ADD, 0),
-        INS(SUB, 0),
-        INS(MUL, 0),
-        INS(DIV, 0),
+// number of word sized operands following the opcode byte
+int operand_count(OpCode op);
 
-        INS(XOR,0),
-        INS(OR, 0),
-        INS(NEG,0),
-        INS(AND,0),
+// Values an instruction takes off the stack and puts back, on the taken path
+// for conditional jumps. PRINT and NEG need one value without changing depth.
+struct StackEffect {
+    int pops;
+    int pushes;
+};
+StackEffect stack_effect(OpCode op);
+
+// A CALL target, a binary's import resolved against a host_functions table
+// by load(). Unbatched functions have 'call', batched ones 'append' and the
+// VM's own queue of their calls; neither means the import isn't bound with
+// that signature.
+template <class Word>
+struct HostCall {
+    void (*call)(void* callable, Word* slots);
+    size_t (*append)(void* queue, const Word* slots);
+    void (*flush)(void* callable, void* queue);
+    std::shared_ptr<void> callable;
+    std::shared_ptr<void> queue;
+    StackEffect effect;
+    bool flush_output;
+    bool parks;             // __sleep, which run(budget, true) hands back instead
+    bool yields;            // bound with HOST_YIELD
+
+    bool bound() const { return call || append; }
+};
+
+// Evaluates a binary operator at compile time, false if it would fault
+template <class Word>
+bool fold_binary(OpCode op, Word a, Word b, Word& result) {
+    // leave division by zero to fault at runtime
+    if ((op == DIV && a == 0) || (op == MOD && b == 0))
+        return false;
+    switch (op) {
+#define FOLD(o, expr)   case o: result = (Word)(expr); return true;
+        MVM_BINARY_OPS(FOLD)
+#undef FOLD
+        default:
+            return false;
+    }
+}
+
+// first instruction of the sequence a superinstruction stands for
+OpCode unfused_opcode(OpCode op);
+// number of instructions a superinstruction stands for, 1 for plain ones
+int fused_length(OpCode op);
+
+struct Profile;
+struct Sampler;
+struct Tracer;
+class execution;
+struct vm_snapshot;
+
+// Instrumentation compiled into an instantiation of mvm::execute
+enum ProfileMode {
+    PROFILE_OFF,
+    PROFILE_COUNT,      // count every dispatch and taken jump, see profile.h
+    PROFILE_SAMPLE,     // publish the dispatched instruction, see sampler.h
+    PROFILE_TRACE,      // record or replay branch outcomes and CALLs, see trace.h
+};
+
+// What running a binary needs, whatever its word size. The CLI, the
+// scheduler and programs embedding libmvm hold VMs through this, see
+// create_mvm and load_mvm. A VM is a self-contained context: nothing it runs
+// touches another VM or exits the process, so one process can load, run and
+// reset any number of them, each on one thread at a time.
+class any_mvm {
+public:
+    virtual ~any_mvm() {}
+
+    virtual bool load(std::string path) = 0;
+    // loads a binary from memory, which the VM copies
+    virtual bool load(const void* data, size_t size) = 0;
+    // Back to the entry point of the loaded program with an empty stack, R0
+    // and memory zeroed. Decoding, verification and generated code are kept,
+    // so running a program again costs only the run.
+    virtual void reset() = 0;
+    // Runs the program loaded into 'other', a VM of the same word size, and
+    // shares its decoding and verification instead of redoing them. Only
+    // the stack, R0, pc and memory are this VM's own. 'other' must stay
+    // loaded with it while this VM runs it.
+    virtual bool attach(const any_mvm& other) = 0;
+    // the word size of the binaries this VM runs
+    virtual unsigned bits() const = 0;
+    // copies 'size' bytes into memory from 'address' on, wrapping around
+    // like STOREM; reset() zeroes them again
+    virtual void write_memory(uint64_t address, const void* data, size_t size) = 0;
+    // The program, pc, R0, stack and memory as they are between runs, for
+    // restore() and fork_mvm to start VMs from. nullptr if nothing is loaded.
+    virtual std::shared_ptr<const vm_snapshot> snapshot() = 0;
+    // Attaches to the snapshot's program unless already attached to it and
+    // takes on its state. Memory is mapped copy-on-write where the platform
+    // allows it, so restoring costs a stack copy and a page table update.
+    virtual bool restore(const vm_snapshot& snapshot) = 0;
+    virtual bool verify(std::string& error) = 0;
+    virtual RunStatus start() = 0;
+    virtual RunStatus start_jit() = 0;
+    virtual RunStatus start_registers() = 0;
+    virtual RunStatus run(int64_t budget, bool park_sleep = false) = 0;
+    // runs the first 'budget' instructions of a run that continues in slices
+    // of as many, see execution
+    execution run_for(int64_t budget);
+    virtual void stop() = 0;
+    // why the last load failed or the last run trapped, with pc, line and R0
+    // for traps; empty otherwise
+    virtual const std::string& last_error() const = 0;
+    virtual uint64_t sleep_time() const = 0;
+    virtual void set_output(output_sink* sink) = 0;
+    virtual void set_host_functions(const host_functions* functions) = 0;
+    virtual void set_cache(const artifact_cache* cache) = 0;
+    virtual void enable_profiling(std::string report_path) = 0;
+    virtual bool enable_sampling(std::string folded_path) = 0;
+    virtual bool enable_tracing(std::string trace_path) = 0;
+    virtual bool enable_replay(std::string trace_path) = 0;
+};
+
+// A run of a VM in slices, for hosts that interleave scripts with their own
+// event loop. Every slice runs about 'budget' instructions and returns at
+// the next taken jump or CALL after them, or right after a CALL of a
+// HOST_YIELD function, so a slice pauses the host for a bounded time. CALL
+// __sleep ends a slice with RUN_SLEEP instead of blocking; the host resumes
+// once sleep_time() has passed. The VM keeps all state in between, the
+// handle only remembers how the last slice ended.
+class execution {
+public:
+    execution(any_mvm& vm, int64_t budget) : vm(&vm), budget(budget) {}
+
+    // runs the next slice, or nothing once the run is finished
+    RunStatus resume() {
+        if (!finished())
+            last = vm->run(budget, true);
+        return last;
+    }
+    // how the last slice ended, RUN_YIELD before the first
+    RunStatus status() const { return last; }
+    // halted, ran off the end, stopped or trapped
+    bool finished() const { return last != RUN_YIELD && last != RUN_SLEEP; }
+    // after RUN_SLEEP, the time CALL __sleep asked for
+    uint64_t sleep_time() const { return vm->sleep_time(); }
+    any_mvm& machine() const { return *vm; }
+
+private:
+    any_mvm* vm;
+    int64_t budget;
+    RunStatus last = RUN_YIELD;
+};
 
-        INS(JMP, 1),
-        INS(JMPZ, 1),
-        INS(JMPNZ, 1),
+inline execution any_mvm::run_for(int64_t budget) {
+    execution run(*this, budget);
+    run.resume();
+    return run;
+}
+
+// The VM over one word type. Stack, R0, immediates and jump operands are all
+// a Word, so every instantiation gets its own dispatch code and arithmetic
+// is a single native operation. Binaries record the word size they were
+// assembled for and only load into the matching instantiation.
+template <class Word>
+class basic_mvm : public any_mvm {
+public:
+    static constexpr unsigned word_bits = sizeof(Word) * 8;
+    template <class> friend class basic_mvm;
 
-        INS(PRINT, 0),
+    explicit basic_mvm(size_t stack_depth = STACK_DEPTH)
+        : stck(stack_depth + 1), stack_depth(stack_depth) {}
+    ~basic_mvm() {
+        stop();
+        free_jit();
+    }
 
-        INS(HALT, 0),
+protected:
+    char running = 0;
+
+    // Operand stack, element i lives in stck[i + 1] and sp is the current
+    // depth. stck[0] is a scratch slot so the interpreter can keep the top
+    // of stack in a register without special-casing an empty stack.
+    std::vector<Word> stck;
+    size_t stack_depth;
+    size_t sp = 0;
+    Word pc = 0;
+    Word reg = 0;
+    size_t resume = 0;              // index in 'code' of pc, if still valid
+    Word sleep_request = 0;
+
+    // what LOADM and friends address, zeroed whenever a program is loaded
+    guest_memory memory;
+
+    // CALL operand i calls calls[i], the binary's imports resolved against
+    // 'host' by load()
+    const host_functions* host = &host_functions::defaults();
+    // where compile() and the JIT keep what they generate, if anywhere
+    const artifact_cache* cache = artifact_cache::defaults();
+    std::vector<HostCall<Word>> calls;
+    HostCall<Word>* queued = nullptr;   // batched function whose queue holds calls
+
+    void resolve_imports();
+    // CALL's effect depends on the function it calls
+    StackEffect effect_of(const DecodedInstruction<Word>& insn) const {
+        OpCode op = unfused_opcode(insn.opcode);
+        return op == CALL ? calls[insn.arg].effect : stack_effect(op);
+    }
+    std::vector<StackEffect> call_effects() const;
+
+    // where PRINT goes, see set_output
+    buffered_sink stdout_sink;
+    output_sink* out = &stdout_sink;
+
+    #define INS(o,a) { o, #o, a },
+    std::vector<Instruction> instruction_definitions = {
+        MVM_MNEMONICS(INS)
     };
     #undef INS
 
-    vector<char> program = {};
+    // the mapped .mvmb and its code section, which is what runs
+    MvmbImage image;
+    ByteSpan program;
+    // the program VM of the last snapshot taken or restored, so snapshots
+    // share it and restores of it needn't attach again
+    std::shared_ptr<const any_mvm> origin;
+    // decoded by load() and shared with every VM attached to this one
+    shared_vector<DecodedInstruction<Word>> code;
+
+    // what last_error returns
+    std::string error;
+    void set_trap(const char* what);
+
+    // takes over a read image, 'name' is what errors call it
+    bool load_image(MvmbImage loaded, const std::string& name);
+    bool decode();
+    void fuse();
+    // installs the interpreter's handlers in 'code' ahead of the first run,
+    // so the VMs attached to this one never have to write to it
+    void prepare();
+
+    // set by load() once verify() passed, run() then drops every runtime check
+    bool verified = false;
+    size_t max_depth = 0;           // deepest the verified program's stack gets
+
+    // register tier, translated from 'code' on first use
+    shared_vector<RegInstruction<Word>> rcode;
+    shared_vector<RegEntry<Word>> reg_entries;
+
+    bool translate_registers();
+
+    // native code for 'code', jit_labels maps each decoded index to its offset
+    void* jit_code = nullptr;
+    size_t jit_size = 0;
+    std::vector<uint32_t> jit_labels;
+
+    bool compile_jit();
+    void free_jit();
+
+    // set while profiling, run() then uses the counting instantiation
+    std::shared_ptr<Profile> profile;
+    std::string profile_path;
+    const void* const* dispatch_table = nullptr;    // handlers installed in 'code'
+
+    // set while sampling, run() then publishes every dispatch for the timer
+    std::shared_ptr<Sampler> sampling;
+    std::string sampling_path;
+
+    // set while tracing or replaying, run() then goes through run_traced
+    std::shared_ptr<Tracer> tracer;
+    bool state_changed = true;      // reset, restored or written to since the last traced run
+    RunStatus run_traced(int64_t budget, bool park_sleep);
+    void record_state();
+    bool replay_state();
+    // CALL of 'insn' on 'args' in the tracing instantiation, 'taken' jumps
+    // after the last fall-through: records the call, or takes its results
+    // from the trace. 'yields' is the function's own, or the recorded one.
+    // Why the call traps, or nullptr.
+    const char* trace_call(const DecodedInstruction<Word>& insn, Word* args, uint64_t taken, bool& yields);
+
+    template <int PROFILE, bool CHECKED>
+    RunStatus execute(int64_t budget, bool park_sleep);
+    // stops the sampler and writes its stacks to sampling_path
+    void finish_sampling();
+    bool write_perf_map() const;
 
 public:
-    bool compile(std::string path, std::string output);
-    void translate_to_x64_asm(std::string path, std::string output);
+    // Neither touches the VM, so compile_all runs compile on many threads.
+    // Sources without a .width directive are assembled for this VM's word.
+    bool compile(std::string path, std::string output, bool optimize = false) const;
+    // compiles every .mvms in 'dir' into 'output_dir' across all cores
+    bool compile_all(std::string dir, std::string output_dir, bool optimize = false) const;
+    bool compile_native(std::string path, std::string output);
     bool decompile(std::string path, std::string output);
-    void execute(INSN_TYPE opcode);
     bool save(std::string path);
-    bool load(std::string path);
+    bool load(std::string path) override;
+    bool load(const void* data, size_t size) override;
+    void reset() override;
+    bool attach(const any_mvm& other) override;
+    unsigned bits() const override { return word_bits; }
+    void write_memory(uint64_t address, const void* data, size_t size) override;
+    std::shared_ptr<const vm_snapshot> snapshot() override;
+    bool restore(const vm_snapshot& snapshot) override;
+    const std::string& last_error() const override { return error; }
+    // source line of the instruction at 'pc' from the debug line map, 0 if unknown
+    uint32_t source_line(Word pc) const;
+    // Proves the loaded program can't fault: every instruction decodes, every
+    // jump lands on an instruction, every CALL has a function and the stack
+    // has the same depth on all paths into an instruction, never below zero
+    // and never above stack_depth. 'error' says why not, with pc and line.
+    bool verify(std::string& error) override;
+
+    // runs to the end and writes the profile and samples asked for
+    RunStatus start() override;
+    RunStatus run(int64_t budget, bool park_sleep = false) override;
+    // Counts every instruction, branch and sampled cycle from here on; start()
+    // writes the report to 'report_path' once the program ends
+    void enable_profiling(std::string report_path) override;
+    bool write_profile(std::string path) const;
+    // Samples where the interpreter or the JIT spends CPU time from here on;
+    // start() and start_jit() write folded stacks to 'folded_path' once the
+    // program ends. The JIT also writes /tmp/perf-<pid>.map for Linux perf.
+    // False where the platform has no SIGPROF.
+    bool enable_sampling(std::string folded_path) override;
+    bool write_samples(std::string path) const;
+    // Records every run() on the interpreter from here on into 'trace_path':
+    // the state the host gives the VM, conditional branch outcomes and
+    // every CALL with its arguments and results. False if the file can't
+    // be created.
+    bool enable_tracing(std::string trace_path) override;
+    // Replays a trace of the loaded binary: every run() picks up the state
+    // and budget of the recorded one, CALLs take their results from the
+    // trace instead of calling anything, and a run that departs from the
+    // recorded one traps. Imports need no host functions bound.
+    bool enable_replay(std::string trace_path) override;
+    // "label" or "label+offset" for the closest label at or before pc, empty
+    // if the binary has no symbols
+    std::string symbol_at(Word pc) const;
+    uint64_t sleep_time() const override { return sleep_request; }
+    // sends PRINT to 'sink' instead of the VM's own buffered stdout, nullptr
+    // switches back; the sink must outlive every run
+    void set_output(output_sink* sink) override { out = sink ? sink : &stdout_sink; }
+    // resolves CALL against 'functions' from the next load() or compile() on,
+    // nullptr switches back to host_functions::defaults()
+    void set_host_functions(const host_functions* functions) override {
+        host = functions ? functions : &host_functions::defaults();
+    }
+    // Keeps assembled binaries and JIT code in 'cache' from now on, so later
+    // processes skip compile() and code generation for them; nullptr turns
+    // caching off. The default is artifact_cache::defaults().
+    void set_cache(const artifact_cache* cache) override { this->cache = cache; }
+    // CALL of host function 'index' on the arguments at 'slots', which get
+    // its results. Batched functions only queue the call.
+    void call_host(size_t index, Word* slots) {
+        HostCall<Word>& f = calls[index];
+        if (f.call) {
+            if (queued)
+                flush_calls();
+            if (f.flush_output)
+                out->flush();
+            f.call(f.callable.get(), slots);
+            return;
+        }
+        if (queued != &f) {
+            if (queued)
+                flush_calls();
+            queued = &f;
+        }
+        if (f.append(f.queue.get(), slots) >= HOST_BATCH)
+            flush_calls();
+    }
+    // hands the queued calls of a batched function over
+    void flush_calls();
+    // native code is only generated for 16-bit words, the others return
+    // RUN_UNSUPPORTED
+    RunStatus start_jit() override;
+    RunStatus start_registers() override;
+    void stop() override;
+};
 
-    void start();
-    void stop();
-};
\ No newline at end of file
+using mvm = basic_mvm<uint16_t>;
+using mvm32 = basic_mvm<uint32_t>;
+using mvm64 = basic_mvm<uint64_t>;
+
+// An empty VM of 'word_bits' (16, 32 or 64) that resolves CALLs against
+// 'host' or the defaults, nullptr for other word sizes
+MVM_API std::unique_ptr<any_mvm> create_mvm(unsigned word_bits = 16, size_t stack_depth = STACK_DEPTH,
+                                            const host_functions* host = nullptr);
+// Loads 'path' into a VM of the word size the binary was assembled for,
+// nullptr if it can't be loaded, with the reason in 'error' if given
+MVM_API std::unique_ptr<any_mvm> load_mvm(const std::string& path, size_t stack_depth = STACK_DEPTH,
+                                          const host_functions* host = nullptr, std::string* error = nullptr);
+// The same for a binary in memory, which the VM copies
+MVM_API std::unique_ptr<any_mvm> load_mvm(const void* data, size_t size, size_t stack_depth = STACK_DEPTH,
+                                          const host_functions* host = nullptr, std::string* error = nullptr);
\ No newline at end of file
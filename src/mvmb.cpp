@@ -0,0 +1,387 @@
+#include "mvmb.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#ifdef _MSC_VER
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mapped_file::~mapped_file() {
+    if (!mapped)
+        return;
+#ifdef _MSC_VER
+    UnmapViewOfFile(data);
+#else
+    munmap((void*)data, size);
+#endif
+}
+
+std::shared_ptr<mapped_file> mapped_file::open(const std::string& path) {
+    std::shared_ptr<mapped_file> file(new mapped_file());
+
+#ifdef _MSC_VER
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(handle, &size) && size.QuadPart > 0) {
+            HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping) {
+                file->data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                file->size = (size_t)size.QuadPart;
+                file->mapped = file->data != nullptr;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(handle);
+    }
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* mem = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mem != MAP_FAILED) {
+                file->data = (const char*)mem;
+                file->size = (size_t)st.st_size;
+                file->mapped = true;
+            }
+        }
+        close(fd);
+    }
+#endif
+    if (file->mapped)
+        return file;
+
+    // pipes, empty files and anything else mmap refuses
+    std::ifstream in(path, std::ios::binary);
+    if (!in.good())
+        return nullptr;
+    file->copy.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    if (file->copy.empty())
+        return nullptr;
+    file->data = file->copy.data();
+    file->size = file->copy.size();
+    return file;
+}
+
+std::shared_ptr<mapped_file> mapped_file::copy_of(const void* data, size_t size) {
+    if (!data || !size)
+        return nullptr;
+    std::shared_ptr<mapped_file> file(new mapped_file());
+    file->copy.assign((const char*)data, (const char*)data + size);
+    file->data = file->copy.data();
+    file->size = file->copy.size();
+    return file;
+}
+
+static bool valid_symbols(ByteSpan span) {
+    uint32_t count;
+    if (span.size() < sizeof(count))
+        return false;
+    memcpy(&count, span.data(), sizeof(count));
+    if (count > (span.size() - sizeof(count)) / sizeof(MvmbSymbol))
+        return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        MvmbSymbol symbol;
+        memcpy(&symbol, span.data() + sizeof(count) + i * sizeof(MvmbSymbol), sizeof(symbol));
+        if (symbol.name > span.size() || symbol.length > span.size() - symbol.name)
+            return false;
+    }
+    return true;
+}
+
+static bool valid_imports(ByteSpan span) {
+    uint32_t count;
+    if (span.size() < sizeof(count))
+        return false;
+    memcpy(&count, span.data(), sizeof(count));
+    if (count > (span.size() - sizeof(count)) / sizeof(MvmbImport))
+        return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        MvmbImport import;
+        memcpy(&import, span.data() + sizeof(count) + i * sizeof(MvmbImport), sizeof(import));
+        if (import.name > span.size() || import.length > span.size() - import.name)
+            return false;
+    }
+    return true;
+}
+
+static bool fail(std::string* error, std::string message) {
+    if (error)
+        *error = std::move(message);
+    return false;
+}
+
+// locates the sections of whatever image.file holds
+static bool parse_mvmb(MvmbImage& image, std::string* error) {
+    ByteSpan bytes = image.file->bytes();
+    if (bytes.size() < sizeof(MvmbHeader) || memcmp(bytes.data(), MVMB_MAGIC, 4) != 0) {
+        image.code = bytes;
+        return true;
+    }
+
+    MvmbHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    if (header.version != MVMB_VERSION || (header.flags & ~MVMB_KNOWN_FLAGS) != 0 ||
+        (header.flags & MVMB_WORD_MASK) > 2) {
+        return fail(error, "Unsupported .mvmb version " + std::to_string(header.version));
+    }
+    if (header.num_sections > MVMB_MAX_SECTIONS ||
+        sizeof(header) + header.num_sections * sizeof(MvmbSection) > bytes.size()) {
+        return fail(error, "Truncated .mvmb section table");
+    }
+
+    bool has_code = false;
+    for (uint16_t i = 0; i < header.num_sections; ++i) {
+        MvmbSection section;
+        memcpy(&section, bytes.data() + sizeof(header) + i * sizeof(MvmbSection), sizeof(section));
+        if (section.offset % MVMB_ALIGN || section.offset > bytes.size() || section.size > bytes.size() - section.offset) {
+            return fail(error, "Invalid .mvmb section " + std::to_string(i));
+        }
+
+        ByteSpan span = { bytes.data() + section.offset, (size_t)section.size };
+        switch (section.type) {
+            case SECTION_CODE:
+                image.code = span;
+                has_code = true;
+                break;
+            case SECTION_JUMP_TARGETS:
+                if (span.size() % sizeof(uint32_t) == 0)
+                    image.jump_targets = span;
+                break;
+            case SECTION_LINES:
+                if (span.size() % sizeof(MvmbLine) == 0)
+                    image.lines = span;
+                break;
+            case SECTION_SYMBOLS:
+                if (valid_symbols(span))
+                    image.symbols = span;
+                break;
+            case SECTION_IMPORTS:
+                // CALL operands would mean something else without it
+                if (!valid_imports(span))
+                    return fail(error, "Invalid .mvmb import section");
+                image.imports = span;
+                break;
+            default:
+                // sections this version doesn't know about are skipped
+                break;
+        }
+    }
+
+    if (!has_code || image.code.empty() || header.entry > image.code.size()) {
+        return fail(error, "Invalid .mvmb code section");
+    }
+    image.version = header.version;
+    image.entry = header.entry;
+    image.word_bits = 16u << (header.flags & MVMB_WORD_MASK);
+    return true;
+}
+
+bool read_mvmb(const std::string& path, MvmbImage& image, std::string* error) {
+    image = MvmbImage();
+    image.file = mapped_file::open(path);
+    if (!image.file)
+        return fail(error, "Could not read '" + path + "'");
+    return parse_mvmb(image, error);
+}
+
+bool read_mvmb(const void* data, size_t size, MvmbImage& image, std::string* error) {
+    image = MvmbImage();
+    image.file = mapped_file::copy_of(data, size);
+    if (!image.file)
+        return fail(error, "Empty binary");
+    return parse_mvmb(image, error);
+}
+
+static void write_padding(std::ofstream& out, uint64_t& offset) {
+    static const char zeros[MVMB_ALIGN] = {};
+    size_t pad = (size_t)((MVMB_ALIGN - offset % MVMB_ALIGN) % MVMB_ALIGN);
+    out.write(zeros, pad);
+    offset += pad;
+}
+
+bool write_mvmb(const std::string& path, uint32_t entry, ByteSpan code, ByteSpan jump_targets, ByteSpan lines,
+                ByteSpan symbols, ByteSpan imports, unsigned word_bits) {
+    std::string temp = path + ".tmp";
+    std::ofstream out(temp, std::ios::binary);
+    if (!out.good())
+        return false;
+
+    std::vector<MvmbSection> sections;
+    std::vector<ByteSpan> contents;
+    auto add = [&](MvmbSectionType type, ByteSpan span) {
+        if (type != SECTION_CODE && span.empty())
+            return;
+        sections.push_back({ type, 0, 0, span.size() });
+        contents.push_back(span);
+    };
+    add(SECTION_CODE, code);
+    add(SECTION_JUMP_TARGETS, jump_targets);
+    add(SECTION_LINES, lines);
+    add(SECTION_SYMBOLS, symbols);
+    add(SECTION_IMPORTS, imports);
+
+    uint64_t offset = sizeof(MvmbHeader) + sections.size() * sizeof(MvmbSection);
+    for (auto& section : sections) {
+        offset = (offset + MVMB_ALIGN - 1) / MVMB_ALIGN * MVMB_ALIGN;
+        section.offset = offset;
+        offset += section.size;
+    }
+
+    MvmbHeader header = {};
+    memcpy(header.magic, MVMB_MAGIC, 4);
+    header.version = MVMB_VERSION;
+    header.num_sections = (uint16_t)sections.size();
+    header.entry = entry;
+    header.flags = word_bits == 64 ? 2 : word_bits == 32 ? 1 : 0;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(MvmbSection));
+
+    offset = sizeof(MvmbHeader) + sections.size() * sizeof(MvmbSection);
+    for (auto& span : contents) {
+        write_padding(out, offset);
+        out.write(span.data(), span.size());
+        offset += span.size();
+    }
+    out.close();
+    if (!out.good()) {
+        std::remove(temp.c_str());
+        return false;
+    }
+
+    // rename doesn't replace an existing file everywhere
+    std::remove(path.c_str());
+    return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+bool write_file(const std::string& path, ByteSpan bytes) {
+    std::string temp = path + ".tmp";
+    std::ofstream out(temp, std::ios::binary);
+    out.write(bytes.data(), bytes.size());
+    out.close();
+    if (!out.good()) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    std::remove(path.c_str());
+    return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// FNV-1a over 8 bytes at a time, with a final mix so every input bit
+// reaches every output bit
+uint64_t content_hash(ByteSpan bytes) {
+    const uint64_t prime = 0x100000001b3ull;
+    uint64_t h = 0xcbf29ce484222325ull ^ bytes.size();
+    size_t i = 0;
+    for (; i + 8 <= bytes.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes.data() + i, 8);
+        h = (h ^ word) * prime;
+        h ^= h >> 29;
+    }
+    for (; i < bytes.size(); ++i)
+        h = (h ^ (unsigned char)bytes[i]) * prime;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+std::vector<char> make_symbols(std::vector<std::pair<uint32_t, std::string>> labels) {
+    std::vector<char> out;
+    if (labels.empty())
+        return out;
+    std::sort(labels.begin(), labels.end());
+
+    uint32_t count = (uint32_t)labels.size();
+    size_t names = sizeof(count) + labels.size() * sizeof(MvmbSymbol);
+    out.resize(names);
+    memcpy(out.data(), &count, sizeof(count));
+    for (size_t i = 0; i < labels.size(); ++i) {
+        MvmbSymbol symbol = { labels[i].first, (uint32_t)out.size(), (uint32_t)labels[i].second.size() };
+        memcpy(&out[sizeof(count) + i * sizeof(MvmbSymbol)], &symbol, sizeof(symbol));
+        out.insert(out.end(), labels[i].second.begin(), labels[i].second.end());
+    }
+    return out;
+}
+
+bool find_symbol(ByteSpan symbols, uint32_t pc, std::string& name, uint32_t& label_pc) {
+    if (symbols.empty())
+        return false;
+    uint32_t count;
+    memcpy(&count, symbols.data(), sizeof(count));
+
+    // last symbol at or before pc, the first of several at the same pc
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        MvmbSymbol probe;
+        memcpy(&probe, symbols.data() + sizeof(count) + mid * sizeof(MvmbSymbol), sizeof(probe));
+        if (probe.pc <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return false;
+
+    MvmbSymbol symbol;
+    memcpy(&symbol, symbols.data() + sizeof(count) + (lo - 1) * sizeof(MvmbSymbol), sizeof(symbol));
+    label_pc = symbol.pc;
+    while (lo > 1) {
+        MvmbSymbol before;
+        memcpy(&before, symbols.data() + sizeof(count) + (lo - 2) * sizeof(MvmbSymbol), sizeof(before));
+        if (before.pc != symbol.pc)
+            break;
+        symbol = before;
+        --lo;
+    }
+    name.assign(symbols.data() + symbol.name, symbol.length);
+    return true;
+}
+
+std::vector<ImportedFunction> default_imports() {
+    return { { "__sleep", 1, 0 } };
+}
+
+std::vector<char> make_imports(const std::vector<ImportedFunction>& imports) {
+    std::vector<char> out;
+    if (imports.empty())
+        return out;
+
+    uint32_t count = (uint32_t)imports.size();
+    out.resize(sizeof(count) + imports.size() * sizeof(MvmbImport));
+    memcpy(out.data(), &count, sizeof(count));
+    for (size_t i = 0; i < imports.size(); ++i) {
+        MvmbImport import = { (uint32_t)out.size(), (uint32_t)imports[i].name.size(), (uint16_t)imports[i].params,
+                              (uint16_t)imports[i].results };
+        memcpy(&out[sizeof(count) + i * sizeof(MvmbImport)], &import, sizeof(import));
+        out.insert(out.end(), imports[i].name.begin(), imports[i].name.end());
+    }
+    return out;
+}
+
+std::vector<ImportedFunction> read_imports(ByteSpan imports) {
+    if (imports.empty())
+        return default_imports();
+    uint32_t count;
+    memcpy(&count, imports.data(), sizeof(count));
+
+    std::vector<ImportedFunction> out;
+    for (uint32_t i = 0; i < count; ++i) {
+        MvmbImport import;
+        memcpy(&import, imports.data() + sizeof(count) + i * sizeof(MvmbImport), sizeof(import));
+        out.push_back({ std::string(imports.data() + import.name, import.length), import.params, import.results });
+    }
+    return out;
+}
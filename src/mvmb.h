@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// .mvmb container: an MvmbHeader, a table of MvmbSection right behind it and
+// the section contents, each starting at a multiple of MVMB_ALIGN. All fields
+// are little-endian. Files that don't start with the magic are raw bytecode
+// from before the container and load as a code section alone.
+#define MVMB_MAGIC          "MVMB"
+#define MVMB_VERSION        1
+#define MVMB_ALIGN          8
+#define MVMB_MAX_SECTIONS   64
+
+// MvmbHeader::flags. The low bits hold the word size as log2(bytes) - 1, so
+// 16-bit binaries, which came first, have none of them set.
+#define MVMB_WORD_MASK      0x3u
+#define MVMB_KNOWN_FLAGS    MVMB_WORD_MASK
+
+enum MvmbSectionType : uint32_t {
+    SECTION_CODE = 1,       // the bytecode
+    SECTION_CONSTANTS,      // reserved for a constant pool, nothing emits it yet
+    SECTION_JUMP_TARGETS,   // sorted uint32_t code offsets of every jump target
+    SECTION_LINES,          // MvmbLine records sorted by pc
+    SECTION_SYMBOLS,        // uint32_t count, MvmbSymbol records sorted by pc, then the names
+    SECTION_IMPORTS,        // uint32_t count, MvmbImport records in CALL operand order, then the names
+};
+
+struct MvmbHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t num_sections;
+    uint32_t entry;         // code offset execution starts at
+    uint32_t flags;         // MVMB_WORD_MASK, every other bit must be 0
+};
+
+struct MvmbSection {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;        // from the start of the file
+    uint64_t size;
+};
+
+// Source line of the instruction at 'pc'
+struct MvmbLine {
+    uint32_t pc;
+    uint32_t line;
+};
+
+// Label at 'pc', its name is 'length' bytes at offset 'name' in the section
+struct MvmbSymbol {
+    uint32_t pc;
+    uint32_t name;
+    uint32_t length;
+};
+
+// Host function CALL operand i stands for: its name is 'length' bytes at
+// offset 'name' in the section, and it takes 'params' words off the stack
+// and pushes 'results'
+struct MvmbImport {
+    uint32_t name;
+    uint32_t length;
+    uint16_t params;
+    uint16_t results;
+};
+
+static_assert(sizeof(MvmbHeader) == 16, "MvmbHeader layout");
+static_assert(sizeof(MvmbSection) == 24, "MvmbSection layout");
+static_assert(sizeof(MvmbLine) == 8, "MvmbLine layout");
+static_assert(sizeof(MvmbSymbol) == 12, "MvmbSymbol layout");
+static_assert(sizeof(MvmbImport) == 12, "MvmbImport layout");
+
+// Read-only view of bytes owned by someone else, usually a mapped file
+struct ByteSpan {
+    const char* ptr = nullptr;
+    size_t len = 0;
+
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    char operator[](size_t i) const { return ptr[i]; }
+    char at(size_t i) const {
+        if (i >= len)
+            throw std::out_of_range("program offset out of range");
+        return ptr[i];
+    }
+};
+
+template <class T>
+ByteSpan span_of(const std::vector<T>& v) {
+    return { reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T) };
+}
+
+// A whole file mapped read-only, so every process running it shares the
+// page cache copy. Falls back to reading it into memory where mapping fails.
+class mapped_file {
+public:
+    ~mapped_file();
+
+    static std::shared_ptr<mapped_file> open(const std::string& path);
+    // a private copy of 'size' bytes at 'data', for binaries already in memory
+    static std::shared_ptr<mapped_file> copy_of(const void* data, size_t size);
+    ByteSpan bytes() const { return { data, size }; }
+
+private:
+    mapped_file() = default;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::vector<char> copy;
+};
+
+// A loaded .mvmb. The spans point into 'file' and stay valid while it lives.
+struct MvmbImage {
+    std::shared_ptr<mapped_file> file;
+    uint16_t version = 0;   // 0 for legacy raw bytecode
+    uint32_t entry = 0;
+    unsigned word_bits = 16;    // size of the stack words and of every operand
+    ByteSpan code;
+    ByteSpan jump_targets;
+    ByteSpan lines;
+    ByteSpan symbols;
+    ByteSpan imports;
+};
+
+// Maps 'path' and locates its sections, false if the file can't be read or
+// the header or section table is malformed. 'error' gets why, if given.
+bool read_mvmb(const std::string& path, MvmbImage& image, std::string* error = nullptr);
+// The same for a binary in memory, which the image copies
+bool read_mvmb(const void* data, size_t size, MvmbImage& image, std::string* error = nullptr);
+// Writes a new file and renames it over 'path', so VMs that still have the
+// old one mapped keep running it. Empty optional sections are left out.
+bool write_mvmb(const std::string& path, uint32_t entry, ByteSpan code, ByteSpan jump_targets, ByteSpan lines,
+                ByteSpan symbols = {}, ByteSpan imports = {}, unsigned word_bits = 16);
+
+// 64-bit hash of a whole binary, what caches of loaded programs key on
+uint64_t content_hash(ByteSpan bytes);
+
+// Writes 'bytes' to a new file and renames it over 'path' like write_mvmb
+bool write_file(const std::string& path, ByteSpan bytes);
+
+// Builds a symbol section from (pc, name) pairs
+std::vector<char> make_symbols(std::vector<std::pair<uint32_t, std::string>> labels);
+// Label at or before 'pc', false if there is none
+bool find_symbol(ByteSpan symbols, uint32_t pc, std::string& name, uint32_t& label_pc);
+
+// A host function as the binary names it, see MvmbImport
+struct ImportedFunction {
+    std::string name;
+    unsigned params;
+    unsigned results;
+};
+
+// Binaries without an import section only know __sleep, as CALL 0
+std::vector<ImportedFunction> default_imports();
+// Builds an import section, in CALL operand order
+std::vector<char> make_imports(const std::vector<ImportedFunction>& imports);
+// The imports of a binary, default_imports() if it has no import section
+std::vector<ImportedFunction> read_imports(ByteSpan imports);
@@ -0,0 +1,293 @@
+#include "native.h"
+
+#include <cstddef>
+
+// VM state is pinned to callee-saved registers so runtime calls never spill
+static const int R_STATE = RBP;
+static const int R_SP = RBX;
+static const int R_TOS = R12;
+static const int R_REG = R13;
+static const int R_BASE = R14;
+static const int R_RUNNING = R15;
+
+// The operand stack keeps the interpreter's layout: top of stack in R_TOS,
+// the rest in memory below R_SP, so either side can pick up where the other
+// left off.
+bool lower_x64(X64Emitter& e, const shared_vector<DecodedInstruction<DATA_TYPE>>& code,
+               const std::vector<StackEffect>& calls, std::vector<uint32_t>& labels,
+               const std::function<bool(NativeHelper)>& call_helper) {
+    std::vector<std::pair<size_t, uint32_t>> fixups;
+    struct Stub { size_t at; NativeStatus status; DATA_TYPE pc; };
+    std::vector<Stub> stubs;
+    std::vector<size_t> exits;
+
+    auto need = [&](int n, DATA_TYPE at) {
+        if (n == 1) {
+            e.alu_r64_r64(ALU_CMP, R_SP, R_BASE);
+        } else {
+            e.lea_r64_m(RAX, R_BASE, (n - 1) * DATA_SIZE);
+            e.alu_r64_r64(ALU_CMP, R_SP, RAX);
+        }
+        stubs.push_back({ e.jcc_rel32(CC_BE), NATIVE_UNDERFLOW, at });
+    };
+    // room for n more values above the top of stack
+    auto room = [&](int n, DATA_TYPE at) {
+        e.lea_r64_m(RAX, R_SP, (n - 1) * DATA_SIZE);
+        e.alu_r64_m(ALU_CMP, RAX, R_STATE, offsetof(NativeState, limit));
+        stubs.push_back({ e.jcc_rel32(CC_AE), NATIVE_OVERFLOW, at });
+    };
+    auto push = [&](DATA_TYPE at) {
+        e.alu_r64_m(ALU_CMP, R_SP, R_STATE, offsetof(NativeState, limit));
+        stubs.push_back({ e.jcc_rel32(CC_AE), NATIVE_OVERFLOW, at });
+        e.mov_m16_r(R_SP, 0, R_TOS);
+        e.alu_r64_imm8(ALU_ADD, R_SP, DATA_SIZE);
+    };
+    auto pop = [&]() {
+        e.alu_r64_imm8(ALU_SUB, R_SP, DATA_SIZE);
+        e.movzx_r32_m16(R_TOS, R_SP, 0);
+    };
+    auto jump = [&](size_t from, uint32_t to) {
+        if (to <= from) {
+            // only backward jumps can loop, so only they poll stop()
+            e.cmp_m8_imm(R_RUNNING, 0, 0);
+            stubs.push_back({ e.jcc_rel32(CC_E), NATIVE_STOPPED, code[to].pc });
+        }
+        fixups.push_back({ e.jmp_rel32(), to });
+    };
+    // RAX = guest memory + the 16-bit address in register 'at'
+    auto address = [&](int at) {
+        e.mov_r64_m(RAX, R_STATE, offsetof(NativeState, memory));
+        e.alu_r64_r64(ALU_ADD, RAX, at);
+    };
+    // RCX = R0 + offset, wrapped to 16 bits
+    auto indexed = [&](DATA_TYPE offset) {
+        e.mov_r32_r32(RCX, R_REG);
+        e.alu_r32_imm(ALU_ADD, RCX, offset);
+        e.movzx_r32_r16(RCX, RCX);
+    };
+    auto leave = [&](NativeStatus status, DATA_TYPE at) {
+        e.mov_r32_imm(RCX, at);
+        e.mov_r32_imm(RAX, status);
+        exits.push_back(e.jmp_rel32());
+    };
+
+    // int entry(NativeState* st, const void* resume_at)
+    static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+    for (int r : saved)
+        e.push_r64(r);
+    e.alu_r64_imm8(ALU_SUB, RSP, 8);
+    e.mov_r64_r64(R_STATE, RDI);
+    e.mov_r64_m(R_SP, R_STATE, offsetof(NativeState, sp));
+    e.movzx_r32_m16(R_TOS, R_SP, 0);
+    e.movzx_r32_m16(R_REG, R_STATE, offsetof(NativeState, reg));
+    e.mov_r64_m(R_BASE, R_STATE, offsetof(NativeState, base));
+    e.mov_r64_m(R_RUNNING, R_STATE, offsetof(NativeState, running));
+    e.jmp_r64(RSI);
+
+    labels.assign(code.size(), 0);
+    for (size_t i = 0; i < code.size(); ++i) {
+        const auto& insn = code[i];
+        labels[i] = (uint32_t)e.size();
+
+        // superinstructions only matter to the interpreter, lower their
+        // first instruction and let the rest follow as usual
+        OpCode op = unfused_opcode(insn.opcode);
+        switch (op) {
+            case NOP:
+                break;
+            case PUSH:
+                push(insn.pc);
+                e.mov_r32_imm(R_TOS, insn.arg);
+                break;
+            case LOAD:
+                push(insn.pc);
+                e.mov_r32_r32(R_TOS, R_REG);
+                break;
+            case POP:
+                need(1, insn.pc);
+                e.mov_r32_r32(R_REG, R_TOS);
+                pop();
+                break;
+            case NEG:
+                need(1, insn.pc);
+                e.not_r32(R_TOS);
+                e.movzx_r32_r16(R_TOS, R_TOS);
+                break;
+            case EQU: case NEQU: case GT: case GTEQ: case LT: case LTEQ:
+            case ADD: case SUB: case MUL: case DIV: case MOD:
+            case XOR: case OR: case AND: {
+                // a = top (R_TOS), b = second (EAX)
+                need(2, insn.pc);
+                e.alu_r64_imm8(ALU_SUB, R_SP, DATA_SIZE);
+                e.movzx_r32_m16(RAX, R_SP, 0);
+                switch (op) {
+                    case ADD: e.alu_r32_r32(ALU_ADD, R_TOS, RAX); break;
+                    case MUL: e.imul_r32_r32(R_TOS, RAX); break;
+                    case XOR: e.alu_r32_r32(ALU_XOR, R_TOS, RAX); break;
+                    case OR:  e.alu_r32_r32(ALU_OR, R_TOS, RAX); break;
+                    case AND: e.alu_r32_r32(ALU_AND, R_TOS, RAX); break;
+                    case SUB:
+                        e.alu_r32_r32(ALU_SUB, RAX, R_TOS);
+                        e.mov_r32_r32(R_TOS, RAX);
+                        break;
+                    case DIV:
+                        e.alu_r32_r32(ALU_XOR, RDX, RDX);
+                        e.div_r32(R_TOS);
+                        e.mov_r32_r32(R_TOS, RAX);
+                        break;
+                    case MOD:
+                        e.mov_r32_r32(RCX, RAX);
+                        e.mov_r32_r32(RAX, R_TOS);
+                        e.alu_r32_r32(ALU_XOR, RDX, RDX);
+                        e.div_r32(RCX);
+                        e.mov_r32_r32(R_TOS, RDX);
+                        break;
+                    default: {
+                        static const X64Cond cc[] = { CC_E, CC_NE, CC_A, CC_AE, CC_B, CC_BE };
+                        e.alu_r32_r32(ALU_CMP, R_TOS, RAX);
+                        e.setcc_r8(cc[op - EQU], RAX);
+                        e.movzx_r32_r8(R_TOS, RAX);
+                        break;
+                    }
+                }
+                // keep DATA_TYPE wraparound
+                e.movzx_r32_r16(R_TOS, R_TOS);
+                break;
+            }
+            case JMP:
+                jump(i, insn.target);
+                break;
+            case JMPZ:
+            case JMPNZ: {
+                need(1, insn.pc);
+                e.test_r32_r32(R_TOS, R_TOS);
+                size_t skip = e.jcc_rel32(op == JMPZ ? CC_NE : CC_E);
+                pop();
+                jump(i, insn.target);
+                e.patch_rel32(skip, e.size());
+                break;
+            }
+            case PRINT:
+                need(1, insn.pc);
+                e.mov_r64_r64(RDI, R_STATE);
+                e.mov_r32_r32(RSI, R_TOS);
+                if (!call_helper(HELPER_PRINT))
+                    return false;
+                break;
+            case CALL: {
+                // like the vector ops, but the helper may also stop the VM
+                auto effect = calls[insn.arg];
+                if (effect.pops)
+                    need(effect.pops, insn.pc);
+                if (effect.pushes > effect.pops)
+                    room(effect.pushes - effect.pops, insn.pc);
+                e.mov_m16_r(R_SP, 0, R_TOS);
+                e.mov_r64_r64(RDI, R_STATE);
+                e.mov_r32_imm(RSI, insn.arg);
+                e.lea_r64_m(RDX, R_SP, (1 - effect.pops) * (int)DATA_SIZE);
+                if (!call_helper(HELPER_CALL))
+                    return false;
+                if (effect.pushes != effect.pops)
+                    e.lea_r64_m(R_SP, R_SP, (effect.pushes - effect.pops) * (int)DATA_SIZE);
+                e.movzx_r32_m16(R_TOS, R_SP, 0);
+                e.test_r32_r32(RAX, RAX);
+                stubs.push_back({ e.jcc_rel32(CC_E), NATIVE_STOPPED, code[i + 1].pc });
+                break;
+            }
+            case LOADM:
+                need(1, insn.pc);
+                e.mov_r32_r32(RCX, R_TOS);
+                address(RCX);
+                e.movzx_r32_m16(R_TOS, RAX, 0);
+                break;
+            case STOREM:
+                // a = address (R_TOS), b = value
+                need(2, insn.pc);
+                e.mov_r32_r32(RCX, R_TOS);
+                pop();
+                address(RCX);
+                e.mov_m16_r(RAX, 0, R_TOS);
+                pop();
+                break;
+            case LOADX:
+                push(insn.pc);
+                indexed(insn.arg);
+                address(RCX);
+                e.movzx_r32_m16(R_TOS, RAX, 0);
+                break;
+            case STOREX:
+                need(1, insn.pc);
+                indexed(insn.arg);
+                address(RCX);
+                e.mov_m16_r(RAX, 0, R_TOS);
+                pop();
+                break;
+            case MFILL: case MCOPY: case VADD: case VSUB: case VMUL: case VAND: case VOR: case VXOR:
+            case VEQ: case VLT: case VGT: case VSUM: case VMIN: case VMAX: {
+                // spill the top of stack so the operands are contiguous
+                auto effect = stack_effect(op);
+                need(effect.pops, insn.pc);
+                e.mov_m16_r(R_SP, 0, R_TOS);
+                e.mov_r64_r64(RDI, R_STATE);
+                e.mov_r32_imm(RSI, op);
+                e.lea_r64_m(RDX, R_SP, -(effect.pops - 1) * (int)DATA_SIZE);
+                if (!call_helper(HELPER_VECTOR))
+                    return false;
+                e.alu_r64_imm8(ALU_SUB, R_SP, (int8_t)((effect.pops - effect.pushes) * DATA_SIZE));
+                if (effect.pushes)
+                    e.movzx_r32_r16(R_TOS, RAX);
+                else
+                    e.movzx_r32_m16(R_TOS, R_SP, 0);
+                break;
+            }
+            case HALT:
+                e.mov_r64_r64(RDI, R_STATE);
+                if (!call_helper(HELPER_HALT))
+                    return false;
+                leave(NATIVE_HALT, code[i + 1].pc);
+                break;
+            case EXIT:
+                leave(NATIVE_EXIT, insn.pc);
+                break;
+            case TRAP:
+                leave((NativeStatus)(NATIVE_INVALID_OPCODE + insn.arg), insn.pc);
+                break;
+            default:
+                return false;
+        }
+    }
+
+    // out of line exits, then the shared epilogue which writes the VM state back
+    for (const auto& stub : stubs) {
+        e.patch_rel32(stub.at, e.size());
+        leave(stub.status, stub.pc);
+    }
+
+    size_t epilogue = e.size();
+    e.mov_m16_r(R_SP, 0, R_TOS);
+    e.mov_m64_r(R_STATE, offsetof(NativeState, sp), R_SP);
+    e.mov_m16_r(R_STATE, offsetof(NativeState, reg), R_REG);
+    e.mov_m16_r(R_STATE, offsetof(NativeState, pc), RCX);
+    e.alu_r64_imm8(ALU_ADD, RSP, 8);
+    for (int i = sizeof(saved) / sizeof(*saved) - 1; i >= 0; --i)
+        e.pop_r64(saved[i]);
+    e.ret();
+
+    for (size_t at : exits)
+        e.patch_rel32(at, epilogue);
+    for (auto& fixup : fixups)
+        e.patch_rel32(fixup.first, labels[fixup.second]);
+    return true;
+}
+
+const char* native_status_message(int status) {
+    switch (status) {
+        case NATIVE_UNDERFLOW:          return "Stack underflow";
+        case NATIVE_OVERFLOW:           return "Stack overflow";
+        case NATIVE_INVALID_OPCODE:     return "Invalid opcode";
+        case NATIVE_TRUNCATED_OPERAND:  return "Truncated operand";
+        case NATIVE_INVALID_JUMP:       return "Invalid jump target";
+        case NATIVE_INVALID_CALL:       return "Invalid call";
+        default:                        return nullptr;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "mvm.h"
+#include "x64.h"
+
+#include <functional>
+
+// Everything generated code reads or writes outside its own registers.
+struct NativeState {
+    DATA_TYPE* base;
+    DATA_TYPE* sp;
+    DATA_TYPE* limit;
+    char* running;
+    DATA_TYPE reg;
+    DATA_TYPE pc;
+    output_sink* out;       // only used by the runtime helpers
+    uint8_t* memory;        // guest memory, MEMORY_SIZE + MEMORY_SLACK bytes
+    mvm* vm;                // what CALL calls through, null in native executables
+};
+
+// Why generated code returned. Traps follow the order of TrapReason.
+enum NativeStatus {
+    NATIVE_EXIT,
+    NATIVE_HALT,
+    NATIVE_STOPPED,
+    NATIVE_UNDERFLOW,
+    NATIVE_OVERFLOW,
+    NATIVE_INVALID_OPCODE,
+    NATIVE_TRUNCATED_OPERAND,
+    NATIVE_INVALID_JUMP,
+    NATIVE_INVALID_CALL,
+};
+
+// Runtime entry points generated code calls into. All of them take the
+// NativeState* first; PRINT takes the value. CALL takes the import index and
+// a pointer to its arguments on the stack, where it leaves the results, and
+// returns non-zero to keep running. VECTOR takes the opcode and a pointer to
+// its operands on the stack and returns the result of a reduction.
+enum NativeHelper {
+    HELPER_PRINT,
+    HELPER_CALL,
+    HELPER_HALT,
+    HELPER_VECTOR,
+};
+
+// Lowers a decoded program to x86-64 at the end of 'e', emitting
+//     int entry(NativeState* st, const void* resume_at)
+// first. calls holds the stack effect of every import CALL reaches, labels
+// receives the buffer offset of every decoded instruction and call_helper
+// emits the call sequence for a runtime entry point, or returns false if the
+// backend has none, which fails the lowering.
+bool lower_x64(X64Emitter& e, const shared_vector<DecodedInstruction<DATA_TYPE>>& code,
+               const std::vector<StackEffect>& calls, std::vector<uint32_t>& labels,
+               const std::function<bool(NativeHelper)>& call_helper);
+// wider words have no lowering yet, their programs stay on the interpreters
+template <class Word>
+bool lower_x64(X64Emitter&, const shared_vector<DecodedInstruction<Word>>&, const std::vector<StackEffect>&,
+               std::vector<uint32_t>&, const std::function<bool(NativeHelper)>&) {
+    return false;
+}
+
+const char* native_status_message(int status);
@@ -0,0 +1,309 @@
+#include "optimizer.h"
+
+#include <algorithm>
+
+#define UNKNOWN_DEPTH   -1
+#define MAX_THREADING   16
+#define MAX_FOLD_ROUNDS 8
+
+// Basic block of the control-flow graph. next is the block control falls
+// through to and taken the destination of the closing jump, -1 if none.
+struct Block {
+    std::vector<AsmInstruction> body;
+    int follow = -1;                // textually next block in the source
+    int next = -1;
+    int taken = -1;
+    int depth = UNKNOWN_DEPTH;      // stack depth on entry, if consistent
+    bool reachable = false;
+};
+
+static bool is_jump(OpCode op) {
+    return op == JMP || op == JMPZ || op == JMPNZ;
+}
+
+// CALL's effect is the function's, CALLs past the table trap when run
+static StackEffect effect_of(const AsmInstruction& insn, const std::vector<StackEffect>& calls) {
+    if (insn.opcode == CALL && insn.arg < calls.size())
+        return calls[insn.arg];
+    return stack_effect(insn.opcode);
+}
+
+static void link(std::vector<Block>& blocks) {
+    for (auto& b : blocks) {
+        OpCode last = b.body.empty() ? NOP : b.body.back().opcode;
+        b.next = last == JMP || last == HALT ? -1 : b.follow;
+        b.taken = is_jump(last) ? b.body.back().target : -1;
+    }
+}
+
+// Entry stack depth of every reachable block. Blocks reached with two
+// different depths, or from a block whose depth is unknown, stay unknown.
+static void analyze_depths(std::vector<Block>& blocks, const std::vector<StackEffect>& calls) {
+    std::vector<bool> conflict(blocks.size(), false);
+    std::vector<int> worklist = { 0 };
+    for (auto& b : blocks) {
+        b.depth = UNKNOWN_DEPTH;
+        b.reachable = false;
+    }
+    blocks[0].depth = 0;
+    blocks[0].reachable = true;
+
+    auto reach = [&](int to, int depth) {
+        auto& b = blocks[to];
+        if (!b.reachable) {
+            b.reachable = true;
+            b.depth = depth;
+            worklist.push_back(to);
+        } else if (b.depth != depth && !conflict[to]) {
+            conflict[to] = true;
+            b.depth = UNKNOWN_DEPTH;
+            worklist.push_back(to);
+        }
+    };
+
+    while (!worklist.empty()) {
+        int id = worklist.back();
+        worklist.pop_back();
+        auto& b = blocks[id];
+
+        int depth = conflict[id] ? UNKNOWN_DEPTH : b.depth;
+        for (auto& insn : b.body) {
+            if (depth == UNKNOWN_DEPTH)
+                break;
+            auto effect = effect_of(insn, calls);
+            depth = depth < effect.pops ? UNKNOWN_DEPTH : depth - effect.pops + effect.pushes;
+        }
+        if (b.taken >= 0)
+            reach(b.taken, depth);
+        // a conditional jump only pops the condition when it is taken
+        if (depth != UNKNOWN_DEPTH && b.taken >= 0 && b.body.back().opcode != JMP)
+            depth += 1;
+        if (b.next >= 0)
+            reach(b.next, depth);
+    }
+}
+
+// fold_binary in the word size the program runs with
+static bool fold_word(OpCode op, uint64_t a, uint64_t b, unsigned word_bits, uint64_t& result) {
+    switch (word_bits) {
+#define FOLD(W)                                                                 \
+        case sizeof(W) * 8: {                                                   \
+            W r;                                                                \
+            if (!fold_binary<W>(op, (W)a, (W)b, r))                             \
+                return false;                                                   \
+            result = r;                                                         \
+            return true;                                                        \
+        }
+        MVM_WORD_TYPES(FOLD)
+#undef FOLD
+        default:
+            return false;
+    }
+}
+
+// Folds constant expressions inside one block. Only done when the block's
+// entry depth is known and it neither underflows nor overflows, so folding
+// can't hide a stack trap the original program would have raised.
+static bool fold_block(Block& b, size_t stack_depth, unsigned word_bits, const std::vector<StackEffect>& calls) {
+    if (b.depth == UNKNOWN_DEPTH)
+        return false;
+
+    int depth = b.depth;
+    for (auto& insn : b.body) {
+        auto effect = effect_of(insn, calls);
+        if (depth < effect.pops)
+            return false;
+        depth += effect.pushes - effect.pops;
+        if (depth > (int)stack_depth)
+            return false;
+    }
+
+    std::vector<AsmInstruction> out;
+    auto pushed = [&](size_t back) {
+        return out.size() >= back && out[out.size() - back].opcode == PUSH && out[out.size() - back].target < 0;
+    };
+
+    for (auto insn : b.body) {
+        OpCode op = insn.opcode;
+        uint64_t result;
+
+        if (op == NOP)
+            continue;
+        if (op == NEG && pushed(1)) {
+            out.back().arg = ~out.back().arg & (word_bits < 64 ? (1ull << word_bits) - 1 : ~0ull);
+            continue;
+        }
+        if (stack_effect(op).pops == 2 && pushed(1) && pushed(2)
+            && fold_word(op, out[out.size() - 1].arg, out[out.size() - 2].arg, word_bits, result)) {
+            out.pop_back();
+            out.back().arg = result;
+            continue;
+        }
+        if (op == POP && !out.empty() && out.back().opcode == LOAD) {
+            // R0 -> stack -> R0
+            out.pop_back();
+            continue;
+        }
+        if ((op == JMPZ || op == JMPNZ) && pushed(1)) {
+            bool taken = (out.back().arg == 0) == (op == JMPZ);
+            if (taken) {
+                // the condition is popped, leaving an unconditional jump
+                out.back() = { JMP, 0, insn.target, insn.line };
+            }
+            // otherwise the condition stays on the stack and control falls through
+            continue;
+        }
+        out.push_back(insn);
+    }
+    bool changed = out.size() != b.body.size();
+    b.body = std::move(out);
+    return changed;
+}
+
+// Retargets jumps that land on a block holding nothing but another JMP.
+static void thread_jumps(std::vector<Block>& blocks) {
+    auto trampoline = [&](int id) {
+        const auto& body = blocks[id].body;
+        return body.size() == 1 && body[0].opcode == JMP ? body[0].target : -1;
+    };
+    for (auto& b : blocks) {
+        if (b.body.empty() || !is_jump(b.body.back().opcode))
+            continue;
+        int& target = b.body.back().target;
+        for (int hops = 0; hops < MAX_THREADING; ++hops) {
+            int next = trampoline(target);
+            if (next < 0 || next == target)
+                break;
+            target = next;
+        }
+    }
+}
+
+// Orders blocks so that fallthrough edges are kept and a block ending in JMP
+// is followed by its destination when nothing else needs to fall into it,
+// which lets the JMP go away. The entry block stays first and the empty
+// exit block last.
+static std::vector<int> layout(const std::vector<Block>& blocks) {
+    int exit = (int)blocks.size() - 1;
+    std::vector<int> fallthrough_preds(blocks.size(), 0);
+    for (auto& b : blocks) {
+        if (b.reachable && b.next >= 0)
+            fallthrough_preds[b.next]++;
+    }
+
+    std::vector<int> order;
+    std::vector<bool> placed(blocks.size(), false);
+    for (int start = 0; start < exit; ++start) {
+        int id = start;
+        while (id >= 0 && id != exit && !placed[id] && blocks[id].reachable) {
+            placed[id] = true;
+            order.push_back(id);
+
+            const auto& b = blocks[id];
+            if (b.next >= 0)
+                id = b.next;
+            else if (b.taken >= 0 && b.body.back().opcode == JMP && fallthrough_preds[b.taken] == 0)
+                id = b.taken;
+            else
+                id = -1;
+        }
+    }
+    order.push_back(exit);
+    return order;
+}
+
+void optimize_program(std::vector<AsmInstruction>& insns, size_t stack_depth, unsigned word_bits,
+                      const std::vector<StackEffect>& calls, std::vector<int32_t>* labels) {
+    if (insns.empty())
+        return;
+    for (auto& insn : insns) {
+        if (is_jump(insn.opcode) != (insn.target >= 0))
+            return;
+    }
+
+    // leaders: the entry, every jump target and whatever follows a jump or HALT
+    size_t n = insns.size();
+    std::vector<bool> leader(n + 1, false);
+    leader[0] = leader[n] = true;
+    for (size_t i = 0; i < n; ++i) {
+        if (is_jump(insns[i].opcode)) {
+            leader[insns[i].target] = true;
+            leader[i + 1] = true;
+        } else if (insns[i].opcode == HALT) {
+            leader[i + 1] = true;
+        }
+    }
+
+    std::vector<int> block_of(n + 1, -1);
+    std::vector<Block> blocks;
+    for (size_t i = 0; i <= n; ++i) {
+        if (leader[i]) {
+            if (!blocks.empty())
+                blocks.back().follow = (int)blocks.size();
+            blocks.emplace_back();
+        }
+        block_of[i] = (int)blocks.size() - 1;
+        if (i < n)
+            blocks.back().body.push_back(insns[i]);
+    }
+    for (auto& b : blocks) {
+        for (auto& insn : b.body) {
+            if (is_jump(insn.opcode))
+                insn.target = block_of[insn.target];
+        }
+    }
+
+    // folding a branch can make code unreachable and settle the depth of
+    // the blocks it merged into, so repeat while that keeps paying off
+    for (int round = 0; round < MAX_FOLD_ROUNDS; ++round) {
+        link(blocks);
+        analyze_depths(blocks, calls);
+        bool changed = false;
+        for (auto& b : blocks) {
+            if (b.reachable)
+                changed |= fold_block(b, stack_depth, word_bits, calls);
+        }
+        if (!changed)
+            break;
+    }
+    link(blocks);
+    thread_jumps(blocks);
+    link(blocks);
+    analyze_depths(blocks, calls);
+
+    std::vector<int> order = layout(blocks);
+    std::vector<int> position(blocks.size(), -1);
+    for (size_t i = 0; i < order.size(); ++i)
+        position[order[i]] = (int)i;
+
+    // emit in layout order, jumps still point at blocks
+    std::vector<AsmInstruction> out;
+    std::vector<int32_t> start(blocks.size(), -1);
+    for (size_t i = 0; i < order.size(); ++i) {
+        const auto& b = blocks[order[i]];
+        int following = i + 1 < order.size() ? order[i + 1] : -1;
+        start[order[i]] = (int32_t)out.size();
+
+        for (size_t k = 0; k < b.body.size(); ++k) {
+            const auto& insn = b.body[k];
+            if (k + 1 == b.body.size() && insn.opcode == JMP && insn.target == following)
+                continue;
+            out.push_back(insn);
+        }
+        if (b.next >= 0 && b.next != following) {
+            uint32_t line = b.body.empty() ? 0 : b.body.back().line;
+            out.push_back({ JMP, 0, b.next, line });
+        }
+    }
+    for (auto& insn : out) {
+        if (is_jump(insn.opcode))
+            insn.target = start[insn.target];
+    }
+    if (labels) {
+        for (auto& label : *labels) {
+            if (label >= 0 && label <= (int32_t)n)
+                label = leader[label] ? start[block_of[label]] : -1;
+        }
+    }
+    insns = std::move(out);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "mvm.h"
+
+// Optimizes a parsed program in place: constant folding, unreachable code
+// removal, jump threading and block layout over its control-flow graph.
+// Programs that use raw numeric offsets as operands are left alone, since
+// moving code would change what those offsets point at. stack_depth is the
+// operand stack capacity, word_bits the word size the program will run with
+// and calls the stack effect of each import CALL reaches. 'labels' holds instruction indices that are updated to where that
+// code ends up, or -1 where it was removed or merged into the middle of a
+// block.
+void optimize_program(std::vector<AsmInstruction>& insns, size_t stack_depth, unsigned word_bits,
+                      const std::vector<StackEffect>& calls, std::vector<int32_t>* labels = nullptr);
@@ -0,0 +1,155 @@
+#include "output.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+using std::chrono::steady_clock;
+
+size_t format_print(char* out, uint64_t value) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    memcpy(out, "PRINT ", 6);
+    for (size_t i = 0; i < n; ++i)
+        out[6 + i] = digits[n - 1 - i];
+    out[6 + n] = '\n';
+    return n + 7;
+}
+
+void stream_sink::print(uint64_t value) {
+    std::cout << "PRINT " << value << std::endl;
+}
+
+void memory_sink::print(uint64_t value) {
+    char line[OUTPUT_LINE_MAX];
+    text.append(line, format_print(line, value));
+}
+
+void buffered_sink::print(uint64_t value) {
+    if (buf.empty()) {
+        buf.resize(OUTPUT_BUFFER);
+        last_flush = steady_clock::now();
+    }
+    if (buf.size() - used < OUTPUT_LINE_MAX)
+        flush();
+    used += format_print(&buf[used], value);
+
+    // reading the clock costs more than formatting a line, so only look
+    // every so often
+    if (++lines % OUTPUT_CHECK_LINES == 0 &&
+        steady_clock::now() - last_flush >= std::chrono::milliseconds(OUTPUT_FLUSH_MS))
+        flush();
+}
+
+void buffered_sink::flush() {
+    if (!used)
+        return;
+    fwrite(buf.data(), 1, used, file);
+    fflush(file);
+    used = 0;
+    last_flush = steady_clock::now();
+}
+
+async_writer::async_writer(FILE* file, size_t capacity) : file(file) {
+    size_t size = OUTPUT_LINE_MAX * 2;
+    while (size < capacity)
+        size *= 2;
+    ring.resize(size);
+    mask = size - 1;
+    thread = std::thread(&async_writer::writer, this);
+}
+
+async_writer::~async_writer() {
+    flush();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+// Wakes the writer early. Done without the lock, so the writer may miss it
+// while it is about to sleep, in which case its timer picks the data up.
+void async_writer::kick() {
+    kicked_at = tail.load(std::memory_order_relaxed);
+    wake.notify_one();
+}
+
+void async_sink::print(uint64_t value) {
+    char line[OUTPUT_LINE_MAX];
+    out.write(line, format_print(line, value));
+}
+
+void async_writer::write(const char* data, size_t size) {
+    // pieces of half the ring at most, so each fits once the writer drains it
+    while (size > ring.size() / 2) {
+        write(data, ring.size() / 2);
+        data += ring.size() / 2;
+        size -= ring.size() / 2;
+    }
+    size_t n = size;
+    size_t t = tail.load(std::memory_order_relaxed);
+
+    // ring full, wait for the writer to make room
+    while (t + n - cached_head > ring.size()) {
+        cached_head = head.load(std::memory_order_acquire);
+        if (t + n - cached_head > ring.size()) {
+            kick();
+            std::this_thread::yield();
+        }
+    }
+
+    size_t at = t & mask;
+    size_t first = std::min(n, ring.size() - at);
+    memcpy(&ring[at], data, first);
+    memcpy(&ring[0], data + first, n - first);
+    tail.store(t + n, std::memory_order_release);
+
+    if (t + n - kicked_at >= ring.size() / 2)
+        kick();
+}
+
+void async_writer::flush() {
+    size_t target = tail.load(std::memory_order_relaxed);
+    std::unique_lock<std::mutex> guard(lock);
+    flushing = true;
+    wake.notify_one();
+    drained.wait(guard, [&] { return head.load(std::memory_order_acquire) == target; });
+    flushing = false;
+}
+
+void async_writer::writer() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        wake.wait_for(guard, std::chrono::milliseconds(OUTPUT_FLUSH_MS), [&] {
+            size_t pending = tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
+            return stopping || pending >= ring.size() / 2 || (flushing && pending);
+        });
+        bool stop = stopping;
+        guard.unlock();
+
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        if (h != t) {
+            while (h != t) {
+                size_t at = h & mask;
+                size_t n = std::min(t - h, ring.size() - at);
+                fwrite(&ring[at], 1, n, file);
+                h += n;
+            }
+            fflush(file);
+            head.store(h, std::memory_order_release);
+        }
+
+        guard.lock();
+        drained.notify_all();
+        if (stop)
+            return;
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "export.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define OUTPUT_BUFFER       16384   // bytes a buffered sink holds before it writes
+#define OUTPUT_RING         (1 << 20)
+#define OUTPUT_FLUSH_MS     50      // longest a line waits in a buffer
+#define OUTPUT_CHECK_LINES  64      // lines between clock checks of a buffered sink
+#define OUTPUT_LINE_MAX     32      // "PRINT " + 20 digits + '\n'
+
+// Destination of PRINT. Every VM writes through one of these; flush()
+// returns once everything printed so far has reached the file.
+class output_sink {
+public:
+    virtual ~output_sink() {}
+    virtual void print(uint64_t value) = 0;
+    virtual void flush() {}
+};
+
+// Formats "PRINT <value>\n" into 'out' without going through iostreams,
+// returns the number of bytes written, at most OUTPUT_LINE_MAX.
+size_t format_print(char* out, uint64_t value);
+
+// The original behaviour: one iostream write and flush per PRINT.
+class stream_sink : public output_sink {
+public:
+    MVM_API void print(uint64_t value) override;
+};
+
+// Keeps the lines in 'text' for whoever runs the VM to write out, for runners
+// that put the output of many VMs in order themselves.
+class memory_sink : public output_sink {
+public:
+    MVM_API void print(uint64_t value) override;
+
+    std::string text;
+};
+
+// Collects lines in memory and writes them in one go when the buffer fills,
+// on flush(), or on the first PRINT after OUTPUT_FLUSH_MS have passed. Lines
+// are never split between writes, so VMs sharing a file don't tear each
+// other's output. Not thread-safe, give every VM its own.
+class buffered_sink : public output_sink {
+public:
+    explicit buffered_sink(FILE* file = stdout) : file(file) {}
+    ~buffered_sink() { flush(); }
+
+    MVM_API void print(uint64_t value) override;
+    MVM_API void flush() override;
+
+private:
+    FILE* file;
+    std::vector<char> buf;      // allocated on first PRINT
+    size_t used = 0;
+    unsigned lines = 0;
+    std::chrono::steady_clock::time_point last_flush;
+};
+
+// Hands bytes to a writer thread over a lock-free single-producer ring, so
+// the producer never waits on a write unless the ring is full. The writer
+// drains it every OUTPUT_FLUSH_MS, when it is half full, or on flush(). One
+// thread may write into it at a time.
+class async_writer {
+public:
+    MVM_API explicit async_writer(FILE* file, size_t capacity = OUTPUT_RING);
+    MVM_API ~async_writer();
+
+    MVM_API void write(const char* data, size_t size);
+    // returns once everything written so far is in the file
+    MVM_API void flush();
+
+private:
+    void writer();
+    void kick();
+
+    FILE* file;
+    std::vector<char> ring;     // capacity is a power of two
+    size_t mask;
+
+    // free-running byte counters, the writer owns head and the VM tail
+    std::atomic<size_t> head{ 0 };
+    std::atomic<size_t> tail{ 0 };
+    size_t cached_head = 0;     // producer's last look at head
+    size_t kicked_at = 0;       // tail when the writer was last woken early
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    bool flushing = false;
+    bool stopping = false;
+    std::thread thread;
+};
+
+// PRINT through an async_writer, see there
+class async_sink : public output_sink {
+public:
+    explicit async_sink(FILE* file = stdout, size_t capacity = OUTPUT_RING) : out(file, capacity) {}
+
+    MVM_API void print(uint64_t value) override;
+    void flush() override { out.flush(); }
+
+private:
+    async_writer out;
+};
@@ -0,0 +1,249 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+static const char* const opcode_names[] = {
+#define NAME(o, a)          #o,
+    MVM_MNEMONICS(NAME)
+#undef NAME
+    "EXIT", "TRAP",
+#define NAME(o, e)          "LOAD_PUSH_" #o, "LOAD_PUSH_" #o "_POP", "PUSH_" #o, #o "_PRINT_POP",
+    MVM_BINARY_OPS(NAME)
+#undef NAME
+#define NAME(o, e)          "LOAD_PUSH_" #o "_JMPZ", "LOAD_PUSH_" #o "_JMPNZ", #o "_JMPZ", #o "_JMPNZ",
+    MVM_COMPARE_OPS(NAME)
+#undef NAME
+    "PUSH_POP", "PRINT_POP",
+};
+static_assert(sizeof(opcode_names) / sizeof(*opcode_names) == NUM_OPCODES, "opcode names out of sync with OpCode");
+
+const char* opcode_name(OpCode op) {
+    return op < NUM_OPCODES ? opcode_names[op] : "?";
+}
+
+Profile::Profile() {
+    // the cheapest of a few back to back reads is what a sample pays for
+    // reading the clock twice
+    overhead = UINT64_MAX;
+    for (int i = 0; i < 64; ++i) {
+        uint64_t start = PROFILE_CLOCK();
+        overhead = std::min<uint64_t>(overhead, PROFILE_CLOCK() - start);
+    }
+}
+
+void Profile::attach(size_t code_size) {
+    if (counts.size() != code_size) {
+        counts.assign(code_size, 0);
+        taken.assign(code_size, 0);
+    }
+    // a sample left open by the last run would time whatever happened since
+    sampled = -1;
+}
+
+template <class Word>
+void basic_mvm<Word>::enable_profiling(std::string report_path) {
+    profile = std::make_shared<Profile>();
+    profile_path = report_path;
+}
+
+template <class Word>
+std::string basic_mvm<Word>::symbol_at(Word pc) const {
+    std::string name;
+    uint32_t label_pc;
+    if (!find_symbol(image.symbols, pc, name, label_pc))
+        return "";
+    if (label_pc != pc)
+        name += "+" + std::to_string(pc - label_pc);
+    return name;
+}
+
+static bool is_conditional(OpCode op) {
+    return op == JMPZ || op == JMPNZ || (op >= LOAD_PUSH_EQU_JMPZ && op < PUSH_POP);
+}
+static bool is_jump(OpCode op) {
+    return op == JMP || is_conditional(op);
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+// A basic block of the decoded program, [first, end) in mvm::code
+struct ProfileBlock {
+    size_t first;
+    size_t end;
+    uint64_t entries;
+    uint64_t instructions;
+};
+
+// Writes the report: opcode mix with sampled cycles, hot basic blocks with
+// an annotated listing, loops found from backward jumps and the busiest
+// conditional branches. Blocks and loops are named after the closest label.
+template <class Word>
+bool basic_mvm<Word>::write_profile(std::string path) const {
+    if (!profile || profile->counts.size() != code.size())
+        return false;
+    std::ofstream out(path);
+    if (!out.good())
+        return false;
+
+    const Profile& p = *profile;
+    char row[256];
+    auto where = [&](Word pc) {
+        std::string label = symbol_at(pc);
+        if (uint32_t line = source_line(pc))
+            label += (label.empty() ? "line " : " line ") + std::to_string(line);
+        return label;
+    };
+    auto listing = [&](size_t i) {
+        std::string text = opcode_name(code[i].opcode);
+        OpCode first = unfused_opcode(code[i].opcode);
+        // fused LOAD_PUSH sequences carry the PUSH immediate
+        if ((operand_count(first) && !is_jump(first)) || (first == LOAD && code[i].opcode != LOAD))
+            text += " " + std::to_string(code[i].arg);
+        if (is_jump(code[i].opcode)) {
+            std::string target = symbol_at(code[code[i].target].pc);
+            text += " " + (target.empty() ? std::to_string(code[code[i].target].pc) : target);
+        }
+        return text;
+    };
+
+    uint64_t dispatches = 0, instructions = 0;
+    for (size_t i = 0; i < code.size(); ++i) {
+        dispatches += p.counts[i];
+        instructions += p.counts[i] * fused_length(code[i].opcode);
+    }
+    out << "mvm profile\n\n";
+    out << dispatches << " dispatches, " << instructions << " instructions\n";
+
+    // opcodes, superinstructions under their own name
+    out << "\nOpcodes\n";
+    snprintf(row, sizeof(row), "  %-22s %14s %7s %10s\n", "opcode", "count", "%", "cycles/op");
+    out << row;
+    std::vector<int> ops;
+    for (int op = 0; op < NUM_OPCODES; ++op) {
+        if (p.op_counts[op])
+            ops.push_back(op);
+    }
+    std::sort(ops.begin(), ops.end(), [&](int a, int b) { return p.op_counts[a] > p.op_counts[b]; });
+    for (int op : ops) {
+        char cycles[32] = "-";
+        if (p.op_samples[op])
+            snprintf(cycles, sizeof(cycles), "%.1f", (double)p.op_cycles[op] / p.op_samples[op]);
+        snprintf(row, sizeof(row), "  %-22s %14llu %6.2f%% %10s\n", opcode_name((OpCode)op),
+                 (unsigned long long)p.op_counts[op], percent(p.op_counts[op], dispatches), cycles);
+        out << row;
+    }
+
+    // basic blocks start at the entry, at jump targets and after jumps
+    std::vector<bool> leader(code.size() + 1, false);
+    leader[0] = true;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (is_jump(code[i].opcode)) {
+            leader[code[i].target] = true;
+            leader[i + 1] = true;
+        } else if (code[i].opcode == HALT || code[i].opcode == EXIT || code[i].opcode == TRAP) {
+            leader[i + 1] = true;
+        }
+    }
+    std::vector<ProfileBlock> blocks;
+    std::vector<size_t> block_of(code.size());
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (leader[i])
+            blocks.push_back({ i, i, p.counts[i], 0 });
+        block_of[i] = blocks.size() - 1;
+        blocks.back().end = i + 1;
+        blocks.back().instructions += p.counts[i] * fused_length(code[i].opcode);
+    }
+
+    std::vector<size_t> hot;
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        if (blocks[b].instructions)
+            hot.push_back(b);
+    }
+    std::sort(hot.begin(), hot.end(), [&](size_t a, size_t b) { return blocks[a].instructions > blocks[b].instructions; });
+    if (hot.size() > PROFILE_TOP)
+        hot.resize(PROFILE_TOP);
+
+    out << "\nHot blocks\n";
+    for (size_t b : hot) {
+        const auto& block = blocks[b];
+        snprintf(row, sizeof(row), "\n  block at pc %u, %s: entered %llu times, %llu instructions (%.2f%%)\n",
+                 (unsigned)code[block.first].pc, where(code[block.first].pc).c_str(),
+                 (unsigned long long)block.entries, (unsigned long long)block.instructions,
+                 percent(block.instructions, instructions));
+        out << row;
+        for (size_t i = block.first; i < block.end; ++i) {
+            // slots a superinstruction covers only run when it falls back
+            if (!p.counts[i] && i != block.first)
+                continue;
+            snprintf(row, sizeof(row), "    %6u %14llu  %s", (unsigned)code[i].pc,
+                     (unsigned long long)p.counts[i], listing(i).c_str());
+            out << row;
+            if (is_conditional(code[i].opcode))
+                out << "  (taken " << p.taken[i] << ")";
+            out << "\n";
+        }
+    }
+
+    // a jump to itself or further up closes a loop; everything in between is its body
+    struct Loop {
+        size_t header;
+        size_t latch;
+        uint64_t iterations;
+        uint64_t instructions;
+    };
+    std::vector<Loop> loops;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (!is_jump(code[i].opcode) || !p.taken[i] || code[i].target > i)
+            continue;
+        Loop loop = { code[i].target, i, p.taken[i], 0 };
+        for (size_t b = block_of[loop.header]; b <= block_of[i]; ++b)
+            loop.instructions += blocks[b].instructions;
+        loops.push_back(loop);
+    }
+    std::sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) { return a.iterations > b.iterations; });
+    if (loops.size() > PROFILE_TOP)
+        loops.resize(PROFILE_TOP);
+
+    out << "\nLoops\n";
+    snprintf(row, sizeof(row), "  %-24s %10s %14s %14s %7s\n", "header", "back edge", "iterations", "instructions", "%");
+    out << row;
+    for (auto& loop : loops) {
+        snprintf(row, sizeof(row), "  %-24s %10u %14llu %14llu %6.2f%%\n", where(code[loop.header].pc).c_str(),
+                 (unsigned)code[loop.latch].pc, (unsigned long long)loop.iterations,
+                 (unsigned long long)loop.instructions, percent(loop.instructions, instructions));
+        out << row;
+    }
+
+    std::vector<size_t> branches;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (is_conditional(code[i].opcode) && p.counts[i])
+            branches.push_back(i);
+    }
+    std::sort(branches.begin(), branches.end(), [&](size_t a, size_t b) { return p.counts[a] > p.counts[b]; });
+    if (branches.size() > PROFILE_TOP)
+        branches.resize(PROFILE_TOP);
+
+    out << "\nBranches\n";
+    snprintf(row, sizeof(row), "  %6s %-24s %14s %14s %7s\n", "pc", "location", "taken", "not taken", "taken%");
+    out << row;
+    for (size_t i : branches) {
+        snprintf(row, sizeof(row), "  %6u %-24s %14llu %14llu %6.2f%%\n", (unsigned)code[i].pc,
+                 where(code[i].pc).c_str(), (unsigned long long)p.taken[i],
+                 (unsigned long long)(p.counts[i] - p.taken[i]), percent(p.taken[i], p.counts[i]));
+        out << row;
+    }
+
+    out.close();
+    return out.good();
+}
+
+#define INSTANTIATE(W)                                                          \
+    template void basic_mvm<W>::enable_profiling(std::string);                 \
+    template std::string basic_mvm<W>::symbol_at(W) const;                     \
+    template bool basic_mvm<W>::write_profile(std::string) const;
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "mvm.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PROFILE_CLOCK()     __rdtsc()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK()     __rdtsc()
+#else
+#include <chrono>
+#define PROFILE_CLOCK()     (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count()
+#endif
+
+#define PROFILE_SAMPLE_PERIOD   61      // dispatches between cycle samples, odd so loops don't alias
+#define PROFILE_TOP             10      // rows per table in the report
+
+// Counters of one profiled program, indexed like mvm::code. Filled in by
+// the profiling instantiation of mvm::execute, one step() per dispatch.
+struct Profile {
+    std::vector<uint64_t> counts;       // dispatches of each decoded instruction
+    std::vector<uint64_t> taken;        // taken jumps of each decoded instruction
+    uint64_t op_counts[NUM_OPCODES] = {};
+    uint64_t op_cycles[NUM_OPCODES] = {};
+    uint64_t op_samples[NUM_OPCODES] = {};
+
+    // every PROFILE_SAMPLE_PERIOD dispatches one instruction is timed from
+    // its dispatch to the next
+    int sampled = -1;
+    uint64_t sample_start = 0;
+    uint32_t countdown = PROFILE_SAMPLE_PERIOD;
+    uint64_t overhead = 0;              // cost of the clock reads themselves
+
+    Profile();
+
+    // sizes the counters for 'code', keeping them if it hasn't changed
+    void attach(size_t code_size);
+
+    void step(size_t index, OpCode op) {
+        ++counts[index];
+        ++op_counts[op];
+        if (sampled >= 0) {
+            uint64_t elapsed = PROFILE_CLOCK() - sample_start;
+            op_cycles[sampled] += elapsed > overhead ? elapsed - overhead : 0;
+            ++op_samples[sampled];
+            sampled = -1;
+        }
+        if (--countdown == 0) {
+            countdown = PROFILE_SAMPLE_PERIOD;
+            sampled = op;
+            sample_start = PROFILE_CLOCK();
+        }
+    }
+};
+
+// Mnemonic of any opcode, superinstructions included
+const char* opcode_name(OpCode op);
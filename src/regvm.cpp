@@ -0,0 +1,650 @@
+#include "mvm.h"
+#include "vector.h"
+
+#include <stdexcept>
+
+// operand forms of a binary register instruction
+enum RegForm {
+    FORM_RR,
+    FORM_AI,
+    FORM_BI,
+};
+
+struct RegBinary {
+    OpCode op;
+    RegOpCode forms[3];
+};
+struct RegBranch {
+    OpCode op;
+    RegOpCode jmpz[3], jmpnz[3];
+};
+
+#define REG_ROW(o, e)       { o, { R_##o, R_##o##_AI, R_##o##_BI } },
+static const RegBinary reg_binary[] = { MVM_BINARY_OPS(REG_ROW) };
+#undef REG_ROW
+#define REG_ROW(o, e)       { o, { R_##o##_JMPZ, R_##o##_AI_JMPZ, R_##o##_BI_JMPZ }, \
+                                 { R_##o##_JMPNZ, R_##o##_AI_JMPNZ, R_##o##_BI_JMPNZ } },
+static const RegBranch reg_branch[] = { MVM_COMPARE_OPS(REG_ROW) };
+#undef REG_ROW
+
+// Stack slot as seen by the translator. Constants and copies of R0 are only
+// written to the slot's register once something needs them there.
+struct Operand {
+    enum Kind { REG, IMM, R0 } kind;
+    uint64_t imm;           // fits the word of the program being translated
+};
+
+// Turns the stack code of one block at a time into register code. The
+// translator keeps a virtual stack whose depth at every instruction is known
+// statically, so slot i always lives in register i + 1.
+template <class Word>
+class RegTranslator {
+public:
+    std::vector<RegInstruction<Word>> out;
+    std::vector<uint32_t> jumps;        // emitted jumps, targets still decoded indices
+    std::vector<Operand> stack;
+    size_t block_start = 0;
+    Word pc = 0;
+
+    static uint16_t home(size_t slot) { return (uint16_t)(slot + 1); }
+
+    RegInstruction<Word>& emit(RegOpCode op) {
+        out.push_back({ nullptr, 0, 0, 0, 0, 0, pc, (uint16_t)stack.size(), op });
+        return out.back();
+    }
+
+    // register holding a slot that isn't a pending constant
+    uint16_t reg_of(size_t slot) {
+        return stack[slot].kind == Operand::R0 ? 0 : home(slot);
+    }
+
+    void materialize(size_t slot) {
+        auto& o = stack[slot];
+        if (o.kind == Operand::IMM)
+            emit(R_MOVI).dst = home(slot), out.back().imm = o.imm;
+        else if (o.kind == Operand::R0)
+            emit(R_MOV).dst = home(slot), out.back().a = 0;
+        o.kind = Operand::REG;
+    }
+    void flush() {
+        for (size_t i = 0; i < stack.size(); ++i)
+            materialize(i);
+    }
+    // copies of R0 have to be saved before R0 is written
+    void save_r0(size_t below) {
+        for (size_t i = 0; i < below; ++i) {
+            if (stack[i].kind == Operand::R0)
+                materialize(i);
+        }
+    }
+
+    // the last instruction of the block, if it produced the top of stack
+    RegInstruction<Word>* producer_of_top() {
+        if (out.size() <= block_start || stack.back().kind != Operand::REG)
+            return nullptr;
+        auto& last = out.back();
+        return last.opcode < R_JMP && last.dst == home(stack.size() - 1) ? &last : nullptr;
+    }
+
+    void pop() {
+        size_t top = stack.size() - 1;
+        if (auto producer = producer_of_top()) {
+            // write the result straight into R0 instead of its slot
+            RegInstruction<Word> insn = *producer;
+            out.pop_back();
+            save_r0(top);
+            insn.dst = 0;
+            if (insn.opcode != R_MOV || insn.a != 0)
+                out.push_back(insn);
+        } else {
+            save_r0(top);
+            if (stack[top].kind == Operand::IMM)
+                emit(R_MOVI).imm = stack[top].imm;
+            else if (stack[top].kind == Operand::REG)
+                emit(R_MOV).a = home(top);
+        }
+        stack.pop_back();
+    }
+
+    void binary(OpCode op) {
+        size_t ia = stack.size() - 1, ib = stack.size() - 2;
+        Operand a = stack[ia], b = stack[ib];
+
+        Word result;
+        if (a.kind == Operand::IMM && b.kind == Operand::IMM) {
+            if (fold_binary<Word>(op, (Word)a.imm, (Word)b.imm, result)) {
+                stack.pop_back();
+                stack.back() = { Operand::IMM, result };
+                return;
+            }
+            materialize(ib);
+            b.kind = Operand::REG;
+        }
+
+        const RegBinary* row = nullptr;
+        for (auto& r : reg_binary) {
+            if (r.op == op)
+                row = &r;
+        }
+        RegForm form = a.kind == Operand::IMM ? FORM_AI : b.kind == Operand::IMM ? FORM_BI : FORM_RR;
+        auto& insn = emit(row->forms[form]);
+        insn.dst = home(ib);
+        if (form == FORM_AI)
+            insn.imm = a.imm;
+        else
+            insn.a = reg_of(ia);
+        if (form == FORM_BI)
+            insn.imm = b.imm;
+        else
+            insn.b = reg_of(ib);
+
+        stack.pop_back();
+        stack.back() = { Operand::REG, 0 };
+    }
+
+    void neg() {
+        size_t top = stack.size() - 1;
+        if (stack[top].kind == Operand::IMM) {
+            stack[top].imm = (Word)~stack[top].imm;
+            return;
+        }
+        auto& insn = emit(R_NEG);
+        insn.dst = home(top);
+        insn.a = reg_of(top);
+        stack[top] = { Operand::REG, 0 };
+    }
+
+    // LOADM, a constant address needs no register
+    void load_memory() {
+        size_t top = stack.size() - 1;
+        if (stack[top].kind == Operand::IMM) {
+            emit(R_LOADMI).dst = home(top), out.back().imm = stack[top].imm;
+        } else {
+            auto& insn = emit(R_LOADM);
+            insn.dst = home(top);
+            insn.a = reg_of(top);
+        }
+        stack[top] = { Operand::REG, 0 };
+    }
+    // LOADX, addressed by R0 as it is right now
+    void load_indexed(Word offset) {
+        auto& insn = emit(R_LOADM);
+        insn.dst = home(stack.size());
+        insn.imm = offset;
+        stack.push_back({ Operand::REG, 0 });
+    }
+
+    // STOREM and STOREX, the value has to be in a register
+    void store_memory(size_t value, const Operand& address, Word offset) {
+        if (stack[value].kind == Operand::IMM)
+            materialize(value);
+        if (address.kind == Operand::IMM) {
+            auto& insn = emit(R_STOREMI);
+            insn.a = reg_of(value);
+            insn.imm = (Word)(address.imm + offset);
+        } else {
+            auto& insn = emit(R_STOREM);
+            insn.a = reg_of(value);
+            insn.b = address.kind == Operand::R0 ? 0 : home(value + 1);
+            insn.imm = offset;
+        }
+    }
+
+    void print() {
+        size_t top = stack.size() - 1;
+        if (stack[top].kind == Operand::IMM)
+            emit(R_PRINTI).imm = stack[top].imm;
+        else
+            emit(R_PRINT).a = reg_of(top);
+    }
+
+    // branch form of a compare instruction, if it is one
+    static RegOpCode fused_branch(RegOpCode compare, OpCode op) {
+        for (auto& r : reg_branch) {
+            for (auto& b : reg_binary) {
+                if (b.op != r.op)
+                    continue;
+                for (int form = 0; form < 3; ++form) {
+                    if (b.forms[form] == compare)
+                        return op == JMPZ ? r.jmpz[form] : r.jmpnz[form];
+                }
+            }
+        }
+        return NUM_REG_OPCODES;
+    }
+
+    void jump(OpCode op, uint32_t target) {
+        RegInstruction<Word>* compare = op == JMP ? nullptr : producer_of_top();
+        RegOpCode fused = compare ? fused_branch(compare->opcode, op) : NUM_REG_OPCODES;
+        if (fused != NUM_REG_OPCODES) {
+            // a compare feeding the branch becomes one instruction
+            RegInstruction<Word> insn = *compare;
+            out.pop_back();
+            flush();
+            insn.opcode = fused;
+            out.push_back(insn);
+        } else if (op == JMP) {
+            flush();
+            emit(R_JMP);
+        } else {
+            flush();
+            emit(op == JMPZ ? R_JMPZ : R_JMPNZ).a = home(stack.size() - 1);
+        }
+        out.back().target = target;
+        jumps.push_back((uint32_t)out.size() - 1);
+    }
+};
+
+// Translates the decoded stack code to register code. Fails, leaving the
+// stack interpreter to run the program, when some instruction can be reached
+// with two different stack depths.
+template <class Word>
+bool basic_mvm<Word>::translate_registers() {
+    rcode.clear();
+    reg_entries.clear();
+    if (code.empty() || stack_depth >= UINT16_MAX)
+        return false;
+
+    // stack depth on entry to every reachable instruction
+    std::vector<int> depth(code.size(), -1);
+    std::vector<bool> leader(code.size(), false);
+    std::vector<uint32_t> worklist = { 0 };
+    depth[0] = 0;
+    leader[0] = true;
+    bool consistent = true;
+    auto reach = [&](uint32_t to, int d) {
+        if (depth[to] < 0) {
+            depth[to] = d;
+            worklist.push_back(to);
+        } else if (depth[to] != d) {
+            consistent = false;
+        }
+    };
+    while (!worklist.empty() && consistent) {
+        uint32_t i = worklist.back();
+        worklist.pop_back();
+
+        OpCode op = unfused_opcode(code[i].opcode);
+        auto effect = effect_of(code[i]);
+        int d = depth[i];
+        if (d < effect.pops || d - effect.pops + effect.pushes > (int)stack_depth)
+            continue;
+        d += effect.pushes - effect.pops;
+
+        switch (op) {
+            case JMP:
+                reach(code[i].target, d);
+                leader[code[i].target] = leader[i + 1] = true;
+                break;
+            case JMPZ: case JMPNZ:
+                reach(code[i].target, d);
+                reach(i + 1, d + 1);
+                leader[code[i].target] = leader[i + 1] = true;
+                break;
+            case CALL: case HALT:
+                // both can stop the VM, so execution must be able to resume after them
+                if (op == CALL)
+                    reach(i + 1, d);
+                leader[i + 1] = true;
+                break;
+            case EXIT: case TRAP:
+                break;
+            default:
+                reach(i + 1, d);
+                break;
+        }
+    }
+    if (!consistent)
+        return false;
+
+    RegTranslator<Word> t;
+    std::vector<uint32_t> index_of(code.size(), UINT32_MAX);
+    bool live = false;
+    for (uint32_t i = 0; i < code.size(); ++i) {
+        if (depth[i] < 0)
+            continue;
+
+        const auto& insn = code[i];
+        OpCode op = unfused_opcode(insn.opcode);
+        if (leader[i] || op == EXIT) {
+            if (live)
+                t.flush();
+            t.stack.assign(depth[i], { Operand::REG, 0 });
+            t.block_start = t.out.size();
+            index_of[i] = (uint32_t)t.out.size();
+            reg_entries.edit().push_back({ insn.pc, (uint16_t)depth[i], index_of[i] });
+        }
+        t.pc = insn.pc;
+        live = true;
+
+        auto effect = effect_of(insn);
+        size_t d = t.stack.size();
+        if ((int)d < effect.pops || d - effect.pops + effect.pushes > stack_depth) {
+            t.flush();
+            t.emit(R_TRAP).imm = (int)d < effect.pops ? TRAP_STACK_UNDERFLOW : TRAP_STACK_OVERFLOW;
+            live = false;
+            continue;
+        }
+
+        switch (op) {
+            case NOP:
+                break;
+            case PUSH:
+                t.stack.push_back({ Operand::IMM, insn.arg });
+                break;
+            case LOAD:
+                t.stack.push_back({ Operand::R0, 0 });
+                break;
+            case POP:
+                t.pop();
+                break;
+#define TRANSLATE(o, e)     case o:
+            MVM_BINARY_OPS(TRANSLATE)
+#undef TRANSLATE
+                t.binary(op);
+                break;
+            case NEG:
+                t.neg();
+                break;
+            case PRINT:
+                t.print();
+                break;
+            case LOADM:
+                t.load_memory();
+                break;
+            case LOADX:
+                t.load_indexed(insn.arg);
+                break;
+            case STOREM:
+                t.store_memory(d - 2, t.stack[d - 1], 0);
+                t.stack.resize(d - 2);
+                break;
+            case STOREX:
+                t.store_memory(d - 1, { Operand::R0, 0 }, insn.arg);
+                t.stack.pop_back();
+                break;
+            case MFILL: case MCOPY: case VADD: case VSUB: case VMUL: case VAND: case VOR: case VXOR:
+            case VEQ: case VLT: case VGT: case VSUM: case VMIN: case VMAX: {
+                // the operands go in consecutive registers, the kernels take them from there
+                t.flush();
+                auto& vec = t.emit(R_VECTOR);
+                vec.imm = op;
+                vec.a = vec.dst = RegTranslator<Word>::home(d - effect.pops);
+                t.stack.resize(d - effect.pops + effect.pushes, { Operand::REG, 0 });
+                break;
+            }
+            case CALL: {
+                // arguments in consecutive registers, the results replace them
+                t.flush();
+                t.stack.resize(d - effect.pops + effect.pushes, { Operand::REG, 0 });
+                t.pc = code[i + 1].pc;
+                auto& call = t.emit(R_CALL);
+                call.imm = insn.arg;
+                call.a = RegTranslator<Word>::home(d - effect.pops);
+                break;
+            }
+            case JMP: case JMPZ: case JMPNZ:
+                t.jump(op, insn.target);
+                live = op != JMP;
+                break;
+            case HALT:
+                t.flush();
+                t.pc = code[i + 1].pc;
+                t.emit(R_HALT);
+                live = false;
+                break;
+            case EXIT:
+                t.emit(R_EXIT);
+                live = false;
+                break;
+            default:
+                t.flush();
+                t.emit(R_TRAP).imm = insn.arg;
+                live = false;
+                break;
+        }
+    }
+
+    // a jump that stops the VM reports the state at its destination
+    for (uint32_t at : t.jumps) {
+        auto& jump = t.out[at];
+        jump.pc = code[jump.target].pc;
+        jump.depth = (uint16_t)depth[jump.target];
+        jump.target = index_of[jump.target];
+    }
+    rcode.assign(std::move(t.out));
+    return true;
+}
+
+// Interpreter for the register tier. Stack depths are known at every
+// instruction, so no handler checks for underflow or overflow; those were
+// turned into TRAP instructions by the translator.
+#ifdef MVM_THREADED_DISPATCH
+#define VM_OP(o)            op_##o:
+#define VM_DISPATCH()       goto *ip->handler
+#else
+#define VM_OP(o)            case o: op_##o:
+#define VM_DISPATCH()       continue
+#endif
+#define VM_NEXT()           ++ip; VM_DISPATCH()
+#define VM_JUMP()           {                                   \
+                                if (!running)                   \
+                                    goto done;                  \
+                                ip = &rcode[ip->target];        \
+                                VM_DISPATCH();                  \
+                            }
+#define VM_SYNC()           do { pc = ip->pc; reg = R[0]; sp = ip->depth; } while (0)
+#define VM_TRAP(msg)        do { VM_SYNC(); flush_calls(); out->flush(); throw std::runtime_error(msg); } while (0)
+#define VM_BINARY(o, expr)                                      \
+    VM_OP(R_##o) {                                              \
+        Word a = R[ip->a];                                      \
+        Word b = R[ip->b];                                      \
+        R[ip->dst] = (Word)(expr);                              \
+        VM_NEXT();                                              \
+    }                                                           \
+    VM_OP(R_##o##_AI) {                                         \
+        Word a = ip->imm;                                       \
+        Word b = R[ip->b];                                      \
+        R[ip->dst] = (Word)(expr);                              \
+        VM_NEXT();                                              \
+    }                                                           \
+    VM_OP(R_##o##_BI) {                                         \
+        Word a = R[ip->a];                                      \
+        Word b = ip->imm;                                       \
+        R[ip->dst] = (Word)(expr);                              \
+        VM_NEXT();                                              \
+    }
+
+// The compare result stays in its register, a JMPZ that falls through
+// leaves it on the stack.
+#define VM_COMPARE_BRANCH(name, A, B, expr, cond)               \
+    VM_OP(name) {                                               \
+        Word a = A;                                             \
+        Word b = B;                                             \
+        Word c = (Word)(expr);                                  \
+        R[ip->dst] = c;                                         \
+        if (cond)                                               \
+            VM_JUMP();                                          \
+        VM_NEXT();                                              \
+    }
+#define VM_BRANCHES(o, expr)                                                \
+    VM_COMPARE_BRANCH(R_##o##_JMPZ, R[ip->a], R[ip->b], expr, c == 0)       \
+    VM_COMPARE_BRANCH(R_##o##_AI_JMPZ, ip->imm, R[ip->b], expr, c == 0)     \
+    VM_COMPARE_BRANCH(R_##o##_BI_JMPZ, R[ip->a], ip->imm, expr, c == 0)     \
+    VM_COMPARE_BRANCH(R_##o##_JMPNZ, R[ip->a], R[ip->b], expr, c != 0)      \
+    VM_COMPARE_BRANCH(R_##o##_AI_JMPNZ, ip->imm, R[ip->b], expr, c != 0)    \
+    VM_COMPARE_BRANCH(R_##o##_BI_JMPNZ, R[ip->a], ip->imm, expr, c != 0)
+
+template <class Word>
+RunStatus basic_mvm<Word>::start_registers() {
+    if (code.empty() && !decode())
+        return RUN_UNSUPPORTED;
+    if (rcode.empty() && !translate_registers())
+        return RUN_UNSUPPORTED;
+
+#ifdef MVM_THREADED_DISPATCH
+    static const void* const handlers[] = {
+        &&op_R_MOV, &&op_R_MOVI, &&op_R_NEG,
+#define REG_HANDLERS(o, e)  &&op_R_##o, &&op_R_##o##_AI, &&op_R_##o##_BI,
+        MVM_BINARY_OPS(REG_HANDLERS)
+#undef REG_HANDLERS
+        &&op_R_LOADM, &&op_R_LOADMI,
+        &&op_R_JMP, &&op_R_JMPZ, &&op_R_JMPNZ,
+#define REG_HANDLERS(o, e)  &&op_R_##o##_JMPZ, &&op_R_##o##_AI_JMPZ, &&op_R_##o##_BI_JMPZ, \
+                            &&op_R_##o##_JMPNZ, &&op_R_##o##_AI_JMPNZ, &&op_R_##o##_BI_JMPNZ,
+        MVM_COMPARE_OPS(REG_HANDLERS)
+#undef REG_HANDLERS
+        &&op_R_PRINT, &&op_R_PRINTI, &&op_R_STOREM, &&op_R_STOREMI, &&op_R_VECTOR, &&op_R_CALL, &&op_R_HALT, &&op_R_EXIT, &&op_R_TRAP,
+    };
+    static_assert(sizeof(handlers) / sizeof(*handlers) == NUM_REG_OPCODES, "handler table out of sync with RegOpCode");
+
+    // installed once, attached VMs share the translation
+    if (rcode[0].handler != handlers[rcode[0].opcode]) {
+        for (auto& insn : rcode.edit())
+            insn.handler = handlers[insn.opcode];
+    }
+#endif
+
+    // register code can only be entered where the whole stack is in registers
+    const RegInstruction<Word>* ip = nullptr;
+    for (auto& entry : reg_entries) {
+        if (entry.pc == pc && entry.depth == sp) {
+            ip = &rcode[entry.index];
+            break;
+        }
+    }
+    if (!ip)
+        return RUN_UNSUPPORTED;
+
+    Word* const R = stck.data();
+    R[0] = reg;
+    uint8_t* const mem = memory.data();
+
+    RunStatus status = RUN_STOPPED;
+    running = 1;
+    try {
+#ifdef MVM_THREADED_DISPATCH
+        VM_DISPATCH();
+#else
+        for (;;) switch (ip->opcode) {
+#endif
+        VM_OP(R_MOV) {
+            R[ip->dst] = R[ip->a];
+            VM_NEXT();
+        }
+        VM_OP(R_MOVI) {
+            R[ip->dst] = ip->imm;
+            VM_NEXT();
+        }
+        VM_OP(R_NEG) {
+            R[ip->dst] = (Word)~R[ip->a];
+            VM_NEXT();
+        }
+        MVM_BINARY_OPS(VM_BINARY)
+        VM_OP(R_LOADM) {
+            R[ip->dst] = load_word<Word>(mem, (Word)(R[ip->a] + ip->imm));
+            VM_NEXT();
+        }
+        VM_OP(R_LOADMI) {
+            R[ip->dst] = load_word<Word>(mem, ip->imm);
+            VM_NEXT();
+        }
+        VM_OP(R_JMP) {
+            VM_JUMP();
+        }
+        VM_OP(R_JMPZ) {
+            if (R[ip->a] == 0)
+                VM_JUMP();
+            VM_NEXT();
+        }
+        VM_OP(R_JMPNZ) {
+            if (R[ip->a] != 0)
+                VM_JUMP();
+            VM_NEXT();
+        }
+        MVM_COMPARE_OPS(VM_BRANCHES)
+        VM_OP(R_PRINT) {
+            out->print(R[ip->a]);
+            VM_NEXT();
+        }
+        VM_OP(R_PRINTI) {
+            out->print(ip->imm);
+            VM_NEXT();
+        }
+        VM_OP(R_STOREM) {
+            store_word<Word>(mem, (Word)(R[ip->b] + ip->imm), R[ip->a]);
+            VM_NEXT();
+        }
+        VM_OP(R_STOREMI) {
+            store_word<Word>(mem, ip->imm, R[ip->a]);
+            VM_NEXT();
+        }
+        VM_OP(R_VECTOR) {
+            // dst is dead after ops without a result
+            R[ip->dst] = vector_op<Word>(mem, (OpCode)ip->imm, &R[ip->a]);
+            VM_NEXT();
+        }
+        VM_OP(R_CALL) {
+            call_host(ip->imm, &R[ip->a]);
+            if (!running)
+                goto done;
+            VM_NEXT();
+        }
+        VM_OP(R_HALT) {
+            out->flush();
+            MVM_LOG("HALT\n");
+            status = RUN_HALTED;
+            goto done;
+        }
+        VM_OP(R_EXIT) {
+            status = RUN_EXIT;
+            goto done;
+        }
+        VM_OP(R_TRAP) {
+            switch (ip->imm) {
+                case TRAP_STACK_UNDERFLOW:
+                    VM_TRAP("Stack underflow");
+                case TRAP_STACK_OVERFLOW:
+                    VM_TRAP("Stack overflow");
+                case TRAP_INVALID_OPCODE:
+                    VM_TRAP("Invalid opcode " + std::to_string((unsigned char)program.at(ip->pc)));
+                case TRAP_TRUNCATED_OPERAND:
+                    VM_TRAP("Truncated operand");
+                case TRAP_INVALID_CALL:
+                    VM_TRAP("Invalid call");
+                default:
+                    VM_TRAP("Invalid jump target");
+            }
+        }
+#ifndef MVM_THREADED_DISPATCH
+        default:
+            goto done;
+        }
+#endif
+    done:
+        VM_SYNC();
+        running = 0;
+        flush_calls();
+        out->flush();
+        return status;
+    }
+    CATCH
+    running = 0;
+    return RUN_TRAP;
+}
+
+#undef VM_OP
+#undef VM_DISPATCH
+#undef VM_NEXT
+#undef VM_JUMP
+#undef VM_SYNC
+#undef VM_TRAP
+#undef VM_BINARY
+#undef VM_COMPARE_BRANCH
+#undef VM_BRANCHES
+
+#define INSTANTIATE(W)                                                          \
+    template bool basic_mvm<W>::translate_registers();                         \
+    template RunStatus basic_mvm<W>::start_registers();
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
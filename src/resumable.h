@@ -0,0 +1,79 @@
+#pragma once
+
+#include "mvm.h"
+
+// C++20 only, the VM itself builds as C++17
+#if __has_include(<coroutine>) && (__cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L))
+#define MVM_COROUTINES
+#include <coroutine>
+#include <utility>
+
+// A run of a VM as a coroutine that suspends after every slice with how the
+// slice ended, the last one being RUN_HALTED, RUN_EXIT, RUN_STOPPED or
+// RUN_TRAP. See run_slices and execution.
+//
+//     for (RunStatus status : run_slices(*vm, 1000))
+//         loop.poll();
+class vm_slices {
+public:
+    struct promise_type {
+        RunStatus status = RUN_YIELD;
+
+        vm_slices get_return_object() { return vm_slices(handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(RunStatus s) noexcept {
+            status = s;
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() { throw; }
+    };
+    using handle = std::coroutine_handle<promise_type>;
+
+    class iterator {
+    public:
+        explicit iterator(handle h) : h(h) {}
+        RunStatus operator*() const { return h.promise().status; }
+        iterator& operator++() {
+            h.resume();
+            return *this;
+        }
+        bool operator==(std::default_sentinel_t) const { return h.done(); }
+
+    private:
+        handle h;
+    };
+
+    vm_slices(vm_slices&& other) noexcept : h(std::exchange(other.h, nullptr)) {}
+    vm_slices& operator=(vm_slices other) noexcept {
+        std::swap(h, other.h);
+        return *this;
+    }
+    ~vm_slices() {
+        if (h)
+            h.destroy();
+    }
+
+    // runs the first slice
+    iterator begin() {
+        h.resume();
+        return iterator(h);
+    }
+    std::default_sentinel_t end() const { return {}; }
+
+private:
+    explicit vm_slices(handle h) : h(h) {}
+
+    handle h;
+};
+
+// Runs 'vm' 'budget' instructions at a time, one slice per resumption
+inline vm_slices run_slices(any_mvm& vm, int64_t budget) {
+    for (execution run = vm.run_for(budget);; run.resume()) {
+        co_yield run.status();
+        if (run.finished())
+            co_return;
+    }
+}
+#endif
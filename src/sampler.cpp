@@ -0,0 +1,262 @@
+#include "sampler.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+
+#ifdef MVM_SAMPLER
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__) && defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+// The signal handler can't be handed a pointer, so the sampler it feeds is
+// global. setitimer is per process anyway, only one sampler runs at a time.
+static std::atomic<Sampler*> active_sampler{ nullptr };
+
+Sampler::Sampler(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    ring.reset(new Slot[size]);
+    mask = size - 1;
+    for (size_t i = 0; i < size; ++i)
+        ring[i].seq.store(i, std::memory_order_relaxed);
+}
+
+Sampler::~Sampler() {
+    stop();
+}
+
+// Any thread can take the signal while another is still in the handler, so
+// producers claim a slot with a CAS on head. A slot the drain thread hasn't
+// freed yet means the ring is full and the sample is counted as dropped.
+void Sampler::push(uint64_t key) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot& slot = ring[pos & mask];
+        size_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.key = key;
+                slot.seq.store(pos + 1, std::memory_order_release);
+                return;
+            }
+        } else if (seq < pos) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void Sampler::drain() {
+    for (;;) {
+        Slot& slot = ring[tail & mask];
+        if (slot.seq.load(std::memory_order_acquire) != tail + 1)
+            break;
+        ++counts[slot.key];
+        ++total;
+        slot.seq.store(tail + mask + 1, std::memory_order_release);
+        ++tail;
+    }
+}
+
+#ifdef MVM_SAMPLER
+
+static struct sigaction previous_action;
+
+static void on_sigprof(int, siginfo_t*, void* context) {
+    Sampler* s = active_sampler.load(std::memory_order_acquire);
+    if (!s)
+        return;
+    uint64_t key = SAMPLE_RUNTIME;
+    if (const void* ip = s->current.load(std::memory_order_relaxed)) {
+        key = SAMPLE_INTERP | ((uintptr_t)ip - s->code_begin.load(std::memory_order_relaxed));
+    } else {
+#if defined(__linux__) && defined(__x86_64__)
+        uintptr_t rip = (uintptr_t)((ucontext_t*)context)->uc_mcontext.gregs[REG_RIP];
+        uintptr_t begin = s->native_begin.load(std::memory_order_relaxed);
+        if (rip >= begin && rip < s->native_end.load(std::memory_order_relaxed))
+            key = SAMPLE_NATIVE | (rip - begin);
+#else
+        (void)context;
+#endif
+    }
+    s->push(key);
+}
+
+bool Sampler::start() {
+    Sampler* expected = nullptr;
+    if (!active_sampler.compare_exchange_strong(expected, this))
+        return false;
+
+    draining = true;
+    drain_thread = std::thread([this] {
+        while (draining) {
+            drain();
+            std::this_thread::sleep_for(std::chrono::milliseconds(SAMPLER_DRAIN_MS));
+        }
+    });
+
+    struct sigaction action = {};
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previous_action);
+
+    struct itimerval timer = {};
+    timer.it_interval.tv_usec = SAMPLER_INTERVAL_US;
+    timer.it_value.tv_usec = SAMPLER_INTERVAL_US;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    return true;
+}
+
+void Sampler::stop() {
+    if (active_sampler.load() != this)
+        return;
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sigaction(SIGPROF, &previous_action, nullptr);
+    active_sampler = nullptr;
+
+    draining = false;
+    drain_thread.join();
+    drain();
+}
+
+#else
+
+bool Sampler::start() {
+    return false;
+}
+void Sampler::stop() {
+}
+
+#endif
+
+template <class Word>
+bool basic_mvm<Word>::enable_sampling(std::string folded_path) {
+    auto s = std::make_shared<Sampler>();
+    if (!s->start())
+        return false;
+    sampling = s;
+    sampling_path = folded_path;
+    return true;
+}
+
+template <class Word>
+void basic_mvm<Word>::finish_sampling() {
+    if (!sampling)
+        return;
+    sampling->stop();
+    if (sampling_path.empty())
+        return;
+    if (write_samples(sampling_path))
+        cerr << sampling->total << " samples written to '" << sampling_path << "'";
+    else
+        cerr << "Could not write samples '" << sampling_path << "'!";
+    if (sampling->dropped)
+        cerr << ", " << sampling->dropped << " dropped";
+    cerr << "\n";
+}
+
+// flamegraph.pl splits frames on ';' and the count off at the last space
+static std::string frame_name(std::string name) {
+    std::replace(name.begin(), name.end(), ';', '_');
+    std::replace(name.begin(), name.end(), ' ', '_');
+    return name;
+}
+
+// Writes folded stacks, one "frame;frame;... count" line per distinct stack:
+// the tier, the enclosing label and the instruction. There are no guest calls
+// yet, once there are their frames belong between the tier and the label.
+template <class Word>
+bool basic_mvm<Word>::write_samples(std::string path) const {
+    if (!sampling)
+        return false;
+    std::ofstream out(path);
+    if (!out.good())
+        return false;
+
+    // native code runs superinstructions as their first instruction
+    auto instruction = [&](size_t i, bool native) {
+        std::string label;
+        uint32_t label_pc;
+        if (!find_symbol(image.symbols, code[i].pc, label, label_pc))
+            label = "[no symbols]";
+        OpCode op = native ? unfused_opcode(code[i].opcode) : code[i].opcode;
+        return frame_name(label) + ";" + opcode_name(op) + "@" + std::to_string(code[i].pc);
+    };
+
+    std::map<std::string, uint64_t> stacks;
+    for (auto& sample : sampling->counts) {
+        uint64_t at = sample.first & ~SAMPLE_KIND;
+        std::string stack = "mvm;";
+        switch (sample.first & SAMPLE_KIND) {
+            case SAMPLE_INTERP: {
+                size_t i = at / sizeof(code[0]);
+                stack += "interpreter;" + (i < code.size() ? instruction(i, false) : std::string("[unknown]"));
+                break;
+            }
+            case SAMPLE_NATIVE: {
+                auto it = std::upper_bound(jit_labels.begin(), jit_labels.end(), (uint32_t)at);
+                stack += "native;" + (it == jit_labels.begin() ? std::string("[entry]") : instruction(it - jit_labels.begin() - 1, true));
+                break;
+            }
+            default:
+                stack += "[runtime]";
+                break;
+        }
+        stacks[stack] += sample.second;
+    }
+    for (auto& stack : stacks)
+        out << stack.first << " " << stack.second << "\n";
+    out.close();
+    return out.good();
+}
+
+// perf looks up symbols for anonymous executable memory in this file, one
+// "start size name" line per range, so its samples land on bytecode offsets
+template <class Word>
+bool basic_mvm<Word>::write_perf_map() const {
+#ifdef MVM_SAMPLER
+    if (!jit_code)
+        return false;
+    std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    FILE* f = fopen(path.c_str(), "a");
+    if (!f)
+        return false;
+    uintptr_t base = (uintptr_t)jit_code;
+    if (!jit_labels.empty() && jit_labels[0])
+        fprintf(f, "%lx %x mvm:[entry]\n", (unsigned long)base, jit_labels[0]);
+    for (size_t i = 0; i < jit_labels.size(); ++i) {
+        size_t end = i + 1 < jit_labels.size() ? jit_labels[i + 1] : jit_size;
+        if (end == jit_labels[i])
+            continue;
+        std::string name = symbol_at(code[i].pc);
+        if (name.empty())
+            name = "pc" + std::to_string(code[i].pc);
+        fprintf(f, "%lx %lx mvm:%s:%s\n", (unsigned long)(base + jit_labels[i]), (unsigned long)(end - jit_labels[i]),
+                name.c_str(), opcode_name(unfused_opcode(code[i].opcode)));
+    }
+    return fclose(f) == 0;
+#else
+    return false;
+#endif
+}
+
+#define INSTANTIATE(W)                                                          \
+    template bool basic_mvm<W>::enable_sampling(std::string);                  \
+    template void basic_mvm<W>::finish_sampling();                             \
+    template bool basic_mvm<W>::write_samples(std::string) const;              \
+    template bool basic_mvm<W>::write_perf_map() const;
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "mvm.h"
+
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
+// SIGPROF and setitimer only exist on POSIX systems
+#if defined(__unix__) || defined(__APPLE__)
+#define MVM_SAMPLER
+#endif
+
+#define SAMPLER_RING        (1 << 14)   // samples in flight between the handler and the drain thread
+#define SAMPLER_INTERVAL_US 1000        // CPU time between samples
+#define SAMPLER_DRAIN_MS    20
+
+// What a sample caught, the kind in the top bits and a position below
+#define SAMPLE_RUNTIME      0ull            // neither the interpreter nor native code, e.g. a CALL
+#define SAMPLE_INTERP       (1ull << 40)    // | byte offset of the instruction in mvm::code
+#define SAMPLE_NATIVE       (2ull << 40)    // | offset into mvm::jit_code
+#define SAMPLE_KIND         (~0ull << 40)
+
+// State of one sampled VM. The sampling instantiation of mvm::execute
+// publishes each instruction it dispatches in 'current', and a timer signal
+// turns whatever is there, or the interrupted native pc, into a sample.
+// Samples go through a bounded lock-free ring, since the handler can't take
+// locks or allocate, and a drain thread folds them into 'counts'.
+struct Sampler {
+    std::atomic<const void*> current{ nullptr };
+    std::atomic<uintptr_t> code_begin{ 0 };
+    std::atomic<uintptr_t> native_begin{ 0 };
+    std::atomic<uintptr_t> native_end{ 0 };
+
+    // Each slot's sequence says whose turn it is: equal to the write position
+    // it's free, one past it it holds a sample for the drain thread
+    struct Slot {
+        std::atomic<size_t> seq;
+        uint64_t key;
+    };
+    std::unique_ptr<Slot[]> ring;
+    size_t mask;
+    std::atomic<size_t> head{ 0 };
+    size_t tail = 0;                    // drain thread only
+    std::atomic<uint64_t> dropped{ 0 };
+
+    std::unordered_map<uint64_t, uint64_t> counts;
+    uint64_t total = 0;
+
+    std::thread drain_thread;
+    std::atomic<bool> draining{ false };
+
+    explicit Sampler(size_t capacity = SAMPLER_RING);
+    ~Sampler();
+
+    // installs the handler and arms the timer, false if another sampler runs
+    // or the platform has no SIGPROF
+    bool start();
+    // disarms the timer and folds whatever is still in the ring
+    void stop();
+
+    // async-signal-safe, drops the sample if the ring is full
+    void push(uint64_t key);
+    void drain();
+};
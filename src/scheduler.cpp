@@ -0,0 +1,163 @@
+#include "scheduler.h"
+
+using std::chrono::steady_clock;
+
+// __sleep takes milliseconds on Windows and seconds everywhere else
+#ifdef _MSC_VER
+#define SLEEP_UNIT  std::chrono::milliseconds(1)
+#else
+#define SLEEP_UNIT  std::chrono::seconds(1)
+#endif
+
+scheduler::TimerWheel::TimerWheel() : origin(steady_clock::now()), slots(TIMER_SLOTS) {}
+
+static uint64_t tick_of(steady_clock::duration since_origin) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(since_origin).count() / TIMER_TICK_MS;
+}
+
+void scheduler::TimerWheel::add(Task* task, steady_clock::duration delay) {
+    auto now = steady_clock::now();
+    // an empty wheel isn't advanced, catch up so it won't walk idle ticks later
+    if (!pending)
+        current = std::max(current, tick_of(now - origin));
+    uint64_t tick = tick_of(now + delay - origin + std::chrono::milliseconds(TIMER_TICK_MS - 1));
+    task->wake_tick = std::max(tick, current);
+    slots[task->wake_tick % TIMER_SLOTS].push_back(task);
+    ++pending;
+}
+
+void scheduler::TimerWheel::advance(steady_clock::time_point now, std::vector<Task*>& due) {
+    uint64_t target = tick_of(now - origin);
+    for (; current <= target && pending; ++current) {
+        auto& slot = slots[current % TIMER_SLOTS];
+        for (size_t i = 0; i < slot.size();) {
+            if (slot[i]->wake_tick <= current) {
+                due.push_back(slot[i]);
+                slot[i] = slot.back();
+                slot.pop_back();
+                --pending;
+            } else {
+                ++i;
+            }
+        }
+    }
+    current = std::max(current, target);
+}
+
+scheduler::scheduler(size_t workers, int64_t slice, exit_handler on_exit)
+    : slice(slice), on_exit(std::move(on_exit)) {
+    if (!workers)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < workers; ++i)
+        queues.push_back(std::make_unique<Queue>());
+    for (size_t i = 0; i < workers; ++i)
+        threads.emplace_back(&scheduler::worker, this, i);
+}
+
+scheduler::~scheduler() {
+    wait();
+    stopping = true;
+    idle.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+void scheduler::spawn(std::unique_ptr<any_mvm> vm) {
+    {
+        std::lock_guard<std::mutex> lock(done_lock);
+        ++live;
+    }
+    push(next_queue++ % queues.size(), new Task{ std::move(vm), 0 });
+}
+
+void scheduler::wait() {
+    std::unique_lock<std::mutex> lock(done_lock);
+    done.wait(lock, [&] { return live == 0; });
+}
+
+void scheduler::push(size_t worker, Task* task) {
+    {
+        std::lock_guard<std::mutex> lock(queues[worker]->lock);
+        queues[worker]->tasks.push_back(task);
+        ++queued;
+    }
+    idle.notify_one();
+}
+
+// Own queue first, oldest task first so VMs take turns. Thieves take from the
+// other end of a victim's queue.
+scheduler::Task* scheduler::next_task(size_t self) {
+    for (size_t k = 0; k < queues.size(); ++k) {
+        auto& q = *queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> lock(q.lock);
+        if (q.tasks.empty())
+            continue;
+        Task* task;
+        if (k == 0) {
+            task = q.tasks.front();
+            q.tasks.pop_front();
+        } else {
+            task = q.tasks.back();
+            q.tasks.pop_back();
+        }
+        --queued;
+        return task;
+    }
+    return nullptr;
+}
+
+// Any worker may advance the wheel; if another one is at it already there's
+// no need to wait.
+void scheduler::poll_timers(size_t self) {
+    std::vector<Task*> due;
+    {
+        std::unique_lock<std::mutex> lock(timer_lock, std::try_to_lock);
+        if (!lock.owns_lock() || timers.empty())
+            return;
+        timers.advance(steady_clock::now(), due);
+    }
+    for (Task* task : due)
+        push(self, task);
+}
+
+void scheduler::finish(Task* task) {
+    delete task;
+    std::lock_guard<std::mutex> lock(done_lock);
+    if (--live == 0)
+        done.notify_all();
+}
+
+void scheduler::worker(size_t self) {
+    while (!stopping) {
+        poll_timers(self);
+
+        Task* task = next_task(self);
+        if (!task) {
+            std::unique_lock<std::mutex> lock(idle_lock);
+            idle.wait_for(lock, std::chrono::milliseconds(TIMER_TICK_MS), [&] {
+                return queued > 0 || stopping;
+            });
+            continue;
+        }
+
+        RunStatus status = task->vm->run(slice, true);
+        switch (status) {
+            case RUN_YIELD:
+                push(self, task);
+                break;
+            case RUN_SLEEP:
+                if (task->vm->sleep_time() == 0) {
+                    push(self, task);
+                } else {
+                    std::lock_guard<std::mutex> lock(timer_lock);
+                    timers.add(task, task->vm->sleep_time() * SLEEP_UNIT);
+                }
+                break;
+            default:
+                if (on_exit)
+                    on_exit(*task->vm, status);
+                finish(task);
+                break;
+        }
+    }
+}
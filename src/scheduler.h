@@ -0,0 +1,88 @@
+#pragma once
+
+#include "mvm.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#define SCHED_SLICE         10000   // instructions a VM runs before it yields
+#define TIMER_SLOTS         256
+#define TIMER_TICK_MS       10
+
+// Runs many VMs over a pool of worker threads. Every worker owns a queue of
+// runnable VMs and steals from the others when its own runs dry. A VM runs for
+// one instruction budget slice at a time; CALL __sleep parks it on a timer
+// wheel instead of blocking the worker, and it is queued again once due.
+class scheduler {
+public:
+    // called on a worker thread once a VM halts, ends, stops or traps, just
+    // before the scheduler drops it
+    using exit_handler = std::function<void(any_mvm& vm, RunStatus status)>;
+
+    explicit scheduler(size_t workers = 0, int64_t slice = SCHED_SLICE, exit_handler on_exit = nullptr);
+    ~scheduler();
+
+    // takes over a loaded VM and queues it to run
+    void spawn(std::unique_ptr<any_mvm> vm);
+    // blocks until every spawned VM has finished
+    void wait();
+
+private:
+    struct Task {
+        std::unique_ptr<any_mvm> vm;
+        uint64_t wake_tick;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task*> tasks;
+    };
+
+    // Hashed timer wheel. A task due in more than TIMER_SLOTS ticks stays in
+    // its slot until the wheel comes round to its tick.
+    class TimerWheel {
+    public:
+        TimerWheel();
+        void add(Task* task, std::chrono::steady_clock::duration delay);
+        // moves every task due by 'now' into 'due'
+        void advance(std::chrono::steady_clock::time_point now, std::vector<Task*>& due);
+        bool empty() const { return pending == 0; }
+
+    private:
+        std::chrono::steady_clock::time_point origin;
+        std::vector<std::vector<Task*>> slots;
+        uint64_t current = 0;
+        size_t pending = 0;
+    };
+
+    void worker(size_t self);
+    Task* next_task(size_t self);
+    void push(size_t worker, Task* task);
+    void poll_timers(size_t self);
+    void finish(Task* task);
+
+    int64_t slice;
+    exit_handler on_exit;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_queue{ 0 };
+
+    std::mutex timer_lock;
+    TimerWheel timers;
+
+    // idle workers sleep here until work is queued or a timer may be due
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    std::atomic<size_t> queued{ 0 };
+    std::atomic<bool> stopping{ false };
+
+    std::mutex done_lock;
+    std::condition_variable done;
+    size_t live = 0;
+};
@@ -0,0 +1,187 @@
+#include "snapshot.h"
+
+#include <new>
+
+template <class Word>
+std::shared_ptr<const vm_snapshot> basic_mvm<Word>::snapshot() {
+    if (code.empty()) {
+        error = "Nothing is loaded to snapshot";
+        return nullptr;
+    }
+    // one program VM for every snapshot of this run, however many are taken
+    if (!origin) {
+        auto program = std::make_shared<basic_mvm>(stack_depth);
+        if (!program->attach(*this)) {
+            error = program->last_error();
+            return nullptr;
+        }
+        origin = program;
+    }
+
+    auto s = std::make_shared<vm_snapshot>();
+    s->program = origin;
+    s->binary = image.file;
+    s->word_bits = word_bits;
+    s->stack_depth = stack_depth;
+    s->pc = pc;
+    s->reg = reg;
+    s->resume = resume;
+    s->stack.assign(stck.begin() + 1, stck.begin() + 1 + sp);
+    try {
+        s->memory = std::make_shared<memory_image>(memory.data());
+    } catch (const std::bad_alloc&) {
+        error = "Could not copy memory for the snapshot";
+        return nullptr;
+    }
+    return s;
+}
+
+template <class Word>
+bool basic_mvm<Word>::restore(const vm_snapshot& snapshot) {
+    if (snapshot.word_bits != word_bits) {
+        error = "The snapshot is of a " + std::to_string(snapshot.word_bits) + "-bit VM, this VM runs " +
+                std::to_string(word_bits) + "-bit binaries";
+        return false;
+    }
+    if (snapshot.stack.size() > stack_depth) {
+        error = "The snapshot's stack is deeper than this VM's";
+        return false;
+    }
+    if (origin != snapshot.program) {
+        if (!attach(*snapshot.program))
+            return false;
+        origin = snapshot.program;
+    }
+
+    flush_calls();
+    pc = (Word)snapshot.pc;
+    reg = (Word)snapshot.reg;
+    resume = (size_t)snapshot.resume;
+    sp = snapshot.stack.size();
+    for (size_t i = 0; i < sp; ++i)
+        stck[i + 1] = (Word)snapshot.stack[i];
+    sleep_request = 0;
+    memory.assign(*snapshot.memory);
+    error.clear();
+    state_changed = true;
+    return true;
+}
+
+#define INSTANTIATE(W)                                                          \
+    template std::shared_ptr<const vm_snapshot> basic_mvm<W>::snapshot();      \
+    template bool basic_mvm<W>::restore(const vm_snapshot&);
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
+
+std::unique_ptr<any_mvm> fork_mvm(const vm_snapshot& snapshot, std::string* error) {
+    auto vm = create_mvm(snapshot.word_bits, snapshot.stack_depth);
+    if (!vm || !vm->restore(snapshot)) {
+        if (error)
+            *error = vm ? vm->last_error() : "Unsupported word size";
+        return nullptr;
+    }
+    return vm;
+}
+
+// pages of guest memory a snapshot can hold, the last one partly slack
+static const uint32_t snapshot_pages = (MEMORY_SIZE + MEMORY_SLACK + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE;
+
+bool save_snapshot(const vm_snapshot& snapshot, const std::string& path) {
+    ByteSpan binary = snapshot.binary->bytes();
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.version = SNAPSHOT_VERSION;
+    header.word_bits = snapshot.word_bits;
+    header.stack_depth = (uint32_t)snapshot.stack_depth;
+    header.pc = snapshot.pc;
+    header.reg = snapshot.reg;
+    header.resume = snapshot.resume;
+    header.depth = (uint32_t)snapshot.stack.size();
+    header.binary_size = binary.size();
+
+    std::vector<char> out(sizeof(header));
+    auto append = [&](const void* data, size_t size) {
+        out.insert(out.end(), (const char*)data, (const char*)data + size);
+    };
+    append(snapshot.stack.data(), snapshot.stack.size() * sizeof(uint64_t));
+
+    // only pages holding something
+    const uint8_t* memory = snapshot.memory->data();
+    for (uint32_t index = 0; index < snapshot_pages; ++index) {
+        uint8_t page[SNAPSHOT_PAGE] = {};
+        size_t at = (size_t)index * SNAPSHOT_PAGE;
+        memcpy(page, memory + at, std::min<size_t>(SNAPSHOT_PAGE, MEMORY_SIZE + MEMORY_SLACK - at));
+        bool empty = true;
+        for (size_t k = 0; k < SNAPSHOT_PAGE && empty; ++k)
+            empty = page[k] == 0;
+        if (empty)
+            continue;
+        append(&index, sizeof(index));
+        append(page, sizeof(page));
+        ++header.pages;
+    }
+    append(binary.data(), binary.size());
+    memcpy(out.data(), &header, sizeof(header));
+    return write_file(path, span_of(out));
+}
+
+std::shared_ptr<const vm_snapshot> load_snapshot(const std::string& path, const host_functions* host,
+                                                 std::string* error) {
+    auto fail = [&](const std::string& why) -> std::shared_ptr<const vm_snapshot> {
+        if (error)
+            *error = why;
+        return nullptr;
+    };
+    auto file = mapped_file::open(path);
+    if (!file)
+        return fail("Could not read '" + path + "'");
+
+    ByteSpan bytes = file->bytes();
+    SnapshotHeader header;
+    if (bytes.size() < sizeof(header))
+        return fail("'" + path + "' is not a snapshot");
+    memcpy(&header, bytes.data(), sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, 4) != 0)
+        return fail("'" + path + "' is not a snapshot");
+    if (header.version != SNAPSHOT_VERSION)
+        return fail("'" + path + "' is a version " + std::to_string(header.version) + " snapshot");
+    uint64_t page_bytes = (uint64_t)header.pages * (sizeof(uint32_t) + SNAPSHOT_PAGE);
+    if (header.depth > header.stack_depth || header.pages > snapshot_pages ||
+        bytes.size() != sizeof(header) + header.depth * sizeof(uint64_t) + page_bytes + header.binary_size)
+        return fail("'" + path + "' is truncated or damaged");
+
+    auto s = std::make_shared<vm_snapshot>();
+    s->word_bits = header.word_bits;
+    s->stack_depth = header.stack_depth;
+    s->pc = header.pc;
+    s->reg = header.reg;
+    s->resume = header.resume;
+    const char* p = bytes.data() + sizeof(header);
+    s->stack.resize(header.depth);
+    memcpy(s->stack.data(), p, header.depth * sizeof(uint64_t));
+    p += header.depth * sizeof(uint64_t);
+
+    std::vector<uint8_t> memory((size_t)snapshot_pages * SNAPSHOT_PAGE, 0);
+    for (uint32_t k = 0; k < header.pages; ++k) {
+        uint32_t index;
+        memcpy(&index, p, sizeof(index));
+        if (index >= snapshot_pages)
+            return fail("'" + path + "' is truncated or damaged");
+        memcpy(memory.data() + (size_t)index * SNAPSHOT_PAGE, p + sizeof(index), SNAPSHOT_PAGE);
+        p += sizeof(index) + SNAPSHOT_PAGE;
+    }
+    try {
+        s->memory = std::make_shared<memory_image>(memory.data());
+    } catch (const std::bad_alloc&) {
+        return fail("Could not map memory for '" + path + "'");
+    }
+
+    s->binary = mapped_file::copy_of(p, header.binary_size);
+    std::string problem;
+    s->program = s->binary ? load_mvm(p, header.binary_size, s->stack_depth, host, &problem) : nullptr;
+    if (!s->program)
+        return fail("'" + path + "' holds no binary that loads: " + problem);
+    if (s->program->bits() != s->word_bits)
+        return fail("'" + path + "' is truncated or damaged");
+    return s;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "mvm.h"
+
+#define SNAPSHOT_MAGIC      "MVMZ"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_PAGE       4096    // memory is stored a page at a time, zero pages left out
+
+// Header of a snapshot file. The stack follows as 'depth' 64-bit words,
+// deepest first, then 'pages' memory pages each behind its uint32_t index,
+// then the binary the VM was running.
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t word_bits;
+    uint32_t stack_depth;
+    uint64_t pc;
+    uint64_t reg;
+    uint64_t resume;
+    uint32_t depth;
+    uint32_t pages;
+    uint64_t binary_size;
+};
+
+static_assert(sizeof(SnapshotHeader) == 56, "SnapshotHeader layout");
+
+// Everything a VM is between runs, see any_mvm::snapshot. Immutable and
+// shared by every VM restored from it: they attach to 'program' and map
+// 'memory' copy-on-write, so a restore copies only the stack.
+struct vm_snapshot {
+    std::shared_ptr<const any_mvm> program;     // loaded copy of the binary, kept for restores
+    std::shared_ptr<mapped_file> binary;        // what 'program' was loaded from
+    unsigned word_bits;
+    size_t stack_depth;
+    uint64_t pc;
+    uint64_t reg;
+    uint64_t resume;                // index of pc in the decoded code, a hint
+    std::vector<uint64_t> stack;    // deepest first
+    std::shared_ptr<const memory_image> memory;
+};
+
+// A new VM in the state of 'snapshot', nullptr with the reason in 'error' if
+// it can't be restored
+MVM_API std::unique_ptr<any_mvm> fork_mvm(const vm_snapshot& snapshot, std::string* error = nullptr);
+// Writes 'snapshot' with its binary to 'path', replacing it like write_mvmb
+MVM_API bool save_snapshot(const vm_snapshot& snapshot, const std::string& path);
+// Reads a snapshot written by save_snapshot and loads its binary against
+// 'host', or the defaults; nullptr with the reason in 'error' if it can't
+MVM_API std::shared_ptr<const vm_snapshot> load_snapshot(const std::string& path, const host_functions* host = nullptr,
+                                                         std::string* error = nullptr);
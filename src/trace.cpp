@@ -0,0 +1,337 @@
+#include "trace.h"
+
+#include <cstring>
+
+Tracer::~Tracer() {
+    if (!writer)
+        return;
+    hand_over(true);
+    writer.reset();
+    fclose(file);
+}
+
+bool Tracer::record(const std::string& path) {
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    writer = std::make_unique<async_writer>(file);
+    buf.reserve(TRACE_BUFFER + TRACE_PAGE * 2);
+    return true;
+}
+
+bool Tracer::replay(const std::string& path) {
+    trace = mapped_file::open(path);
+    if (!trace || trace->bytes().size() < sizeof(header))
+        return false;
+    ByteSpan bytes = trace->bytes();
+    memcpy(&header, bytes.data(), sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, 4) != 0 || header.version != TRACE_VERSION)
+        return false;
+    at = (const uint8_t*)bytes.data() + sizeof(header);
+    end = (const uint8_t*)bytes.data() + bytes.size();
+    replaying = true;
+    return true;
+}
+
+void Tracer::hand_over(bool now) {
+    if (buf.size() >= TRACE_BUFFER || (now && !buf.empty())) {
+        writer->write(buf.data(), buf.size());
+        buf.clear();
+    }
+}
+
+bool Tracer::get(uint8_t& byte) {
+    if (at == end)
+        return false;
+    byte = *at++;
+    return true;
+}
+
+bool Tracer::get_varint(uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        uint8_t byte;
+        if (!get(byte))
+            return false;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool Tracer::get_signed(int64_t& value) {
+    uint64_t raw;
+    if (!get_varint(raw))
+        return false;
+    value = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+    return true;
+}
+
+bool Tracer::get_pc(uint64_t& pc) {
+    int64_t delta;
+    if (!get_signed(delta))
+        return false;
+    pc = last_pc += delta;
+    return true;
+}
+
+bool Tracer::next_is(TraceRecord tag) {
+    if (at == end || *at != tag)
+        return false;
+    ++at;
+    return true;
+}
+
+bool Tracer::replay_fall(uint64_t taken) {
+    if (!in_branches) {
+        if (!next_is(TRACE_BRANCHES))
+            return false;
+        in_branches = true;
+    }
+    uint64_t recorded;
+    return get_varint(recorded) && recorded == taken + 1;
+}
+
+bool Tracer::end_branches() {
+    if (!in_branches)
+        return true;
+    in_branches = false;
+    if (!replaying) {
+        put(0);
+        return true;
+    }
+    uint8_t end;
+    return get(end) && end == 0;
+}
+
+template <class Word>
+bool basic_mvm<Word>::enable_tracing(std::string trace_path) {
+    auto t = std::make_shared<Tracer>();
+    if (!t->record(trace_path))
+        return false;
+    tracer = t;
+    state_changed = true;
+    return true;
+}
+
+// Loads the binary again with every import bound to a stub, so CALLs of
+// functions this process doesn't have still decode
+template <class Word>
+bool basic_mvm<Word>::enable_replay(std::string trace_path) {
+    auto t = std::make_shared<Tracer>();
+    if (!t->replay(trace_path)) {
+        error = "'" + trace_path + "' is not a trace";
+        return false;
+    }
+    if (program.empty() || t->header.word_bits != word_bits || t->header.binary != content_hash(image.file->bytes())) {
+        error = "'" + trace_path + "' is not a trace of the loaded binary";
+        return false;
+    }
+    tracer = t;
+    return load_image(image, "The binary");
+}
+
+template <class Word>
+void basic_mvm<Word>::record_state() {
+    Tracer& t = *tracer;
+    t.put(TRACE_STATE);
+    t.put_pc(pc);
+    t.put_varint(reg);
+    t.put_varint(sp);
+    for (size_t i = 1; i <= sp; ++i)
+        t.put_varint(stck[i]);
+
+    // the mapping holds whole pages past the slack, see MEMORY_STRIDE
+    const uint8_t* m = memory.data();
+    const size_t pages = (MEMORY_SIZE + MEMORY_SLACK + TRACE_PAGE - 1) / TRACE_PAGE;
+    auto used = [&](size_t index) {
+        for (size_t k = 0; k < TRACE_PAGE; ++k) {
+            if (m[index * TRACE_PAGE + k])
+                return true;
+        }
+        return false;
+    };
+    size_t count = 0;
+    for (size_t index = 0; index < pages; ++index)
+        count += used(index);
+    t.put_varint(count);
+    for (size_t index = 0; index < pages; ++index) {
+        if (!used(index))
+            continue;
+        t.put_varint(index);
+        t.buf.insert(t.buf.end(), (const char*)m + index * TRACE_PAGE, (const char*)m + (index + 1) * TRACE_PAGE);
+        t.hand_over();
+    }
+}
+
+template <class Word>
+bool basic_mvm<Word>::replay_state() {
+    Tracer& t = *tracer;
+    uint64_t recorded_pc, recorded_reg, depth, count;
+    if (!t.get_pc(recorded_pc) || !t.get_varint(recorded_reg) || !t.get_varint(depth) || depth > stack_depth)
+        return false;
+    for (size_t i = 1; i <= depth; ++i) {
+        uint64_t value;
+        if (!t.get_varint(value))
+            return false;
+        stck[i] = (Word)value;
+    }
+    pc = (Word)recorded_pc;
+    reg = (Word)recorded_reg;
+    sp = (size_t)depth;
+    resume = 0;
+
+    memory.clear();
+    const size_t pages = (MEMORY_SIZE + MEMORY_SLACK + TRACE_PAGE - 1) / TRACE_PAGE;
+    if (!t.get_varint(count) || count > pages)
+        return false;
+    for (uint64_t k = 0; k < count; ++k) {
+        uint64_t index;
+        if (!t.get_varint(index) || index >= pages || t.end - t.at < TRACE_PAGE)
+            return false;
+        memcpy(memory.data() + index * TRACE_PAGE, t.at, TRACE_PAGE);
+        t.at += TRACE_PAGE;
+    }
+    return true;
+}
+
+template <class Word>
+const char* basic_mvm<Word>::trace_call(const DecodedInstruction<Word>& insn, Word* args, uint64_t taken,
+                                        bool& yields) {
+    Tracer& t = *tracer;
+    const StackEffect effect = calls[insn.arg].effect;
+    if (!t.replaying) {
+        t.args.assign(args, args + effect.pops);
+        uint8_t flags = 0;
+        try {
+            call_host(insn.arg, args);
+        } catch (std::exception& e) {
+            t.message = e.what();
+            flags = TRACE_CALL_THREW;
+        }
+        if (!running)
+            flags |= TRACE_CALL_STOPPED;
+
+        t.end_branches();
+        t.put(TRACE_CALL);
+        t.put_varint(taken);
+        t.put_pc(insn.pc);
+        t.put_varint((uint64_t)insn.arg << 1 | yields);
+        for (uint64_t a : t.args)
+            t.put_varint(a);
+        t.put(flags);
+        if (flags & TRACE_CALL_THREW) {
+            t.put_varint(t.message.size());
+            t.buf.insert(t.buf.end(), t.message.begin(), t.message.end());
+        } else {
+            for (int i = 0; i < effect.pushes; ++i)
+                t.put_varint(args[i]);
+        }
+        t.hand_over();
+        return flags & TRACE_CALL_THREW ? t.message.c_str() : nullptr;
+    }
+
+    // the same call with the same arguments after the same branches
+    uint64_t recorded, recorded_pc, index;
+    if (!t.end_branches() || !t.next_is(TRACE_CALL) || !t.get_varint(recorded) || recorded != taken ||
+        !t.get_pc(recorded_pc) || recorded_pc != insn.pc || !t.get_varint(index) || index >> 1 != insn.arg)
+        return TRACE_DIVERGED;
+    for (int i = 0; i < effect.pops; ++i) {
+        uint64_t value;
+        if (!t.get_varint(value) || (Word)value != args[i])
+            return TRACE_DIVERGED;
+    }
+    uint8_t flags;
+    if (!t.get(flags))
+        return TRACE_DIVERGED;
+    if (flags & TRACE_CALL_THREW) {
+        uint64_t size;
+        if (!t.get_varint(size) || (uint64_t)(t.end - t.at) < size)
+            return TRACE_DIVERGED;
+        t.message.assign((const char*)t.at, (size_t)size);
+        t.at += size;
+        return t.message.c_str();
+    }
+    for (int i = 0; i < effect.pushes; ++i) {
+        uint64_t value;
+        if (!t.get_varint(value))
+            return TRACE_DIVERGED;
+        args[i] = (Word)value;
+    }
+    yields = index & 1;
+    if (flags & TRACE_CALL_STOPPED)
+        running = 0;
+    return nullptr;
+}
+
+// Every run is framed by a RUN and an END record. Replay runs with the
+// recorded budget, so it yields exactly where the recorded run did, and
+// checks that it ended the same way.
+template <class Word>
+RunStatus basic_mvm<Word>::run_traced(int64_t budget, bool park_sleep) {
+    Tracer& t = *tracer;
+    if (!t.replaying) {
+        if (!t.started) {
+            TraceHeader header = {};
+            memcpy(header.magic, TRACE_MAGIC, 4);
+            header.version = TRACE_VERSION;
+            header.word_bits = word_bits;
+            header.binary = image.file ? content_hash(image.file->bytes()) : 0;
+            t.buf.insert(t.buf.end(), (const char*)&header, (const char*)&header + sizeof(header));
+            t.started = true;
+        }
+        t.put(TRACE_RUN);
+        t.put_signed(budget);
+        t.put(park_sleep);
+        if (state_changed)
+            record_state();
+    } else {
+        uint8_t park;
+        if (!t.next_is(TRACE_RUN) || !t.get_signed(budget) || !t.get(park)) {
+            set_trap(t.at == t.end ? "The trace has no more runs" : TRACE_DIVERGED);
+            return RUN_TRAP;
+        }
+        park_sleep = park != 0;
+        if (t.next_is(TRACE_STATE) && !replay_state()) {
+            set_trap("The trace is damaged");
+            return RUN_TRAP;
+        }
+    }
+    state_changed = false;
+
+    RunStatus status = verified ? execute<PROFILE_TRACE, false>(budget, park_sleep)
+                                : execute<PROFILE_TRACE, true>(budget, park_sleep);
+
+    if (!t.replaying) {
+        t.end_branches();
+        t.put(TRACE_END);
+        t.put_varint(t.taken);
+        t.put((uint8_t)status);
+        t.put_pc(pc);
+        t.put_varint(reg);
+        t.hand_over(true);
+        return status;
+    }
+
+    uint64_t taken, recorded_pc, recorded_reg;
+    uint8_t recorded_status;
+    bool same = t.end_branches() && t.next_is(TRACE_END) && t.get_varint(taken) && t.get(recorded_status) &&
+                t.get_pc(recorded_pc) && t.get_varint(recorded_reg) && taken == t.taken &&
+                recorded_status == status && recorded_pc == pc && recorded_reg == reg;
+    if (!same) {
+        // a trap already says where replay left the trace
+        if (status != RUN_TRAP)
+            set_trap(TRACE_DIVERGED);
+        return RUN_TRAP;
+    }
+    return status;
+}
+
+#define INSTANTIATE(W)                                                          \
+    template bool basic_mvm<W>::enable_tracing(std::string);                   \
+    template bool basic_mvm<W>::enable_replay(std::string);                    \
+    template RunStatus basic_mvm<W>::run_traced(int64_t, bool);                \
+    template const char* basic_mvm<W>::trace_call(const DecodedInstruction<W>&, W*, uint64_t, bool&);
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "mvm.h"
+#include "output.h"
+
+#define TRACE_MAGIC         "MVMT"
+#define TRACE_VERSION       1
+#define TRACE_BUFFER        (64 << 10)  // bytes a VM collects before handing them to the writer thread
+#define TRACE_PAGE          4096        // memory goes into a trace a page at a time, zero pages left out
+#define TRACE_DIVERGED      "Replay diverged from the trace"
+
+// How a traced CALL ended
+#define TRACE_CALL_STOPPED  1       // the function called stop()
+#define TRACE_CALL_THREW    2       // an exception's message follows instead of the results
+
+// A trace is this header and then records, each a tag and its fields as
+// LEB128 varints, signed ones zigzagged. A pc is a delta from the one last
+// recorded. Conditional branch outcomes are run lengths: how many jumps
+// were taken before each fall-through, and before each CALL and the end of
+// a run, so a loop costs a varint per exit rather than a bit per pass.
+struct TraceHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t word_bits;
+    uint32_t reserved;
+    uint64_t binary;        // content_hash of the traced .mvmb
+};
+
+static_assert(sizeof(TraceHeader) == 24, "TraceHeader layout");
+
+enum TraceRecord : uint8_t {
+    TRACE_RUN = 1,          // budget, park_sleep: run() was called
+    TRACE_STATE,            // pc, R0, depth, the stack, pages, each page's index and bytes: the host set the state
+    TRACE_BRANCHES,         // taken + 1 for each fall-through, then 0
+    TRACE_CALL,             // taken, pc, index << 1 | yields, arguments, flags, results or the exception
+    TRACE_END,              // taken, status, pc, R0: run() returned
+};
+
+// Trace of one VM, see any_mvm::enable_tracing. The tracing instantiation
+// of mvm::execute counts taken jumps in a register and only calls in here
+// when one falls through; records collect in 'buf', which goes to a writer
+// thread over async_writer's lock-free ring once it fills or a run ends, so
+// the VM never waits on the file. Replaying reads the same records back
+// from a mapping of the file.
+struct Tracer {
+    bool replaying = false;
+    uint64_t taken = 0;                     // where the last run() ended
+    uint64_t last_pc = 0;
+    bool in_branches = false;               // a TRACE_BRANCHES record is open
+
+    // recording
+    FILE* file = nullptr;
+    std::unique_ptr<async_writer> writer;
+    std::vector<char> buf;
+    bool started = false;                   // header written
+    std::vector<uint64_t> args;             // of the CALL in flight, the call overwrites them
+    std::string message;                    // of the last host function that threw
+
+    // replaying
+    std::shared_ptr<mapped_file> trace;
+    const uint8_t* at = nullptr;
+    const uint8_t* end = nullptr;
+    TraceHeader header = {};
+
+    ~Tracer();
+
+    // false if 'path' can't be created, or read as a trace
+    bool record(const std::string& path);
+    bool replay(const std::string& path);
+
+    void put(uint8_t byte) { buf.push_back((char)byte); }
+    void put_varint(uint64_t value) {
+        while (value >= 0x80) {
+            buf.push_back((char)(value | 0x80));
+            value >>= 7;
+        }
+        buf.push_back((char)value);
+    }
+    void put_signed(int64_t value) { put_varint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63)); }
+    void put_pc(uint64_t pc) {
+        put_signed((int64_t)(pc - last_pc));
+        last_pc = pc;
+    }
+    // hands 'buf' to the writer once it is full, or always if 'now'
+    void hand_over(bool now = false);
+
+    // false if the trace ends first
+    bool get(uint8_t& byte);
+    bool get_varint(uint64_t& value);
+    bool get_signed(int64_t& value);
+    bool get_pc(uint64_t& pc);
+    // consumes the next record's tag if it is 'tag'
+    bool next_is(TraceRecord tag);
+
+    // A conditional jump fell through after 'taken' were: recorded, or
+    // checked against the trace, false if it doesn't match
+    bool fell_through(uint64_t taken) {
+        if (replaying)
+            return replay_fall(taken);
+        if (!in_branches) {
+            put(TRACE_BRANCHES);
+            in_branches = true;
+        }
+        put_varint(taken + 1);
+        if (buf.size() >= TRACE_BUFFER)
+            hand_over();
+        return true;
+    }
+    bool replay_fall(uint64_t taken);
+    // Ends the open TRACE_BRANCHES record before any other, false if
+    // replay expected more fall-throughs
+    bool end_branches();
+};
@@ -0,0 +1,266 @@
+#include "vector.h"
+
+#include <algorithm>
+
+#ifdef MVM_VECTOR_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Element-wise operators over two uint16 sources, widened so nothing is UB
+#define MVM_VECTOR_BINARY(X)    X(VADD, x + y) X(VSUB, x - y) X(VMUL, x * y)                   \
+                                X(VAND, x & y) X(VOR, x | y) X(VXOR, x ^ y)                     \
+                                X(VEQ, x == y ? 0xFFFF : 0) X(VLT, x < y ? 0xFFFF : 0)          \
+                                X(VGT, x > y ? 0xFFFF : 0)
+static_assert(VGT - VADD == 8, "element-wise opcodes out of order");
+
+static inline uint16_t get(const uint8_t* p, size_t i) {
+    uint16_t v;
+    memcpy(&v, p + 2 * i, sizeof(v));
+    return v;
+}
+static inline void put(uint8_t* p, size_t i, uint16_t v) {
+    memcpy(p + 2 * i, &v, sizeof(v));
+}
+
+static void scalar_binary(OpCode op, uint8_t* dst, const uint8_t* px, const uint8_t* py, size_t n) {
+    switch (op) {
+#define SCALAR(o, expr)     case o:                                             \
+                                for (size_t i = 0; i < n; ++i) {                \
+                                    uint32_t x = get(px, i), y = get(py, i);    \
+                                    put(dst, i, (uint16_t)(expr));              \
+                                }                                               \
+                                break;
+        MVM_VECTOR_BINARY(SCALAR)
+#undef SCALAR
+        default:
+            break;
+    }
+}
+static void scalar_fill(uint8_t* dst, uint16_t value, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        put(dst, i, value);
+}
+static uint64_t scalar_sum(const uint8_t* src, size_t n) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; ++i)
+        total += get(src, i);
+    return total;
+}
+static uint16_t scalar_min(const uint8_t* src, size_t n) {
+    uint16_t best = UINT16_MAX;
+    for (size_t i = 0; i < n; ++i)
+        best = std::min(best, get(src, i));
+    return best;
+}
+static uint16_t scalar_max(const uint8_t* src, size_t n) {
+    uint16_t best = 0;
+    for (size_t i = 0; i < n; ++i)
+        best = std::max(best, get(src, i));
+    return best;
+}
+
+static const VectorKernels scalar = { "scalar", scalar_binary, scalar_fill, scalar_sum, scalar_min, scalar_max };
+
+const VectorKernels& scalar_kernels() {
+    return scalar;
+}
+
+#ifdef MVM_VECTOR_X86
+
+// MSVC takes any intrinsic anywhere, GCC and clang only in functions
+// compiled for the instruction set
+#if defined(__GNUC__) || defined(__clang__)
+#define MVM_TARGET_AVX2     __attribute__((target("avx2")))
+#else
+#define MVM_TARGET_AVX2
+#endif
+
+// The same kernels for every vector width: V is the register type, P the
+// intrinsic prefix and SI the suffix of its whole-register operations. Each
+// kernel runs whole registers and leaves the tail to the scalar one. There
+// are no unsigned 16-bit compares, so those flip the sign bit first.
+#define SIMD_LANES(V)       (sizeof(V) / sizeof(uint16_t))
+#define SIMD_LOOP(V, P, SI, expr)                                               \
+    for (; i + SIMD_LANES(V) <= n; i += SIMD_LANES(V)) {                        \
+        V a = P##loadu_##SI((const V*)(px + 2 * i));                            \
+        V b = P##loadu_##SI((const V*)(py + 2 * i));                            \
+        P##storeu_##SI((V*)(dst + 2 * i), expr);                                \
+    }                                                                           \
+    break;
+#define SIMD_REDUCE(isa, ATTR, name, V, P, SI, init, pick)                      \
+    ATTR static uint16_t isa##_##name(const uint8_t* src, size_t n) {           \
+        V bias = P##set1_epi16((short)0x8000);                                  \
+        V best = P##set1_epi16((short)(init));                                  \
+        size_t i = 0;                                                           \
+        for (; i + SIMD_LANES(V) <= n; i += SIMD_LANES(V)) {                    \
+            V v = P##loadu_##SI((const V*)(src + 2 * i));                       \
+            best = P##pick##_epi16(best, P##xor_##SI(v, bias));                 \
+        }                                                                       \
+        uint16_t lanes[SIMD_LANES(V)];                                          \
+        P##storeu_##SI((V*)lanes, best);                                        \
+        uint16_t result = scalar_##name(src + 2 * i, n - i);                    \
+        for (uint16_t lane : lanes)                                             \
+            result = std::pick<uint16_t>(result, lane ^ 0x8000);               \
+        return result;                                                          \
+    }
+#define SIMD_KERNELS(isa, ATTR, V, P, SI)                                       \
+    ATTR static void isa##_binary(OpCode op, uint8_t* dst, const uint8_t* px,   \
+                                  const uint8_t* py, size_t n) {                \
+        V bias = P##set1_epi16((short)0x8000);                                  \
+        size_t i = 0;                                                           \
+        switch (op) {                                                           \
+            case VADD: SIMD_LOOP(V, P, SI, P##add_epi16(a, b))                  \
+            case VSUB: SIMD_LOOP(V, P, SI, P##sub_epi16(a, b))                  \
+            case VMUL: SIMD_LOOP(V, P, SI, P##mullo_epi16(a, b))                \
+            case VAND: SIMD_LOOP(V, P, SI, P##and_##SI(a, b))                   \
+            case VOR:  SIMD_LOOP(V, P, SI, P##or_##SI(a, b))                    \
+            case VXOR: SIMD_LOOP(V, P, SI, P##xor_##SI(a, b))                   \
+            case VEQ:  SIMD_LOOP(V, P, SI, P##cmpeq_epi16(a, b))                \
+            case VLT:  SIMD_LOOP(V, P, SI, P##cmpgt_epi16(P##xor_##SI(b, bias), \
+                                                          P##xor_##SI(a, bias)))\
+            case VGT:  SIMD_LOOP(V, P, SI, P##cmpgt_epi16(P##xor_##SI(a, bias), \
+                                                          P##xor_##SI(b, bias)))\
+            default:   break;                                                   \
+        }                                                                       \
+        scalar_binary(op, dst + 2 * i, px + 2 * i, py + 2 * i, n - i);          \
+    }                                                                           \
+    ATTR static void isa##_fill(uint8_t* dst, uint16_t value, size_t n) {       \
+        V v = P##set1_epi16((short)value);                                      \
+        size_t i = 0;                                                           \
+        for (; i + SIMD_LANES(V) <= n; i += SIMD_LANES(V))                      \
+            P##storeu_##SI((V*)(dst + 2 * i), v);                               \
+        scalar_fill(dst + 2 * i, value, n - i);                                 \
+    }                                                                           \
+    /* 32-bit lanes can't overflow, a range is at most 32 Ki elements */        \
+    ATTR static uint64_t isa##_sum(const uint8_t* src, size_t n) {              \
+        V zero = P##setzero_##SI();                                             \
+        V acc = zero;                                                           \
+        size_t i = 0;                                                           \
+        for (; i + SIMD_LANES(V) <= n; i += SIMD_LANES(V)) {                    \
+            V v = P##loadu_##SI((const V*)(src + 2 * i));                       \
+            acc = P##add_epi32(acc, P##add_epi32(P##unpacklo_epi16(v, zero),    \
+                                                 P##unpackhi_epi16(v, zero)));  \
+        }                                                                       \
+        uint32_t lanes[sizeof(V) / sizeof(uint32_t)];                           \
+        P##storeu_##SI((V*)lanes, acc);                                         \
+        uint64_t total = scalar_sum(src + 2 * i, n - i);                        \
+        for (uint32_t lane : lanes)                                             \
+            total += lane;                                                      \
+        return total;                                                           \
+    }                                                                           \
+    SIMD_REDUCE(isa, ATTR, min, V, P, SI, 0x7FFF, min)                          \
+    SIMD_REDUCE(isa, ATTR, max, V, P, SI, 0x8000, max)
+
+SIMD_KERNELS(sse2, , __m128i, _mm_, si128)
+SIMD_KERNELS(avx2, MVM_TARGET_AVX2, __m256i, _mm256_, si256)
+
+static const VectorKernels sse2 = { "sse2", sse2_binary, sse2_fill, sse2_sum, sse2_min, sse2_max };
+static const VectorKernels avx2 = { "avx2", avx2_binary, avx2_fill, avx2_sum, avx2_min, avx2_max };
+
+// AVX2 also needs the OS to save the upper halves of the registers
+static bool cpu_has_avx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+const VectorKernels& vector_kernels() {
+    static const VectorKernels& best = cpu_has_avx2() ? avx2 : sse2;
+    return best;
+}
+
+#else
+
+const VectorKernels& vector_kernels() {
+    return scalar;
+}
+
+#endif
+
+// elements at 'address' before one would start past the end of memory
+static size_t contiguous(uint64_t address) {
+    return (MEMORY_SIZE - (address & MEMORY_MASK) + 1) / 2;
+}
+
+// partially overlapping ranges have to run one element at a time, in order
+static bool overlaps(uint64_t dst, uint64_t src, size_t n) {
+    return dst != src && dst < src + 2 * n && src < dst + 2 * n;
+}
+
+// Splits every operation at the points where one of its ranges wraps, so a
+// kernel only ever sees contiguous memory.
+uint64_t run_vector_op(uint8_t* memory, OpCode op, const uint64_t* args) {
+    const VectorKernels& k = vector_kernels();
+    switch (op) {
+        case MFILL: {
+            uint64_t dst = args[0];
+            for (size_t count = args[2] & MEMORY_MASK; count;) {
+                size_t n = std::min(count, contiguous(dst));
+                k.fill(memory + (dst & MEMORY_MASK), (uint16_t)args[1], n);
+                dst += 2 * n;
+                count -= n;
+            }
+            return 0;
+        }
+        case MCOPY: {
+            // as if through a buffer, however the ranges overlap
+            uint64_t dst = args[0] & MEMORY_MASK, src = args[1] & MEMORY_MASK;
+            size_t count = args[2] & MEMORY_MASK;
+            if (count <= contiguous(dst) && count <= contiguous(src)) {
+                memmove(memory + dst, memory + src, 2 * count);
+                return 0;
+            }
+            std::vector<uint16_t> buffer(count);
+            for (size_t i = 0; i < count; ++i)
+                buffer[i] = load_word<uint16_t>(memory, src + 2 * i);
+            for (size_t i = 0; i < count; ++i)
+                store_word<uint16_t>(memory, dst + 2 * i, buffer[i]);
+            return 0;
+        }
+        case VSUM: case VMIN: case VMAX: {
+            uint64_t src = args[0];
+            uint64_t total = 0;
+            uint16_t best = op == VMIN ? UINT16_MAX : 0;
+            for (size_t count = args[1] & MEMORY_MASK; count;) {
+                size_t n = std::min(count, contiguous(src));
+                const uint8_t* p = memory + (src & MEMORY_MASK);
+                if (op == VSUM)
+                    total += k.sum(p, n);
+                else if (op == VMIN)
+                    best = std::min(best, k.min(p, n));
+                else
+                    best = std::max(best, k.max(p, n));
+                src += 2 * n;
+                count -= n;
+            }
+            return op == VSUM ? total : best;
+        }
+        default: {
+            uint64_t dst = args[0], x = args[1], y = args[2];
+            for (size_t count = args[3] & MEMORY_MASK; count;) {
+                size_t n = std::min({ count, contiguous(dst), contiguous(x), contiguous(y) });
+                uint64_t d = dst & MEMORY_MASK, a = x & MEMORY_MASK, b = y & MEMORY_MASK;
+                const VectorKernels& kernels = overlaps(d, a, n) || overlaps(d, b, n) ? scalar : k;
+                kernels.binary(op, memory + d, memory + a, memory + b, n);
+                dst += 2 * n;
+                x += 2 * n;
+                y += 2 * n;
+                count -= n;
+            }
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "mvm.h"
+
+// x86 has SSE2 everywhere and AVX2 on most machines, see vector_kernels
+#if defined(__x86_64__) || defined(_M_X64)
+#define MVM_VECTOR_X86
+#endif
+
+// Kernels over guest memory for one instruction set. Pointers are byte
+// pointers, elements are little-endian uint16 at any alignment and n counts
+// elements; ranges never run past the end of memory.
+struct VectorKernels {
+    const char* isa;
+    // VADD ... VGT, dst may be x or y but mustn't overlap them otherwise
+    void (*binary)(OpCode op, uint8_t* dst, const uint8_t* x, const uint8_t* y, size_t n);
+    void (*fill)(uint8_t* dst, uint16_t value, size_t n);
+    uint64_t (*sum)(const uint8_t* src, size_t n);
+    uint16_t (*min)(const uint8_t* src, size_t n);
+    uint16_t (*max)(const uint8_t* src, size_t n);
+};
+
+// the best kernels the CPU runs, picked by CPUID on first use
+const VectorKernels& vector_kernels();
+// plain C++ kernels, what vector_kernels falls back to
+const VectorKernels& scalar_kernels();
+
+// Runs a bulk memory or vector opcode on its stack operands, deepest first,
+// and returns the result of a reduction. Addresses and the element count wrap
+// at 64 KiB like every other memory access.
+uint64_t run_vector_op(uint8_t* memory, OpCode op, const uint64_t* args);
+
+template <class Word>
+inline Word vector_op(uint8_t* memory, OpCode op, const Word* operands) {
+    uint64_t args[4];
+    for (int i = 0; i < stack_effect(op).pops; ++i)
+        args[i] = operands[i];
+    return (Word)run_vector_op(memory, op, args);
+}
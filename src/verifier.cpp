@@ -0,0 +1,100 @@
+#include "mvm.h"
+
+#include <algorithm>
+
+static const char* trap_message(uint64_t reason) {
+    switch (reason) {
+        case TRAP_INVALID_OPCODE:       return "invalid opcode";
+        case TRAP_TRUNCATED_OPERAND:    return "truncated operand";
+        case TRAP_INVALID_JUMP:         return "jump into the middle of an instruction or past the end";
+        case TRAP_INVALID_CALL:         return "CALL of a function that isn't bound, or is bound with another signature";
+        default:                        return "trap";
+    }
+}
+
+// Runs over the decoded program, so malformed bytes have already become TRAP
+// instructions; any of those fails the whole program, reachable or not. The
+// stack depth is then followed from the entry point along every path, the
+// same way translate_registers does, but a mismatch is an error here.
+template <class Word>
+bool basic_mvm<Word>::verify(std::string& error) {
+    max_depth = 0;
+    if (code.empty())
+        return false;
+
+    auto fail = [&](size_t i, const std::string& what) {
+        error = "pc " + std::to_string(code[i].pc);
+        if (uint32_t line = source_line(code[i].pc))
+            error += " (line " + std::to_string(line) + ")";
+        error += ": " + what;
+        return false;
+    };
+
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].opcode == TRAP)
+            return fail(i, trap_message(code[i].arg));
+    }
+
+    // execution starts wherever load() left pc with an empty stack
+    size_t entry = 0;
+    while (code[entry].pc != pc && code[entry].opcode != EXIT)
+        ++entry;
+
+    std::vector<int> depth(code.size(), -1);
+    std::vector<uint32_t> worklist = { (uint32_t)entry };
+    depth[entry] = 0;
+    size_t bad = SIZE_MAX;
+    int expected = 0;
+    auto reach = [&](uint32_t to, int d) {
+        if (depth[to] < 0) {
+            depth[to] = d;
+            worklist.push_back(to);
+        } else if (depth[to] != d && bad == SIZE_MAX) {
+            bad = to;
+            expected = d;
+        }
+    };
+    while (!worklist.empty() && bad == SIZE_MAX) {
+        uint32_t i = worklist.back();
+        worklist.pop_back();
+
+        // superinstructions behave exactly like the sequence they stand for,
+        // whose other instructions follow as usual
+        OpCode op = unfused_opcode(code[i].opcode);
+        auto effect = effect_of(code[i]);
+        int d = depth[i];
+        if (d < effect.pops)
+            return fail(i, "stack underflow, depth " + std::to_string(d));
+        if (d - effect.pops + effect.pushes > (int)stack_depth)
+            return fail(i, "stack overflow, depth " + std::to_string(d) + " of " + std::to_string(stack_depth));
+        max_depth = std::max<size_t>(max_depth, d - effect.pops + effect.pushes);
+        d += effect.pushes - effect.pops;
+
+        switch (op) {
+            case JMP:
+                reach(code[i].target, d);
+                break;
+            case JMPZ: case JMPNZ:
+                // the value is only popped when the jump is taken
+                reach(code[i].target, d);
+                reach(i + 1, d + 1);
+                break;
+            case EXIT:
+                break;
+            default:
+                // HALT too, a halted VM can be started again after it
+                reach(i + 1, d);
+                break;
+        }
+    }
+    if (bad != SIZE_MAX) {
+        return fail(bad, "stack depth " + std::to_string(depth[bad]) + " on one path and " + std::to_string(expected) +
+                         " on another");
+    }
+    return true;
+}
+
+#define INSTANTIATE(W)                                                          \
+    template bool basic_mvm<W>::verify(std::string&);
+MVM_WORD_TYPES(INSTANTIATE)
+#undef INSTANTIATE
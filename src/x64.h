@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Minimal x86-64 machine code encoder, covering only the instruction forms
+// the native backends need. Registers use their hardware numbers.
+enum X64Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+enum X64Cond {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5,
+    CC_BE = 0x6, CC_A = 0x7,
+};
+
+// group 1 ALU operations, as both the /r opcode and the /digit extension
+enum X64Alu {
+    ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7,
+};
+
+class X64Emitter {
+public:
+    std::vector<uint8_t> buf;
+
+    size_t size() const { return buf.size(); }
+
+    void byte(uint8_t b) { buf.push_back(b); }
+    void word(uint16_t v) { bytes(&v, sizeof(v)); }
+    void dword(uint32_t v) { bytes(&v, sizeof(v)); }
+    void qword(uint64_t v) { bytes(&v, sizeof(v)); }
+    void bytes(const void* p, size_t n) {
+        buf.insert(buf.end(), (const uint8_t*)p, (const uint8_t*)p + n);
+    }
+
+    // patch a rel32 written at 'at' so it lands on 'target'
+    void patch_rel32(size_t at, size_t target) {
+        int32_t rel = (int32_t)(target - (at + 4));
+        memcpy(&buf[at], &rel, 4);
+    }
+
+    void mov_r32_imm(int dst, uint32_t imm) { rex(0, 0, dst, false); byte(0xB8 + (dst & 7)); dword(imm); }
+    void mov_r64_imm(int dst, uint64_t imm) { rex(1, 0, dst, true); byte(0xB8 + (dst & 7)); qword(imm); }
+    void mov_r64_r64(int dst, int src) { rex(1, src, dst, true); byte(0x89); modrm_reg(src, dst); }
+    void mov_r32_r32(int dst, int src) { rex(0, src, dst, false); byte(0x89); modrm_reg(src, dst); }
+    void mov_r64_m(int dst, int base, int32_t disp) { rex(1, dst, base, true); byte(0x8B); modrm_mem(dst, base, disp); }
+    void mov_m64_r(int base, int32_t disp, int src) { rex(1, src, base, true); byte(0x89); modrm_mem(src, base, disp); }
+    void mov_m32_r(int base, int32_t disp, int src) { rex(0, src, base, false); byte(0x89); modrm_mem(src, base, disp); }
+    void mov_m16_r(int base, int32_t disp, int src) { byte(0x66); rex(0, src, base, false); byte(0x89); modrm_mem(src, base, disp); }
+    void mov_m8_r(int base, int32_t disp, int src) { rex(0, src, base, false, true); byte(0x88); modrm_mem(src, base, disp); }
+    void mov_m8_imm(int base, int32_t disp, uint8_t imm) { rex(0, 0, base, false); byte(0xC6); modrm_mem(0, base, disp); byte(imm); }
+    void mov_m16_imm(int base, int32_t disp, uint16_t imm) { byte(0x66); rex(0, 0, base, false); byte(0xC7); modrm_mem(0, base, disp); word(imm); }
+    void mov_m32_imm(int base, int32_t disp, uint32_t imm) { rex(0, 0, base, false); byte(0xC7); modrm_mem(0, base, disp); dword(imm); }
+    void mov_m64_imm(int base, int32_t disp, int32_t imm) { rex(1, 0, base, false); byte(0xC7); modrm_mem(0, base, disp); dword((uint32_t)imm); }
+    void movzx_r32_m16(int dst, int base, int32_t disp) { rex(0, dst, base, false); byte(0x0F); byte(0xB7); modrm_mem(dst, base, disp); }
+    void movzx_r32_m8(int dst, int base, int32_t disp) { rex(0, dst, base, false); byte(0x0F); byte(0xB6); modrm_mem(dst, base, disp); }
+    void movzx_r32_r16(int dst, int src) { rex(0, dst, src, false); byte(0x0F); byte(0xB7); modrm_reg(dst, src); }
+    void movzx_r32_r8(int dst, int src) { rex(0, dst, src, true, true); byte(0x0F); byte(0xB6); modrm_reg(dst, src); }
+    void lea_r64_m(int dst, int base, int32_t disp) { rex(1, dst, base, true); byte(0x8D); modrm_mem(dst, base, disp); }
+
+    void alu_r32_r32(X64Alu op, int dst, int src) { rex(0, src, dst, false); byte((uint8_t)(op << 3 | 1)); modrm_reg(src, dst); }
+    void alu_r64_r64(X64Alu op, int dst, int src) { rex(1, src, dst, true); byte((uint8_t)(op << 3 | 1)); modrm_reg(src, dst); }
+    void alu_r32_imm(X64Alu op, int dst, uint32_t imm) { rex(0, 0, dst, false); byte(0x81); modrm_reg(op, dst); dword(imm); }
+    void alu_r64_imm8(X64Alu op, int dst, int8_t imm) { rex(1, 0, dst, true); byte(0x83); modrm_reg(op, dst); byte((uint8_t)imm); }
+    void alu_r64_m(X64Alu op, int dst, int base, int32_t disp) { rex(1, dst, base, true); byte((uint8_t)(op << 3 | 3)); modrm_mem(dst, base, disp); }
+    void cmp_m8_imm(int base, int32_t disp, uint8_t imm) { rex(0, 0, base, false); byte(0x80); modrm_mem(7, base, disp); byte(imm); }
+    void test_r32_r32(int a, int b) { rex(0, b, a, false); byte(0x85); modrm_reg(b, a); }
+    void imul_r32_r32(int dst, int src) { rex(0, dst, src, false); byte(0x0F); byte(0xAF); modrm_reg(dst, src); }
+    void div_r32(int src) { rex(0, 0, src, false); byte(0xF7); modrm_reg(6, src); }
+    void not_r32(int dst) { rex(0, 0, dst, false); byte(0xF7); modrm_reg(2, dst); }
+    void shl_r64_imm(int dst, uint8_t n) { rex(1, 0, dst, true); byte(0xC1); modrm_reg(4, dst); byte(n); }
+    void shr_r64_imm(int dst, uint8_t n) { rex(1, 0, dst, true); byte(0xC1); modrm_reg(5, dst); byte(n); }
+    void setcc_r8(X64Cond cc, int dst) { rex(0, 0, dst, true, true); byte(0x0F); byte((uint8_t)(0x90 + cc)); modrm_reg(0, dst); }
+
+    void push_r64(int r) { if (r & 8) byte(0x41); byte((uint8_t)(0x50 + (r & 7))); }
+    void pop_r64(int r) { if (r & 8) byte(0x41); byte((uint8_t)(0x58 + (r & 7))); }
+    void call_r64(int r) { if (r & 8) byte(0x41); byte(0xFF); modrm_reg(2, r); }
+    void jmp_r64(int r) { if (r & 8) byte(0x41); byte(0xFF); modrm_reg(4, r); }
+    void syscall() { byte(0x0F); byte(0x05); }
+    void ret() { byte(0xC3); }
+
+    // branches return the offset of their rel32 so callers can patch it
+    size_t jmp_rel32(size_t target = 0) { byte(0xE9); return rel32(target); }
+    size_t call_rel32(size_t target = 0) { byte(0xE8); return rel32(target); }
+    size_t jcc_rel32(X64Cond cc, size_t target = 0) { byte(0x0F); byte((uint8_t)(0x80 + cc)); return rel32(target); }
+
+private:
+    size_t rel32(size_t target) {
+        size_t at = size();
+        dword(0);
+        if (target)
+            patch_rel32(at, target);
+        return at;
+    }
+
+    // byte_regs forces a REX prefix so registers 4-7 mean spl..dil, not ah..bh
+    void rex(int w, int reg, int rm, bool rm_is_reg, bool byte_regs = false) {
+        uint8_t r = (uint8_t)(0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+        if (r != 0x40 || (byte_regs && ((reg & 7) >= 4 || (rm_is_reg && (rm & 7) >= 4))))
+            byte(r);
+    }
+    void modrm_reg(int reg, int rm) { byte((uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7))); }
+    void modrm_mem(int reg, int base, int32_t disp) {
+        // rbp/r13 have no disp-less form, rsp/r12 need a SIB byte
+        uint8_t mod = disp == 0 && (base & 7) != RBP ? 0x00 : (disp >= -128 && disp <= 127 ? 0x40 : 0x80);
+        byte((uint8_t)(mod | (reg & 7) << 3 | (base & 7)));
+        if ((base & 7) == RSP)
+            byte(0x24);
+        if (mod == 0x40)
+            byte((uint8_t)disp);
+        else if (mod == 0x80)
+            dword((uint32_t)disp);
+    }
+};